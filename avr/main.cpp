@@ -0,0 +1,306 @@
+/*
+ * Written in the end of April 2020 by Niklas Ekström.
+ * Updated in July 2021 by Niklas Ekström to handle Card Present signal.
+ * Updated in October 2026 to use the protocol engine shared with the RP2040.
+ */
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "engine.hpp"
+
+// Par  P-name  Arduino AVR     SD      Name    Description
+// 2    D0      A0      PC0                     Parallel port data lines
+// 3    D1      A1      PC1
+// 4    D2      A2      PC2
+// 5    D3      A3      PC3
+// 6    D4      A4      PC4
+// 7    D5      A5      PC5
+// 8    D6      D6      PD6
+// 9    D7      D7      PD7
+// 10   ACK     D9      PB1             IRQ     Interrupt request to Amiga
+// 11   BUSY    D4      PD4             ACT     Indicate command running
+// 12   POUT    D5      PD5             CLK     Clock to advance command
+// 13   SEL     D2      PD2             REQ     Amiga wants to execute command
+//              D3      PD3     CD      CP      Card Present
+//              D10     PB2     SS
+//              D11     PB3     MOSI
+//              D12     PB4     MISO
+//              D13     PB5     SCK
+//
+// With AVR_SPI_USART set, the SPI is done by USART0 in Master SPI mode
+// instead, whose transmitter is double buffered. Its clock pin XCK0 is PD4,
+// so ACT moves to PB0, and MOSI and MISO move to TXD0 and RXD0:
+//
+// 11   BUSY    D8      PB0             ACT
+//              D4      PD4     SCK
+//              D1      PD1     MOSI
+//              D0      PD0     MISO
+
+// Reported by GET_CAPS, major << 8 | minor.
+#define FIRMWARE_VERSION_AVR    0x0200
+
+#ifndef AVR_SPI_USART
+#define AVR_SPI_USART   0
+#endif
+
+// Pins in port B.
+#define SCK_BIT         5 // Output.
+#define MISO_BIT        4 // Input.
+#define MOSI_BIT        3 // Output.
+#define SS_BIT_n        2 // Output, active low.
+#define IRQ_BIT_n       1 // Output, active low, open collector.
+
+// Pins in port D.
+#define CLK_BIT         5 // Input.
+#define CP_BIT_n        3 // Input, active low, internal pull-up enabled.
+#define REQ_BIT_n       2 // Input, active low, internal pull-up enabled.
+
+#if AVR_SPI_USART
+
+#define XCK_BIT         4 // Output, USART0 clock.
+
+#define ACT_PORT        PORTB
+#define ACT_BIT_n       0 // Output, active low.
+
+// Outputs in port D other than the data lines, and their idle levels.
+#define PORTD_OUTPUTS   (1 << XCK_BIT)
+#define PORTD_IDLE      ((1 << CP_BIT_n) | (1 << REQ_BIT_n))
+
+// USART0 baud rate register values, fosc/(2*(UBRR0+1)).
+#define UBRR_FAST       0   // 8 MHz
+#define UBRR_SLOW       31  // 250 kHz
+
+#else
+
+#define ACT_PORT        PORTD
+#define ACT_BIT_n       4 // Output, active low.
+
+#define PORTD_OUTPUTS   (1 << ACT_BIT_n)
+#define PORTD_IDLE      ((1 << ACT_BIT_n) | (1 << CP_BIT_n) | (1 << REQ_BIT_n))
+
+#endif
+
+// Platform policy for protocol::Engine. The data lines are split over
+// PD7-PD6 and PC5-PC0, and CLK is sampled in port D.
+struct Avr : protocol::PlatformDefaults {
+    using pins_t = uint8_t;
+    using count_t = uint16_t;
+
+    static constexpr uint8_t FIRMWARE_ID = CAPS_FIRMWARE_AVR;
+    static constexpr uint16_t FIRMWARE_VERSION = FIRMWARE_VERSION_AVR;
+    static constexpr uint16_t SPI_FAST_KHZ = 8000;
+    static constexpr uint16_t SPI_SLOW_KHZ = 250;
+    static constexpr uint16_t BUFFER_SIZE = 512;
+
+    // A request is abandoned by the INT0 handler when REQ is released,
+    // so the loops don't have to look at REQ.
+    static constexpr bool POLL_REQ = false;
+
+    static PROTOCOL_INLINE pins_t sample() { return PIND; }
+    static PROTOCOL_INLINE pins_t clk(pins_t pins) { return pins & (1 << CLK_BIT); }
+    static PROTOCOL_INLINE bool req_released(pins_t pins) { return pins & (1 << REQ_BIT_n); }
+    static PROTOCOL_INLINE uint8_t data(pins_t pins) { return (pins & 0xc0) | PINC; }
+
+    static PROTOCOL_INLINE void act() { ACT_PORT &= ~(1 << ACT_BIT_n); }
+    static PROTOCOL_INLINE void act_release() { ACT_PORT |= (1 << ACT_BIT_n); }
+
+#if AVR_SPI_USART
+    // The transmitter takes a second byte while the first one is shifting,
+    // and the receiver holds two bytes. TXC0 is cleared after every byte
+    // written, so that it is set when all of them have been shifted out.
+    static constexpr bool SPI_BUFFERED = true;
+
+    static PROTOCOL_INLINE void spi_start(uint8_t value) {
+        while (!(UCSR0A & (1 << UDRE0)))
+            ;
+        UDR0 = value;
+        UCSR0A = (1 << TXC0);
+    }
+
+    static PROTOCOL_INLINE uint8_t spi_data() { return UDR0; }
+
+    static PROTOCOL_INLINE void spi_wait() {
+        while (!(UCSR0A & (1 << RXC0)))
+            ;
+    }
+
+    static PROTOCOL_INLINE void spi_idle() {
+        while (!(UCSR0A & (1 << TXC0)))
+            ;
+    }
+
+    // Lets the last bytes of a write finish and drops what they received.
+    static PROTOCOL_INLINE void spi_begin() {
+        spi_idle();
+        while (UCSR0A & (1 << RXC0))
+            (void)UDR0;
+    }
+
+    static PROTOCOL_INLINE void select(bool sel) {
+        spi_idle();
+        if (sel)
+            PORTB &= ~(1 << SS_BIT_n);
+        else
+            PORTB |= (1 << SS_BIT_n);
+    }
+
+    static PROTOCOL_INLINE void set_speed(bool fast) {
+        spi_idle();
+        UBRR0 = fast ? UBRR_FAST : UBRR_SLOW;
+    }
+#else
+    static PROTOCOL_INLINE void spi_start(uint8_t value) { SPDR = value; }
+    static PROTOCOL_INLINE uint8_t spi_data() { return SPDR; }
+
+    static PROTOCOL_INLINE void spi_wait() {
+        while (!(SPSR & (1 << SPIF)))
+            ;
+    }
+
+    static PROTOCOL_INLINE void select(bool sel) {
+        if (sel)
+            PORTB &= ~(1 << SS_BIT_n);
+        else
+            PORTB |= (1 << SS_BIT_n);
+    }
+
+    static PROTOCOL_INLINE void set_speed(bool fast) {
+        if (fast)
+            SPCR = (1 << SPE) | (1 << MSTR);
+        else
+            SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
+    }
+#endif
+
+    static PROTOCOL_INLINE void irq_release() { DDRB &= ~(1 << IRQ_BIT_n); }
+    static PROTOCOL_INLINE bool card_present() { return !(PIND & (1 << CP_BIT_n)); }
+
+    // Drives the data lines. Port D also holds the pull-ups of CP and REQ,
+    // and ACT (kept asserted) unless it was moved to port B, so its value
+    // is computed ahead of time.
+    struct Output {
+        struct Value {
+            uint8_t d;
+            uint8_t c;
+        };
+
+        PROTOCOL_INLINE Output(pins_t, uint8_t value) {
+            PORTD = (value & 0xc0) | (1 << CP_BIT_n) | (1 << REQ_BIT_n);
+            DDRD = 0xc0 | PORTD_OUTPUTS;
+
+            PORTC = value;
+            DDRC = 0x3f;
+        }
+
+        static PROTOCOL_INLINE Value prepare(uint8_t value) {
+            return {(uint8_t)((value & 0xc0) | (1 << CP_BIT_n) | (1 << REQ_BIT_n)), value};
+        }
+
+        static PROTOCOL_INLINE void drive(Value value) {
+            PORTD = value.d;
+            PORTC = value.c;
+        }
+    };
+};
+
+extern "C" void start_command()
+{
+    protocol::Engine<Avr>::handle_request(PIND);
+
+    while (1)
+        ;
+}
+
+extern "C" void busy_wait()
+{
+    while (1)
+        ;
+}
+
+// Interrupt handler for REQ signal changes (INT0).
+ISR(INT0_vect, ISR_NAKED)
+{
+    void (*next_fn)();
+
+    if (PIND & (1 << REQ_BIT_n))
+    {
+        DDRD = PORTD_OUTPUTS;
+        PORTD = PORTD_IDLE;
+#if AVR_SPI_USART
+        ACT_PORT |= (1 << ACT_BIT_n);
+#endif
+
+        DDRC = 0;
+        PORTC = 0;
+
+        EIMSK |= (1 << 1);
+
+        next_fn = &busy_wait;
+    }
+    else
+    {
+        EIMSK &= ~(1 << 1);
+
+        next_fn = &start_command;
+    }
+
+    uint16_t fn_int = (uint16_t)next_fn;
+    uint16_t sp = ((SPH << 8) | SPL) + 1;
+    uint8_t *p = (uint8_t *)sp;
+    *p++ = fn_int >> 8;
+    *p++ = fn_int & 0xff;
+
+    reti();
+}
+
+// Interrupt handler for CP signal changes (INT1).
+ISR(INT1_vect, ISR_NAKED)
+{
+    DDRB |= (1 << IRQ_BIT_n);
+
+    reti();
+}
+
+int main()
+{
+#if AVR_SPI_USART
+    DDRB = (1 << SS_BIT_n) | (1 << ACT_BIT_n);
+    PORTB = (1 << SS_BIT_n) | (1 << ACT_BIT_n);
+
+    DDRD = PORTD_OUTPUTS;
+    PORTD = PORTD_IDLE;
+
+    // USART0 in Master SPI mode 0, MSB first. The baud rate must be zero
+    // when the transmitter is enabled.
+    UBRR0 = 0;
+    UCSR0C = (1 << UMSEL01) | (1 << UMSEL00);
+    UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+    UBRR0 = UBRR_SLOW;
+
+    // Send one byte with SS released, so that TXC0 says the SPI is idle.
+    UDR0 = 0xff;
+#else
+    DDRB = (1 << SCK_BIT) | (1 << MOSI_BIT) | (1 << SS_BIT_n);
+    PORTB = (1 << SS_BIT_n);
+
+    // SPI enabled, master, fosc/64 = 250 kHz
+    SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
+    SPSR |= (1 << SPI2X);
+
+    DDRD = PORTD_OUTPUTS;
+    PORTD = PORTD_IDLE;
+#endif
+
+    DDRC = 0;
+    PORTC = 0;
+
+    // Enable interrupts
+    EICRA = (1 << 2) | (1 << 0);
+    EIFR = (1 << 1) | (1 << 0);
+    EIMSK = (1 << 1) | (1 << 0);
+
+    sei();
+
+    while (1)
+        ;
+}
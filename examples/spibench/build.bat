@@ -0,0 +1 @@
+vc spibench.c ../spisd/sd.c ../spisd/timer.c ../../spi-lib/spi.c ../../spi-lib/spi_low.asm -I../spisd -I../../spi-lib -O2 -lamiga -o spibench
@@ -0,0 +1,589 @@
+/*
+ * Written in October 2026.
+ *
+ * spibench - measures throughput and latency of the SPI adapter.
+ *
+ * The raw tests and the direct SD tests link spi-lib and sd.c and therefore
+ * need exclusive access to the parallel port (spisd.device must not be
+ * loaded). With DEVICE the SD tests are instead run through a trackdisk
+ * style device, which includes the request overhead of the device driver.
+ */
+#include <exec/types.h>
+#include <exec/execbase.h>
+#include <exec/io.h>
+#include <exec/memory.h>
+#include <devices/trackdisk.h>
+#include <dos/dos.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "spi.h"
+#include "sd.h"
+#include "timer.h"
+
+#ifndef AFB_68060
+#define AFB_68060 7
+#endif
+
+#define DEFAULT_ITERATIONS 200
+#define MAX_BURST_SECTORS 128
+#define BUFFER_SIZE (MAX_BURST_SECTORS * SD_SECTOR_SIZE)
+#define SEQUENTIAL_BYTES (1024 * 1024)
+
+static const char template[] =
+    "RAW/S,SD/S,RANDOM/S,LOOPBACK/S,WRITE/S,LINES/S,ITERATIONS=ITER/K/N,LBA/K/N,DEVICE/K,UNIT/K/N";
+
+enum {
+    ARG_RAW,
+    ARG_SD,
+    ARG_RANDOM,
+    ARG_LOOPBACK,
+    ARG_WRITE,
+    ARG_LINES,
+    ARG_ITERATIONS,
+    ARG_LBA,
+    ARG_DEVICE,
+    ARG_UNIT,
+    ARG_COUNT
+};
+
+static ULONG timing_overhead;
+
+static BOOL lines_output;
+
+static struct MsgPort *dev_port;
+static struct IOStdReq *dev_ior;
+static BOOL spi_opened;
+
+static UBYTE *buffer;
+static ULONG total_sectors;
+static ULONG random_state;
+
+struct stats
+{
+    ULONG count;
+    ULONG bytes;
+    ULONG total;
+    ULONG min;
+    ULONG max;
+};
+
+static int (*blk_read)(UBYTE *buf, ULONG lba, ULONG count);
+static int (*blk_write)(const UBYTE *buf, ULONG lba, ULONG count);
+
+static void change_isr()
+{
+}
+
+static ULONG now()
+{
+    return timer_get_tick_count();
+}
+
+static ULONG ticks_to_us(ULONG ticks)
+{
+    return TIMER_TO_MICROS(ticks);
+}
+
+static void stats_reset(struct stats *s)
+{
+    s->count = 0;
+    s->bytes = 0;
+    s->total = 0;
+    s->min = 0xffffffff;
+    s->max = 0;
+}
+
+static void stats_add(struct stats *s, ULONG start, ULONG end, ULONG bytes)
+{
+    ULONG ticks = end - start;
+
+    ticks = ticks > timing_overhead ? ticks - timing_overhead : 0;
+
+    s->count++;
+    s->bytes += bytes;
+    s->total += ticks;
+    if (ticks < s->min)
+        s->min = ticks;
+    if (ticks > s->max)
+        s->max = ticks;
+}
+
+// Computes n * 1000 / ms without overflowing for large n.
+static ULONG per_second(ULONG n, ULONG ms)
+{
+    if (!ms)
+        return 0;
+    return (n / ms) * 1000 + (n % ms) * 1000 / ms;
+}
+
+static void print_header()
+{
+    const char *cpu = "68000";
+    UWORD attn = SysBase->AttnFlags;
+
+    if (attn & (1 << AFB_68060))
+        cpu = "68060";
+    else if (attn & AFF_68040)
+        cpu = "68040";
+    else if (attn & AFF_68030)
+        cpu = "68030";
+    else if (attn & AFF_68020)
+        cpu = "68020";
+    else if (attn & AFF_68010)
+        cpu = "68010";
+
+    if (lines_output)
+    {
+        printf("spibench cpu=%s timer_hz=%lu overhead_us=%lu\n",
+                cpu, (ULONG)TIMER_TICK_FREQ, ticks_to_us(timing_overhead));
+    }
+    else
+    {
+        printf("CPU %s, timer %lu Hz, timing overhead %lu us (subtracted)\n\n",
+                cpu, (ULONG)TIMER_TICK_FREQ, ticks_to_us(timing_overhead));
+        if (spi_opened)
+        {
+            const struct spi_caps *caps = spi_get_caps();
+            printf("Adapter firmware %u version %u.%u, SPI %u/%u kHz, features %04x, %u devices, REQ latency %u ns\n\n",
+                    caps->firmware_id, caps->firmware_version >> 8, caps->firmware_version & 0xff,
+                    caps->spi_slow_khz, caps->spi_fast_khz, caps->features, caps->devices, caps->req_latency_ns);
+        }
+        printf("%-14s %6s %6s %9s %7s %8s %8s %8s\n",
+                "test", "size", "count", "B/s", "IOPS", "min us", "avg us", "max us");
+    }
+}
+
+static void report(const char *test, ULONG size, struct stats *s)
+{
+    ULONG ms = TIMER_TO_MILLIS(s->total);
+    ULONG avg = s->count ? s->total / s->count : 0;
+
+    if (!s->count)
+        return;
+
+    if (lines_output)
+    {
+        printf("spibench test=%s size=%lu count=%lu bps=%lu iops=%lu min_us=%lu avg_us=%lu max_us=%lu\n",
+                test, size, s->count, per_second(s->bytes, ms), per_second(s->count, ms),
+                ticks_to_us(s->min), ticks_to_us(avg), ticks_to_us(s->max));
+    }
+    else
+    {
+        printf("%-14s %6lu %6lu %9lu %7lu %8lu %8lu %8lu\n",
+                test, size, s->count, per_second(s->bytes, ms), per_second(s->count, ms),
+                ticks_to_us(s->min), ticks_to_us(avg), ticks_to_us(s->max));
+    }
+}
+
+static BOOL check_break()
+{
+    return (SetSignal(0, SIGBREAKF_CTRL_C) & SIGBREAKF_CTRL_C) != 0;
+}
+
+static ULONG next_random()
+{
+    // xorshift32
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void calibrate()
+{
+    ULONG best = 0xffffffff;
+
+    for (int i = 0; i < 16; i++)
+    {
+        ULONG start = now();
+        ULONG end = now();
+        if (end - start < best)
+            best = end - start;
+    }
+
+    timing_overhead = best;
+}
+
+static const ULONG raw_sizes[] = {1, 6, 16, 64, 65, 512, 2048, 8191, 0};
+
+static void run_raw(ULONG iterations)
+{
+    struct stats s;
+
+    // Keep the card deselected so that it ignores the traffic.
+    spi_deselect();
+    spi_set_speed(SPI_SPEED_FAST);
+
+    for (const ULONG *size = raw_sizes; *size; size++)
+    {
+        stats_reset(&s);
+        for (ULONG i = 0; i < iterations && !check_break(); i++)
+        {
+            ULONG start = now();
+            spi_read(buffer, *size);
+            stats_add(&s, start, now(), *size);
+        }
+        report("spi_read", *size, &s);
+
+        memset(buffer, 0xff, *size);
+
+        stats_reset(&s);
+        for (ULONG i = 0; i < iterations && !check_break(); i++)
+        {
+            ULONG start = now();
+            spi_write(buffer, *size);
+            stats_add(&s, start, now(), *size);
+        }
+        report("spi_write", *size, &s);
+    }
+}
+
+// The raw tests with the adapter in loopback mode, which leaves out the SPI,
+// followed by a check of the data moved in both directions.
+static int run_loopback(ULONG iterations)
+{
+    struct stats s;
+    struct spi_self_test result;
+
+    spi_deselect();
+    spi_set_speed(SPI_SPEED_FAST);
+
+    if (spi_loopback(1) < 0)
+        return -1;
+
+    for (const ULONG *size = raw_sizes; *size; size++)
+    {
+        stats_reset(&s);
+        for (ULONG i = 0; i < iterations && !check_break(); i++)
+        {
+            ULONG start = now();
+            spi_read(buffer, *size);
+            stats_add(&s, start, now(), *size);
+        }
+        report("loop_read", *size, &s);
+
+        stats_reset(&s);
+        for (ULONG i = 0; i < iterations && !check_break(); i++)
+        {
+            ULONG start = now();
+            spi_write(buffer, *size);
+            stats_add(&s, start, now(), *size);
+        }
+        report("loop_write", *size, &s);
+    }
+
+    spi_loopback(0);
+
+    if (spi_self_test(buffer, 8191, iterations, &result) < 0)
+        return -1;
+
+    if (lines_output)
+    {
+        printf("spibench test=self_test bytes=%lu errors=%lu stalls=%lu sum=%s\n",
+                result.bytes, result.errors, result.stalls, result.sum_ok ? "ok" : "bad");
+    }
+    else
+    {
+        printf("\nSelf test: %lu bytes each way, %lu read errors, %lu stalls, checksum %s\n",
+                result.bytes, result.errors, result.stalls, result.sum_ok ? "ok" : "bad");
+    }
+
+    return 0;
+}
+
+static const ULONG burst_sizes[] = {1, 8, 32, MAX_BURST_SECTORS, 0};
+
+static int run_sequential(ULONG first_lba, BOOL write)
+{
+    struct stats s;
+    char name[16];
+
+    for (const ULONG *count = burst_sizes; *count; count++)
+    {
+        ULONG bytes = *count * SD_SECTOR_SIZE;
+        ULONG lba = first_lba;
+
+        if (first_lba + SEQUENTIAL_BYTES / SD_SECTOR_SIZE > total_sectors)
+            return -1;
+
+        stats_reset(&s);
+        for (ULONG done = 0; done < SEQUENTIAL_BYTES && !check_break(); done += bytes)
+        {
+            ULONG start = now();
+            if (blk_read(buffer, lba, *count))
+                return -1;
+            stats_add(&s, start, now(), bytes);
+
+            lba += *count;
+        }
+        sprintf(name, "sd_read%s", *count == 1 ? "" : "_multi");
+        report(name, bytes, &s);
+
+        if (!write)
+            continue;
+
+        // Write back what is already on the card so that the test does not
+        // change any data.
+        lba = first_lba;
+        stats_reset(&s);
+        for (ULONG done = 0; done < SEQUENTIAL_BYTES && !check_break(); done += bytes)
+        {
+            if (blk_read(buffer, lba, *count))
+                return -1;
+
+            ULONG start = now();
+            if (blk_write(buffer, lba, *count))
+                return -1;
+            stats_add(&s, start, now(), bytes);
+
+            lba += *count;
+        }
+        sprintf(name, "sd_write%s", *count == 1 ? "" : "_multi");
+        report(name, bytes, &s);
+    }
+
+    return 0;
+}
+
+static int run_random(ULONG iterations, BOOL write)
+{
+    struct stats s;
+
+    stats_reset(&s);
+    for (ULONG i = 0; i < iterations && !check_break(); i++)
+    {
+        ULONG lba = next_random() % total_sectors;
+        ULONG start = now();
+        if (blk_read(buffer, lba, 1))
+            return -1;
+        stats_add(&s, start, now(), SD_SECTOR_SIZE);
+    }
+    report("random_read", SD_SECTOR_SIZE, &s);
+
+    if (!write)
+        return 0;
+
+    stats_reset(&s);
+    for (ULONG i = 0; i < iterations && !check_break(); i++)
+    {
+        ULONG lba = next_random() % total_sectors;
+        if (blk_read(buffer, lba, 1))
+            return -1;
+
+        ULONG start = now();
+        if (blk_write(buffer, lba, 1))
+            return -1;
+        stats_add(&s, start, now(), SD_SECTOR_SIZE);
+    }
+    report("random_write", SD_SECTOR_SIZE, &s);
+
+    return 0;
+}
+
+static int sd_blk_read(UBYTE *buf, ULONG lba, ULONG count)
+{
+    return sd_read(buf, lba, count);
+}
+
+static int sd_blk_write(const UBYTE *buf, ULONG lba, ULONG count)
+{
+    return sd_write(buf, lba, count);
+}
+
+// The 64-bit commands take the upper half of the byte offset in io_Actual,
+// so cards larger than 4 GB don't wrap.
+static int dev_blk_read(UBYTE *buf, ULONG lba, ULONG count)
+{
+    dev_ior->io_Command = TD_READ64;
+    dev_ior->io_Data = buf;
+    dev_ior->io_Offset = lba << SD_SECTOR_SHIFT;
+    dev_ior->io_Actual = lba >> (32 - SD_SECTOR_SHIFT);
+    dev_ior->io_Length = count << SD_SECTOR_SHIFT;
+    return DoIO((struct IORequest *)dev_ior);
+}
+
+static int dev_blk_write(const UBYTE *buf, ULONG lba, ULONG count)
+{
+    dev_ior->io_Command = TD_WRITE64;
+    dev_ior->io_Data = (APTR)buf;
+    dev_ior->io_Offset = lba << SD_SECTOR_SHIFT;
+    dev_ior->io_Actual = lba >> (32 - SD_SECTOR_SHIFT);
+    dev_ior->io_Length = count << SD_SECTOR_SHIFT;
+    return DoIO((struct IORequest *)dev_ior);
+}
+
+static int open_device(const char *name, ULONG unit)
+{
+    struct DriveGeometry geom;
+
+    dev_port = CreateMsgPort();
+    if (!dev_port)
+        return -1;
+
+    dev_ior = (struct IOStdReq *)CreateIORequest(dev_port, sizeof(struct IOExtTD));
+    if (!dev_ior)
+        return -1;
+
+    if (OpenDevice(name, unit, (struct IORequest *)dev_ior, 0))
+    {
+        DeleteIORequest((struct IORequest *)dev_ior);
+        dev_ior = NULL;
+        return -1;
+    }
+
+    dev_ior->io_Command = TD_GETGEOMETRY;
+    dev_ior->io_Data = &geom;
+    dev_ior->io_Length = sizeof(geom);
+    if (DoIO((struct IORequest *)dev_ior) || geom.dg_SectorSize != SD_SECTOR_SIZE)
+        return -1;
+
+    total_sectors = geom.dg_TotalSectors;
+    blk_read = dev_blk_read;
+    blk_write = dev_blk_write;
+    return 0;
+}
+
+static void close_device()
+{
+    if (dev_ior)
+    {
+        if (dev_ior->io_Device)
+            CloseDevice((struct IORequest *)dev_ior);
+        DeleteIORequest((struct IORequest *)dev_ior);
+    }
+
+    if (dev_port)
+        DeleteMsgPort(dev_port);
+}
+
+int main()
+{
+    LONG args[ARG_COUNT] = {0};
+    struct RDArgs *rdargs;
+    int rc = RETURN_FAIL;
+
+    rdargs = ReadArgs(template, args, NULL);
+    if (!rdargs)
+    {
+        PrintFault(IoErr(), "spibench");
+        return RETURN_FAIL;
+    }
+
+    BOOL all = !args[ARG_RAW] && !args[ARG_SD] && !args[ARG_RANDOM] && !args[ARG_LOOPBACK];
+    BOOL write = args[ARG_WRITE] != 0;
+    ULONG iterations = args[ARG_ITERATIONS] ? *(LONG *)args[ARG_ITERATIONS] : DEFAULT_ITERATIONS;
+    ULONG first_lba = args[ARG_LBA] ? *(LONG *)args[ARG_LBA] : 0;
+    const char *device = (const char *)args[ARG_DEVICE];
+    ULONG unit = args[ARG_UNIT] ? *(LONG *)args[ARG_UNIT] : 0;
+
+    lines_output = args[ARG_LINES] != 0;
+
+    if (timer_init() != 0)
+    {
+        printf("No free CIA timer\n");
+        goto fail1;
+    }
+
+    buffer = AllocMem(BUFFER_SIZE, MEMF_PUBLIC);
+    if (!buffer)
+    {
+        printf("Out of memory\n");
+        goto fail2;
+    }
+
+    if (device && (args[ARG_RAW] || args[ARG_LOOPBACK]))
+    {
+        printf("RAW and LOOPBACK cannot be combined with DEVICE\n");
+        goto fail3;
+    }
+
+    if (device)
+    {
+        if (open_device(device, unit))
+        {
+            printf("Could not open %s unit %lu\n", device, unit);
+            goto fail4;
+        }
+    }
+    else
+    {
+        int res = spi_initialize(&change_isr);
+        if (res < 0)
+        {
+            printf("Could not initialize spi-lib (%d), is the parallel port in use?\n", res);
+            goto fail3;
+        }
+        spi_opened = TRUE;
+
+        if ((all || args[ARG_SD] || args[ARG_RANDOM]))
+        {
+            if (res != 1 || sd_open() != 0)
+            {
+                printf("No usable SD card\n");
+                goto fail4;
+            }
+            total_sectors = sd_get_card_info()->total_sectors;
+            blk_read = sd_blk_read;
+            blk_write = sd_blk_write;
+        }
+    }
+
+    calibrate();
+    random_state = now() | 1;
+
+    print_header();
+
+    if (!device && (all || args[ARG_RAW]))
+        run_raw(iterations);
+
+    if (args[ARG_LOOPBACK])
+    {
+        if (run_loopback(iterations))
+        {
+            printf("The adapter has no loopback mode\n");
+            goto fail4;
+        }
+    }
+
+    if (all || args[ARG_SD])
+    {
+        if (run_sequential(first_lba, write))
+        {
+            printf("Sequential test failed\n");
+            goto fail4;
+        }
+    }
+
+    if (all || args[ARG_RANDOM])
+    {
+        if (run_random(iterations, write))
+        {
+            printf("Random test failed\n");
+            goto fail4;
+        }
+    }
+
+    if (spi_opened && spi_fast_path_misses())
+        printf("A write that skipped the wait for ACT went unanswered, the fast path was turned off\n");
+
+    rc = RETURN_OK;
+
+fail4:
+    if (spi_opened)
+        spi_shutdown();
+    close_device();
+
+fail3:
+    FreeMem(buffer, BUFFER_SIZE);
+
+fail2:
+    timer_shutdown();
+
+fail1:
+    FreeArgs(rdargs);
+    return rc;
+}
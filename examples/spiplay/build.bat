@@ -0,0 +1 @@
+vc spiplay.c -I../spisd -O2 -lamiga -o spiplay
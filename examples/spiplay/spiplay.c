@@ -0,0 +1,187 @@
+/*
+ * Written in October 2026.
+ *
+ * spiplay - plays an audio file on the VS1053 decoder of spisd.device.
+ */
+#include <exec/types.h>
+#include <exec/io.h>
+#include <exec/memory.h>
+#include <dos/dos.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+#include <stdio.h>
+
+#include "spisd_cmds.h"
+
+static const char template[] = "FILE/A,VOLUME/K/N,DEVICE/K";
+
+enum {
+    ARG_FILE,
+    ARG_VOLUME,
+    ARG_DEVICE,
+    ARG_COUNT
+};
+
+// Size of each of the two buffers. One is read from the file while the
+// driver sends the other to the decoder; at 320 kbit/s it lasts 0.4 s.
+#define BUFFER_SIZE 16384
+
+static struct MsgPort *port;
+static struct IOStdReq *ior[2];
+static UBYTE *buf[2];
+static BOOL pending[2];
+
+static int do_command(UWORD command, ULONG offset)
+{
+    ior[0]->io_Command = command;
+    ior[0]->io_Data = NULL;
+    ior[0]->io_Length = 0;
+    ior[0]->io_Offset = offset;
+    return DoIO((struct IORequest *)ior[0]);
+}
+
+// Waits for the write from buffer i, if there is one. Returns its error.
+static int finish_write(int i)
+{
+    if (!pending[i])
+        return 0;
+
+    pending[i] = FALSE;
+    return WaitIO((struct IORequest *)ior[i]);
+}
+
+// Streams the file through the two buffers. Returns once it has all been
+// sent, or when CTRL-C is pressed or a write fails.
+static int play(BPTR fh)
+{
+    int rc = RETURN_OK;
+
+    for (int i = 0;; i ^= 1)
+    {
+        if (finish_write(i))
+        {
+            printf("Write to the decoder failed (error %d)\n", ior[i]->io_Error);
+            rc = RETURN_ERROR;
+            break;
+        }
+
+        if (CheckSignal(SIGBREAKF_CTRL_C))
+        {
+            rc = RETURN_WARN;
+            break;
+        }
+
+        LONG n = Read(fh, buf[i], BUFFER_SIZE);
+        if (n < 0)
+        {
+            PrintFault(IoErr(), "spiplay");
+            rc = RETURN_ERROR;
+        }
+        if (n <= 0)
+            break;
+
+        ior[i]->io_Command = CMD_WRITE;
+        ior[i]->io_Data = buf[i];
+        ior[i]->io_Length = n;
+        ior[i]->io_Offset = 0;
+        SendIO((struct IORequest *)ior[i]);
+        pending[i] = TRUE;
+    }
+
+    finish_write(0);
+    finish_write(1);
+
+    // A stream that was cut short is dropped, one that was played to the
+    // end is played out.
+    if (do_command(rc == RETURN_OK ? CMD_UPDATE : CMD_RESET, 0) && rc == RETURN_OK)
+        rc = RETURN_ERROR;
+
+    return rc;
+}
+
+static UBYTE *alloc_buffer()
+{
+    UBYTE *p = AllocMem(BUFFER_SIZE, MEMF_FAST);
+    return p ? p : AllocMem(BUFFER_SIZE, MEMF_ANY);
+}
+
+int main()
+{
+    LONG args[ARG_COUNT] = {0};
+    struct RDArgs *rdargs;
+    BPTR fh;
+    int rc = RETURN_FAIL;
+
+    rdargs = ReadArgs(template, args, NULL);
+    if (!rdargs)
+    {
+        PrintFault(IoErr(), "spiplay");
+        return RETURN_FAIL;
+    }
+
+    const char *path = (const char *)args[ARG_FILE];
+    const char *device = args[ARG_DEVICE] ? (const char *)args[ARG_DEVICE] : "spisd.device";
+
+    fh = Open(path, MODE_OLDFILE);
+    if (!fh)
+    {
+        PrintFault(IoErr(), path);
+        goto fail1;
+    }
+
+    // Fast RAM, if there is any, keeps the buffers off the chip bus.
+    buf[0] = alloc_buffer();
+    buf[1] = alloc_buffer();
+    if (!buf[0] || !buf[1])
+    {
+        printf("Not enough memory\n");
+        goto fail2;
+    }
+
+    port = CreateMsgPort();
+    if (!port)
+        goto fail2;
+
+    ior[0] = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+    ior[1] = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+    if (!ior[0] || !ior[1])
+        goto fail3;
+
+    if (OpenDevice(device, SPISD_AUDIO_UNIT, (struct IORequest *)ior[0], 0))
+    {
+        printf("Could not open %s unit %d, is there a decoder?\n", device, SPISD_AUDIO_UNIT);
+        goto fail3;
+    }
+
+    ior[1]->io_Device = ior[0]->io_Device;
+    ior[1]->io_Unit = ior[0]->io_Unit;
+
+    if (args[ARG_VOLUME])
+    {
+        ULONG volume = *(LONG *)args[ARG_VOLUME];
+        do_command(SPISD_CMD_AUDIO_VOLUME, (volume << 8) | volume);
+    }
+
+    rc = play(fh);
+
+    CloseDevice((struct IORequest *)ior[0]);
+
+fail3:
+    if (ior[1])
+        DeleteIORequest((struct IORequest *)ior[1]);
+    if (ior[0])
+        DeleteIORequest((struct IORequest *)ior[0]);
+    DeleteMsgPort(port);
+
+fail2:
+    if (buf[1])
+        FreeMem(buf[1], BUFFER_SIZE);
+    if (buf[0])
+        FreeMem(buf[0], BUFFER_SIZE);
+    Close(fh);
+
+fail1:
+    FreeArgs(rdargs);
+    return rc;
+}
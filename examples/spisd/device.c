@@ -12,6 +12,7 @@
 #include <exec/errors.h>
 #include <exec/execbase.h>
 #include <exec/interrupts.h>
+#include <exec/memory.h>
 #include <exec/ports.h>
 #include <exec/tasks.h>
 #include <libraries/dos.h>
@@ -21,22 +22,67 @@
 #include <proto/exec.h>
 #include <proto/alib.h>
 
+#include <string.h>
+
 #include "version.h"
 #include "sd.h"
 #include "spi.h"
+#include "spisd_cmds.h"
+#include "timer.h"
+#include "vs1053.h"
 
 #define TASK_STACK_SIZE 2048
 #define TASK_PRIORITY 10
 
 #define DEBOUNCE_TIMEOUT_US 100000
 
-#define SIGB_CARD_CHANGE 30
+// Unit 0 is the SD card on the adapter's first chip select, units 1 to 3
+// are the adapter's own disks (see protocol/disk.h), and units 4 and up the
+// SD cards on its other chip selects, when it has them. The last unit is a
+// VS1053 audio decoder, which takes the chip selects of two of the cards.
+#define SD_UNIT 0
+#define SD_EXTRA_UNIT 4
+#define AUDIO_UNIT SPISD_AUDIO_UNIT
+#define DEVICE_UNITS (AUDIO_UNIT + 1)
+
+// Most bytes sent to the decoder in one turn of the audio unit, half of
+// its FIFO, before the other units get the link.
+#define AUDIO_TURN_BYTES 1024
+
+// How long writes to a flash or remote disk of the adapter may stay in its buffer
+// before the driver flushes them, so that writes that follow each other
+// closely share the erases. A card's read or write stream is closed once it
+// has not been used for as long.
+#define FLUSH_DELAY_US 500000
+
+#define TRACE_DEFAULT_ENTRIES 4096
+// Largest ring TRACE_START accepts, 1.5 MB. Also keeps the allocation size
+// from overflowing for a bogus io_Length.
+#define TRACE_MAX_ENTRIES 65536
+
+// Smallest format that is done by erasing the card when the data written
+// would be what erased sectors read as. Below this the erase commands cost
+// more than writing.
+#define FORMAT_ERASE_MIN_SECTORS 16
+
+// Most queued writes joined into one batch, and the allocation unit assumed
+// when the card doesn't report one.
+#define WRITE_BATCH_REQUESTS 16
+#define WRITE_BATCH_DEFAULT_AU 8192
+
+// Requests that have been queued but not yet picked up by the task, for
+// which the arrival time is remembered while tracing.
+#define TRACE_ARRIVAL_SLOTS 16
+
+#define SIGB_IRQ 30
 #define SIGB_OP_REQUEST 29
 #define SIGB_TIMER 28
+#define SIGB_FLUSH 27
 
-#define SIGF_CARD_CHANGE (1 << SIGB_CARD_CHANGE)
+#define SIGF_IRQ (1 << SIGB_IRQ)
 #define SIGF_OP_REQUEST (1 << SIGB_OP_REQUEST)
 #define SIGF_OP_TIMER (1 << SIGB_TIMER)
+#define SIGF_FLUSH (1 << SIGB_FLUSH)
 
 // How much of struct NSDeviceQueryResult we use/need. It could be extended
 // and we don't want that to change the behaviour of the code.
@@ -48,13 +94,80 @@ static struct timerequest tr;
 static struct Task *task;
 static struct MsgPort mp;
 static struct MsgPort timer_mp;
-static volatile BOOL card_present;
-static volatile BOOL card_opened;
+static struct timerequest flush_tr;
+static struct MsgPort flush_mp;
+static BOOL flush_pending;
+// Only the card on the first chip select has a card detect switch. The
+// others are looked for once, when the task starts.
+static volatile BOOL card_present[SD_MAX_CARDS];
+static volatile BOOL card_opened[SD_MAX_CARDS];
 static volatile ULONG card_change_num;
 
+// Set for the cards whose sectors the adapter encrypts, which are never
+// formatted by erasing.
+static BOOL card_encrypted[SD_MAX_CARDS];
+
+// The decoder is looked for when the device is loaded. audio_waiting is set
+// while the audio unit waits for the adapter to assert IRQ for DREQ, and
+// audio_sent counts the bytes of the request at the head of its queue that
+// the decoder has.
+static BOOL audio_present;
+static BOOL audio_waiting;
+static ULONG audio_sent;
+static ULONG audio_start;
+
 static struct Interrupt *remove_int;
 static struct IOStdReq *change_int;
 
+static struct Unit units[DEVICE_UNITS];
+
+// Requests taken from mp by the task, one queue per unit, so that the task
+// can serve the units in turn.
+static struct List unit_queues[DEVICE_UNITS];
+
+// The adapter's disks, as found when the device was loaded. A unit with no
+// sectors can't be opened.
+static struct spi_disk_info disk_info[DEVICE_UNITS];
+static BOOL disk_dirty[DEVICE_UNITS];
+
+static struct SpiSdStats stats;
+
+// The trace ring is written both by begin_io (quick commands, and arrival
+// times) and by the task, so it is only touched under Forbid(). After
+// recording stops it is kept until the entries in it have been read.
+static BOOL trace_on;
+static struct SpiSdTraceEntry *trace_ring;
+static ULONG trace_size;
+static ULONG trace_head;
+static ULONG trace_count;
+static ULONG trace_dropped;
+
+static struct
+{
+    struct IOStdReq *ior;
+    ULONG time;
+} trace_arrivals[TRACE_ARRIVAL_SLOTS];
+
+static int request_unit(struct IOStdReq *ior)
+{
+    return ior->io_Unit ? ior->io_Unit - units : SD_UNIT;
+}
+
+// Returns the card of a unit, or -1 for the adapter's own disks and the
+// audio unit.
+static int unit_card(int unit)
+{
+    if (unit == SD_UNIT)
+        return 0;
+    return unit >= SD_EXTRA_UNIT && unit < AUDIO_UNIT ? unit - SD_EXTRA_UNIT + 1 : -1;
+}
+
+// Number of chip selects with cards on them.
+static int card_devices()
+{
+    return audio_present ? VS1053_SCI_DEVICE : spi_get_caps()->devices;
+}
+
 static uint32_t device_get_geometry(struct IOStdReq *ior)
 {
     struct DriveGeometry *geom = (struct DriveGeometry*)ior->io_Data;
@@ -75,6 +188,23 @@ static uint32_t device_get_geometry(struct IOStdReq *ior)
     return 0;
 }
 
+// The adapter's disks have no tracks, they are given erase block sized
+// cylinders of one head.
+static void disk_get_geometry(struct IOStdReq *ior, int unit)
+{
+    struct DriveGeometry *geom = (struct DriveGeometry*)ior->io_Data;
+
+    geom->dg_SectorSize = DISK_SECTOR_SIZE;
+    geom->dg_TotalSectors = disk_info[unit].sectors;
+    geom->dg_Cylinders = geom->dg_TotalSectors / 8;
+    geom->dg_CylSectors = 8;
+    geom->dg_Heads = 1;
+    geom->dg_TrackSectors = 8;
+    geom->dg_BufMemType = MEMF_PUBLIC;
+    geom->dg_DeviceType = DG_DIRECT_ACCESS;
+    geom->dg_Flags = 0;
+}
+
 static void handle_changed()
 {
     // Wait to debounce the card detect switch.
@@ -85,13 +215,13 @@ static void handle_changed()
 
     int res = spi_get_card_present();
 
-    if (res == 1 && sd_open() == 0)
-        card_opened = TRUE;
+    if (res == 1 && sd_set_card(0) == 0 && sd_open() == 0)
+        card_opened[0] = TRUE;
     else
-        card_opened = FALSE;
+        card_opened[0] = FALSE;
 
     Forbid();
-    card_present = res == 1;
+    card_present[0] = res == 1;
     card_change_num++;
     Permit();
 
@@ -107,14 +237,431 @@ static uint32_t offset_to_sd_sectors(uint32_t high_offset, uint32_t low_offset)
     return (high_offset << (32 - SD_SECTOR_SHIFT)) | (low_offset >> SD_SECTOR_SHIFT);
 }
 
+static int request_op(UWORD command)
+{
+    switch (command)
+    {
+    case CMD_READ:
+    case TD_READ64:
+    case NSCMD_TD_READ64:
+        return SPISD_OP_READ;
+
+    case CMD_WRITE:
+    case TD_WRITE64:
+    case NSCMD_TD_WRITE64:
+        return SPISD_OP_WRITE;
+
+    case TD_FORMAT:
+    case TD_FORMAT64:
+    case NSCMD_TD_FORMAT64:
+    case SPISD_CMD_DISCARD:
+        return SPISD_OP_FORMAT;
+
+    default:
+        return SPISD_OP_OTHER;
+    }
+}
+
+static void record_latency(int op, ULONG ticks)
+{
+    int bucket = 0;
+    ULONG us = ticks < 4000000 ? TIMER_TO_MICROS(ticks) : 0xffffffff;
+
+    us >>= 8;
+    while (us && bucket < SPISD_LATENCY_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    stats.ss_Latency[op][bucket]++;
+}
+
+static void get_stats(struct IOStdReq *ior)
+{
+    sd_stats_t *sds = sd_get_stats();
+    ULONG length = ior->io_Length < sizeof(stats) ? ior->io_Length : sizeof(stats);
+
+    Forbid();
+    stats.ss_Size = sizeof(stats);
+    stats.ss_SdCommands = sds->commands;
+    stats.ss_ResponsePolls = sds->response_polls;
+    stats.ss_ReadyWaitPolls = sds->ready_polls;
+    stats.ss_TokenWaitPolls = sds->token_polls;
+    stats.ss_Retries = sds->retries;
+    CopyMem(&stats, ior->io_Data, length);
+    Permit();
+
+    ior->io_Actual = length;
+}
+
+static void reset_stats()
+{
+    Forbid();
+    memset(&stats, 0, sizeof(stats));
+    memset(sd_get_stats(), 0, sizeof(sd_stats_t));
+    Permit();
+}
+
+static ULONG request_lba(struct IOStdReq *ior)
+{
+    switch (ior->io_Command)
+    {
+    case CMD_READ:
+    case CMD_WRITE:
+    case TD_FORMAT:
+        return offset_to_sd_sectors(0, ior->io_Offset);
+
+    case TD_READ64:
+    case TD_WRITE64:
+    case TD_FORMAT64:
+    case NSCMD_TD_READ64:
+    case NSCMD_TD_WRITE64:
+    case NSCMD_TD_FORMAT64:
+    case SPISD_CMD_DISCARD:
+    case SPISD_CMD_SCAN:
+    case SPISD_CMD_COMPARE:
+        return offset_to_sd_sectors(ior->io_Actual, ior->io_Offset);
+
+    default:
+        return 0;
+    }
+}
+
+static void trace_start(struct IOStdReq *ior)
+{
+    ULONG entries = ior->io_Length ? ior->io_Length : TRACE_DEFAULT_ENTRIES;
+
+    if (entries > TRACE_MAX_ENTRIES)
+    {
+        ior->io_Error = IOERR_BADLENGTH;
+        return;
+    }
+
+    struct SpiSdTraceEntry *ring = AllocMem(entries * sizeof(struct SpiSdTraceEntry), MEMF_PUBLIC);
+
+    if (!ring)
+    {
+        ior->io_Error = TDERR_NoMem;
+        return;
+    }
+
+    Forbid();
+    struct SpiSdTraceEntry *old_ring = trace_ring;
+    ULONG old_size = trace_size;
+    trace_on = TRUE;
+    trace_ring = ring;
+    trace_size = entries;
+    trace_head = 0;
+    trace_count = 0;
+    trace_dropped = 0;
+    memset(trace_arrivals, 0, sizeof(trace_arrivals));
+    Permit();
+
+    if (old_ring)
+        FreeMem(old_ring, old_size * sizeof(struct SpiSdTraceEntry));
+}
+
+// Stops recording and frees the ring once it has been read, or at once
+// with discard set.
+static void trace_stop(BOOL discard)
+{
+    struct SpiSdTraceEntry *old_ring = NULL;
+
+    Forbid();
+    ULONG old_size = trace_size;
+    trace_on = FALSE;
+    if (discard)
+        trace_count = 0;
+    if (!trace_count)
+    {
+        old_ring = trace_ring;
+        trace_ring = NULL;
+        trace_size = 0;
+        trace_head = 0;
+    }
+    Permit();
+
+    if (old_ring)
+        FreeMem(old_ring, old_size * sizeof(struct SpiSdTraceEntry));
+}
+
+static void trace_read(struct IOStdReq *ior)
+{
+    struct SpiSdTraceInfo *info = (struct SpiSdTraceInfo *)ior->io_Data;
+    struct SpiSdTraceEntry *out = (struct SpiSdTraceEntry *)(info + 1);
+
+    if (ior->io_Length < sizeof(struct SpiSdTraceInfo))
+    {
+        ior->io_Error = IOERR_BADLENGTH;
+        return;
+    }
+
+    ULONG n = (ior->io_Length - sizeof(struct SpiSdTraceInfo)) / sizeof(struct SpiSdTraceEntry);
+
+    Forbid();
+    if (!trace_ring)
+        n = 0;
+    else if (n > trace_count)
+        n = trace_count;
+
+    for (ULONG i = 0; i < n; i++)
+    {
+        ULONG index = trace_head + trace_size - trace_count;
+        if (index >= trace_size)
+            index -= trace_size;
+        out[i] = trace_ring[index];
+        trace_count--;
+    }
+
+    info->ti_TickFreq = TIMER_TICK_FREQ;
+    info->ti_Dropped = trace_dropped;
+    info->ti_Count = n;
+    trace_dropped = 0;
+
+    // Still under Forbid(), so that a TRACE_START from another task can't
+    // come in between.
+    if (!trace_on)
+        trace_stop(FALSE);
+    Permit();
+
+    ior->io_Actual = sizeof(struct SpiSdTraceInfo) + n * sizeof(struct SpiSdTraceEntry);
+}
+
+// Called under Forbid() from begin_io, just before the request is queued.
+static void trace_arrival(struct IOStdReq *ior, ULONG now)
+{
+    for (int i = 0; i < TRACE_ARRIVAL_SLOTS; i++)
+    {
+        if (!trace_arrivals[i].ior)
+        {
+            trace_arrivals[i].ior = ior;
+            trace_arrivals[i].time = now;
+            return;
+        }
+    }
+}
+
+// Returns the arrival time of a queued request, or start if it was not
+// recorded (tracing started while it was queued, or all slots were taken).
+static ULONG trace_take_arrival(struct IOStdReq *ior, ULONG start)
+{
+    ULONG arrival = start;
+
+    Forbid();
+    for (int i = 0; i < TRACE_ARRIVAL_SLOTS; i++)
+    {
+        if (trace_arrivals[i].ior == ior)
+        {
+            trace_arrivals[i].ior = NULL;
+            arrival = trace_arrivals[i].time;
+            break;
+        }
+    }
+    Permit();
+
+    return arrival;
+}
+
+static void trace_add(struct IOStdReq *ior, ULONG lba, ULONG arrival, ULONG start, ULONG complete)
+{
+    Forbid();
+    if (trace_on)
+    {
+        if (trace_count == trace_size)
+            trace_dropped++;
+        else
+        {
+            struct SpiSdTraceEntry *e = &trace_ring[trace_head];
+            e->te_Command = ior->io_Command;
+            e->te_Error = ior->io_Error;
+            e->te_Unit = request_unit(ior);
+            e->te_Lba = lba;
+            e->te_Length = ior->io_Length;
+            e->te_Arrival = arrival;
+            e->te_Start = start;
+            e->te_Complete = complete;
+
+            if (++trace_head == trace_size)
+                trace_head = 0;
+            trace_count++;
+        }
+    }
+    Permit();
+}
+
+// Returns TRUE if all of the length bytes in buf are value.
+static BOOL is_filled(const uint8_t *buf, ULONG length, uint8_t value)
+{
+    const ULONG *p = (const ULONG *)buf;
+    ULONG fill = value * 0x01010101UL;
+
+    for (ULONG i = 0; i < length / 4; i++)
+    {
+        if (p[i] != fill)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Formats by erasing when the card supports it and the data is what erased
+// sectors read as, as it is when a file system is formatted.
+static BOOL format_by_erase(struct IOStdReq *ior)
+{
+    const sd_card_info_t *ci = sd_get_card_info();
+
+    return ci->can_erase && !card_encrypted[unit_card(request_unit(ior))] &&
+        (ior->io_Length >> SD_SECTOR_SHIFT) >= FORMAT_ERASE_MIN_SECTORS &&
+        is_filled((const uint8_t *)ior->io_Data, ior->io_Length, ci->erased_byte);
+}
+
+// Counts a request that is done in the statistics and the trace, and
+// replies it.
+static void finish_request(struct IOStdReq *ior, ULONG lba, BOOL erased, ULONG start)
+{
+    int op = request_op(ior->io_Command);
+
+    if (ior->io_Error)
+        stats.ss_Errors++;
+    else if (request_unit(ior) == AUDIO_UNIT)
+        ;   // a stream is not counted in sectors
+    else if (op == SPISD_OP_READ)
+        stats.ss_SectorsRead += ior->io_Length >> SD_SECTOR_SHIFT;
+    else if (erased)
+        stats.ss_SectorsErased += ior->io_Length >> SD_SECTOR_SHIFT;
+    else if (op != SPISD_OP_OTHER)
+        stats.ss_SectorsWritten += ior->io_Length >> SD_SECTOR_SHIFT;
+
+    ULONG complete = timer_get_tick_count();
+
+    record_latency(op, complete - start);
+
+    if (trace_on)
+        trace_add(ior, lba, trace_take_arrival(ior, start), start, complete);
+
+    ReplyMsg(&ior->io_Message);
+}
+
+// Flushes the adapter's flash and remote disks that have been written to.
+static void flush_disks()
+{
+    for (int unit = SD_UNIT + 1; unit < SD_EXTRA_UNIT; unit++)
+    {
+        if (disk_dirty[unit])
+        {
+            disk_dirty[unit] = FALSE;
+            spi_disk_flush(unit);
+        }
+    }
+}
+
+static void schedule_flush()
+{
+    if (flush_pending)
+        return;
+
+    flush_tr.tr_node.io_Command = TR_ADDREQUEST;
+    flush_tr.tr_time.tv_secs = 0;
+    flush_tr.tr_time.tv_micro = FLUSH_DELAY_US;
+    SendIO((struct IORequest *)&flush_tr);
+    flush_pending = TRUE;
+}
+
+// Serves a request to one of the adapter's disks. They can't be removed
+// and don't know erasing.
+static void process_disk_request(struct IOStdReq *ior, int unit)
+{
+    ULONG lba = request_lba(ior);
+    ULONG count = ior->io_Length >> SD_SECTOR_SHIFT;
+
+    switch (ior->io_Command)
+    {
+    case TD_GETGEOMETRY:
+        // A remote disk comes and goes with the host serving it.
+        if (disk_info[unit].type == DISK_TYPE_REMOTE)
+            spi_disk_info(unit, &disk_info[unit]);
+        disk_get_geometry(ior, unit);
+        break;
+
+    case CMD_UPDATE:
+        disk_dirty[unit] = FALSE;
+        if (spi_disk_flush(unit) != 0)
+            ior->io_Error = TDERR_NotSpecified;
+        break;
+
+    case TD_FORMAT:
+    case CMD_WRITE:
+    case TD_FORMAT64:
+    case TD_WRITE64:
+    case NSCMD_TD_FORMAT64:
+    case NSCMD_TD_WRITE64:
+        if (spi_disk_write(unit, lba, (const uint8_t *)ior->io_Data, count) == 0)
+            ior->io_Actual = ior->io_Length;
+        else
+            ior->io_Error = TDERR_NotSpecified;
+
+        if (disk_info[unit].type != DISK_TYPE_RAM)
+        {
+            disk_dirty[unit] = TRUE;
+            schedule_flush();
+        }
+        break;
+
+    case CMD_READ:
+    case TD_READ64:
+    case NSCMD_TD_READ64:
+        if (spi_disk_read(unit, lba, (uint8_t *)ior->io_Data, count) == 0)
+            ior->io_Actual = ior->io_Length;
+        else
+            ior->io_Error = TDERR_NotSpecified;
+        break;
+
+    case SPISD_CMD_DISCARD:
+        ior->io_Error = IOERR_NOCMD;
+        break;
+    }
+}
+
+// Runs SPISD_CMD_SCAN or SPISD_CMD_COMPARE on the current card. The struct
+// from sc_Mode on is what the adapter carries the scan in.
+static void scan(struct IOStdReq *ior)
+{
+    struct SpiSdScan *sc = ior->io_Data;
+    ULONG sector = offset_to_sd_sectors(ior->io_Actual, ior->io_Offset);
+    ULONG count = ior->io_Length >> SD_SECTOR_SHIFT;
+    uint32_t done;
+    int res;
+
+    if (ior->io_Command == SPISD_CMD_COMPARE)
+        res = sd_compare(&sc->sc_Mode, sector, offset_to_sd_sectors(sc->sc_Other[0], sc->sc_Other[1]), count, &done);
+    else
+        res = sd_scan(&sc->sc_Mode, sector, count, &done);
+
+    if (res == sdError_Unsupported)
+        ior->io_Error = IOERR_NOCMD;
+    else if (res)
+        ior->io_Error = TDERR_NotSpecified;
+
+    ior->io_Actual = done << SD_SECTOR_SHIFT;
+}
+
 static void process_request(struct IOStdReq *ior)
 {
-    if (!card_present)
+    ULONG start = timer_get_tick_count();
+    ULONG lba = request_lba(ior);
+    BOOL erased = FALSE;
+    int card = unit_card(request_unit(ior));
+
+    if (card < 0)
+        process_disk_request(ior, request_unit(ior));
+    else if (!card_present[card])
         ior->io_Error = TDERR_DiskChanged;
-    else if (!card_opened)
+    else if (!card_opened[card])
         ior->io_Error = TDERR_NotSpecified;
     else
     {
+        sd_set_card(card);
+
         switch (ior->io_Command)
         {
         case TD_GETGEOMETRY:
@@ -128,10 +675,19 @@ static void process_request(struct IOStdReq *ior)
         case TD_WRITE64:
         case NSCMD_TD_FORMAT64:
         case NSCMD_TD_WRITE64:
-            if (sd_write((uint8_t *)ior->io_Data, offset_to_sd_sectors(ior->io_Actual, ior->io_Offset), ior->io_Length >> SD_SECTOR_SHIFT) == 0)
+            if (request_op(ior->io_Command) == SPISD_OP_FORMAT && format_by_erase(ior))
+            {
+                erased = TRUE;
+                if (sd_erase(offset_to_sd_sectors(ior->io_Actual, ior->io_Offset), ior->io_Length >> SD_SECTOR_SHIFT) == 0)
+                    ior->io_Actual = ior->io_Length;
+                else
+                    ior->io_Error = TDERR_NotSpecified;
+            }
+            else if (sd_write((uint8_t *)ior->io_Data, offset_to_sd_sectors(ior->io_Actual, ior->io_Offset), ior->io_Length >> SD_SECTOR_SHIFT) == 0)
                 ior->io_Actual = ior->io_Length;
             else
                 ior->io_Error = TDERR_NotSpecified;
+            schedule_flush();
             break;
 
         case CMD_READ:
@@ -142,45 +698,338 @@ static void process_request(struct IOStdReq *ior)
                 ior->io_Actual = ior->io_Length;
             else
                 ior->io_Error = TDERR_NotSpecified;
+            schedule_flush();
+            break;
+
+        case CMD_UPDATE:
+            // Ends the stream left open by the last read or write, so that
+            // the card has all the data written.
+            if (sd_stream_close() != 0)
+                ior->io_Error = TDERR_NotSpecified;
+            break;
+
+        case SPISD_CMD_SET_KEY:
+        {
+            int res = sd_set_key(ior->io_Length ? (const uint8_t *)ior->io_Data : NULL);
+
+            if (res == sdError_Unsupported)
+                ior->io_Error = IOERR_NOCMD;
+            else if (res)
+                ior->io_Error = TDERR_NotSpecified;
+            else
+                card_encrypted[card] = ior->io_Length != 0;
+            break;
+        }
+
+        case SPISD_CMD_SCAN:
+        case SPISD_CMD_COMPARE:
+            scan(ior);
+            break;
+
+        case SPISD_CMD_DISCARD:
+            erased = TRUE;
+            if ((ior->io_Offset | ior->io_Length) & (SD_SECTOR_SIZE - 1))
+                ior->io_Error = IOERR_BADLENGTH;
+            else if (!sd_get_card_info()->can_erase)
+                ior->io_Error = IOERR_NOCMD;
+            else if (sd_erase(offset_to_sd_sectors(ior->io_Actual, ior->io_Offset), ior->io_Length >> SD_SECTOR_SHIFT) == 0)
+                ior->io_Actual = ior->io_Length;
+            else
+                ior->io_Error = TDERR_NotSpecified;
             break;
         }
     }
 
-    ReplyMsg(&ior->io_Message);
+    finish_request(ior, lba, erased, start);
+}
+
+// Serves the request at the head of the audio unit's queue. A stream is
+// sent to the decoder in bursts, each once the adapter reports DREQ high,
+// and at most AUDIO_TURN_BYTES in one turn so that the cards get the link
+// in between. When DREQ is low the adapter is asked to assert IRQ as soon
+// as it goes high, and the unit waits for that with the request left at
+// the head of the queue.
+static void process_audio()
+{
+    struct IOStdReq *ior = (struct IOStdReq *)unit_queues[AUDIO_UNIT].lh_Head;
+
+    if (!audio_sent)
+        audio_start = timer_get_tick_count();
+
+    sd_release();
+
+    switch (ior->io_Command)
+    {
+    case CMD_WRITE:
+    case CMD_UPDATE:
+    {
+        // CMD_UPDATE ends the stream: the end fill plays out the last
+        // frame, and the cancel gets the decoder ready for another.
+        ULONG length = ior->io_Command == CMD_WRITE ? ior->io_Length : VS1053_END_FILL;
+        ULONG turn = 0;
+
+        while (audio_sent < length)
+        {
+            if (turn == AUDIO_TURN_BYTES)
+                return;
+
+            int status = spi_dreq(1);
+
+            if (status < 0)
+            {
+                ior->io_Error = TDERR_NotSpecified;
+                break;
+            }
+
+            // The card change is seen by handle_irq() on the next turn.
+            if (status & DREQ_STATUS_CARD_CHANGE)
+                SetSignal(SIGF_IRQ, SIGF_IRQ);
+
+            if (!(status & DREQ_STATUS_HIGH))
+            {
+                audio_waiting = TRUE;
+                return;
+            }
+
+            ULONG n = length - audio_sent < VS1053_BURST ? length - audio_sent : VS1053_BURST;
+
+            if (ior->io_Command == CMD_WRITE)
+                vs1053_send((const uint8_t *)ior->io_Data + audio_sent, n);
+            else
+                vs1053_send_end_fill(n);
+
+            audio_sent += n;
+            turn += n;
+        }
+
+        if (ior->io_Command == CMD_WRITE)
+            ior->io_Actual = audio_sent;
+        else if (!ior->io_Error && vs1053_cancel() != 0)
+            ior->io_Error = TDERR_NotSpecified;
+        break;
+    }
+
+    case CMD_RESET:
+        if (vs1053_reset() != 0)
+            ior->io_Error = TDERR_NotSpecified;
+        break;
+
+    case SPISD_CMD_AUDIO_VOLUME:
+        if (vs1053_set_volume(ior->io_Offset) != 0)
+            ior->io_Error = TDERR_NotSpecified;
+        break;
+
+    default:
+        ior->io_Error = IOERR_NOCMD;
+        break;
+    }
+
+    Remove(&ior->io_Message.mn_Node);
+    audio_sent = 0;
+    finish_request(ior, 0, FALSE, audio_start);
+}
+
+static BOOL is_write(struct IOStdReq *ior)
+{
+    return ior->io_Command == CMD_WRITE || ior->io_Command == TD_WRITE64 || ior->io_Command == NSCMD_TD_WRITE64;
+}
+
+// Writes ior together with the writes queued behind it that continue where
+// it ends. SD cards write fastest when whole allocation units are written
+// in sequence, so the sectors are sent as one CMD25 per allocation unit
+// touched, pre-erased with ACMD23 for the sectors it writes, rather than
+// one command per request. The writes are taken from the queue of the
+// unit, so requests to other units in between don't break a batch up.
+static void process_write_batch(struct IOStdReq *ior, int unit)
+{
+    struct IOStdReq *batch[WRITE_BATCH_REQUESTS];
+    ULONG lba[WRITE_BATCH_REQUESTS + 1];
+    ULONG start = timer_get_tick_count();
+    int count = 1;
+
+    batch[0] = ior;
+    lba[0] = request_lba(ior);
+    lba[1] = lba[0] + (ior->io_Length >> SD_SECTOR_SHIFT);
+
+    while (count < WRITE_BATCH_REQUESTS)
+    {
+        struct IOStdReq *next = (struct IOStdReq *)unit_queues[unit].lh_Head;
+
+        if (!next->io_Message.mn_Node.ln_Succ || !is_write(next) || request_lba(next) != lba[count])
+            break;
+
+        Remove(&next->io_Message.mn_Node);
+        batch[count] = next;
+        lba[count + 1] = lba[count] + (next->io_Length >> SD_SECTOR_SHIFT);
+        count++;
+    }
+
+    sd_set_card(unit_card(unit));
+
+    ULONG au = sd_get_card_info()->au_sectors;
+    if (!au)
+        au = WRITE_BATCH_DEFAULT_AU;
+
+    // Sectors up to written have been written, i is the request that holds
+    // the next sector.
+    ULONG written = lba[0];
+    int i = 0;
+
+    while (written < lba[count])
+    {
+        ULONG n = au - written % au;
+        if (n > lba[count] - written)
+            n = lba[count] - written;
+
+        ULONG sector = written;
+        int err = sd_write_start(sector, n);
+
+        while (!err && sector < written + n)
+        {
+            while (sector == lba[i + 1])
+                i++;
+
+            ULONG k = lba[i + 1] - sector;
+            if (k > written + n - sector)
+                k = written + n - sector;
+
+            err = sd_write_blocks((uint8_t *)batch[i]->io_Data + ((sector - lba[i]) << SD_SECTOR_SHIFT), k);
+            sector += k;
+        }
+
+        if (sd_write_stop() < 0 || err)
+            break;
+
+        written += n;
+    }
+    schedule_flush();
+
+    for (int j = 0; j < count; j++)
+    {
+        if (lba[j + 1] <= written)
+            batch[j]->io_Actual = batch[j]->io_Length;
+        else
+            batch[j]->io_Error = TDERR_NotSpecified;
+
+        finish_request(batch[j], lba[j], FALSE, start);
+    }
+}
+
+// Moves the requests that have arrived to the queues of their units.
+static void take_requests()
+{
+    struct IOStdReq *ior;
+
+    while ((ior = (struct IOStdReq *)GetMsg(&mp)))
+        AddTail(&unit_queues[request_unit(ior)], &ior->io_Message.mn_Node);
+}
+
+// Returns the first unit after last that has requests queued, or -1.
+static int next_unit(int last)
+{
+    for (int i = 1; i <= DEVICE_UNITS; i++)
+    {
+        int unit = (last + i) % DEVICE_UNITS;
+        if (!IsListEmpty(&unit_queues[unit]) && !(unit == AUDIO_UNIT && audio_waiting))
+            return unit;
+    }
+    return -1;
+}
+
+// IRQ is shared by the card detect switch and, while the audio unit waits
+// for it, the decoder's DREQ.
+static void handle_irq()
+{
+    if (audio_waiting)
+    {
+        int status = spi_dreq(1);
+
+        if (status & DREQ_STATUS_HIGH)
+            audio_waiting = FALSE;
+        if (!(status & DREQ_STATUS_CARD_CHANGE))
+            return;
+    }
+
+    handle_changed();
 }
 
 static void task_run()
 {
-    if (card_present && sd_open() == 0)
-        card_opened = TRUE;
+    int unit = SD_UNIT;
+
+    if (card_present[0] && sd_set_card(0) == 0 && sd_open() == 0)
+        card_opened[0] = TRUE;
+
+    for (int card = 1; card < SD_MAX_CARDS && card < card_devices(); card++)
+    {
+        if (sd_set_card(card) == 0 && sd_open() == 0)
+        {
+            card_present[card] = TRUE;
+            card_opened[card] = TRUE;
+        }
+    }
 
     while (1)
     {
-        ULONG sigs = Wait(SIGF_CARD_CHANGE | SIGF_OP_REQUEST);
+        ULONG sigs = Wait(SIGF_IRQ | SIGF_OP_REQUEST | SIGF_FLUSH);
 
-        if (sigs & SIGF_CARD_CHANGE)
-            handle_changed();
+        if (sigs & SIGF_IRQ)
+            handle_irq();
 
-        if (sigs & SIGF_OP_REQUEST)
+        if (flush_pending && CheckIO((struct IORequest *)&flush_tr))
+        {
+            WaitIO((struct IORequest *)&flush_tr);
+            flush_pending = FALSE;
+            flush_disks();
+
+            // Only the current card can have a stream open, since switching
+            // cards closes it.
+            if (sd_stream_idle())
+                schedule_flush();
+        }
+
+        // The units with requests queued get one request, one batch of
+        // writes or one turn of audio, each in turn. With two cards, one of
+        // them then gets its data while the other is still programming
+        // what it got.
+        if (sigs & (SIGF_OP_REQUEST | SIGF_IRQ))
         {
             BOOL first = TRUE;
 
-            struct IOStdReq *ior;
-            while ((ior = (struct IOStdReq *)GetMsg(&mp)))
-            {
-                if (!first && (SetSignal(0, SIGF_CARD_CHANGE) & SIGF_CARD_CHANGE))
-                    handle_changed();
+            take_requests();
 
-                process_request(ior);
+            while ((unit = next_unit(unit)) >= 0)
+            {
+                if (!first && (SetSignal(0, SIGF_IRQ) & SIGF_IRQ))
+                {
+                    handle_irq();
+                    if (unit == AUDIO_UNIT && audio_waiting)
+                        continue;
+                }
+
+                if (unit == AUDIO_UNIT)
+                    process_audio();
+                else
+                {
+                    struct IOStdReq *ior = (struct IOStdReq *)RemHead(&unit_queues[unit]);
+                    int card = unit_card(unit);
+
+                    if (card >= 0 && card_present[card] && card_opened[card] && is_write(ior))
+                        process_write_batch(ior, unit);
+                    else
+                        process_request(ior);
+                }
                 first = FALSE;
+
+                take_requests();
             }
         }
     }
 }
 
-static void change_isr()
+static void irq_isr()
 {
-    Signal(task, SIGF_CARD_CHANGE);
+    Signal(task, SIGF_IRQ);
 }
 
 static const UWORD supported_commands[] =
@@ -207,9 +1056,34 @@ static const UWORD supported_commands[] =
     NSCMD_TD_READ64,
     NSCMD_TD_WRITE64,
     NSCMD_TD_FORMAT64,
+    SPISD_CMD_GETSTATS,
+    SPISD_CMD_RESETSTATS,
+    SPISD_CMD_TRACE_START,
+    SPISD_CMD_TRACE_STOP,
+    SPISD_CMD_TRACE_READ,
+    SPISD_CMD_DISCARD,
+    SPISD_CMD_AUDIO_VOLUME,
+    SPISD_CMD_SET_KEY,
+    SPISD_CMD_SCAN,
+    SPISD_CMD_COMPARE,
     0
 };
 
+// Hands a request to the task.
+static void queue_request(struct IOStdReq *ior)
+{
+    ior->io_Flags &= ~IOF_QUICK;
+    if (trace_on)
+    {
+        Forbid();
+        trace_arrival(ior, timer_get_tick_count());
+        PutMsg(&mp, (struct Message *)&ior->io_Message);
+        Permit();
+    }
+    else
+        PutMsg(&mp, (struct Message *)&ior->io_Message);
+}
+
 static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdReq *ior)
 {
     if (!ior)
@@ -217,22 +1091,45 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
 
     ior->io_Error = 0;
 
+    stats.ss_Requests[request_op(ior->io_Command)]++;
+
     switch (ior->io_Command)
     {
     case CMD_RESET:
-    case CMD_CLEAR:
+        // The audio unit resets its decoder.
+        if (request_unit(ior) == AUDIO_UNIT)
+        {
+            queue_request(ior);
+            ior = NULL;
+            break;
+        }
+        ior->io_Actual = 0;
+        break;
+
     case CMD_UPDATE:
+        // The adapter buffers writes to its flash and remote disks, a card
+        // may have a write stream open and the audio unit ends its stream.
+        if (unit_card(request_unit(ior)) < 0 || card_opened[unit_card(request_unit(ior))])
+        {
+            queue_request(ior);
+            ior = NULL;
+            break;
+        }
+    case CMD_CLEAR:
     case TD_MOTOR:
     case TD_PROTSTATUS:
         ior->io_Actual = 0;
         break;
 
     case TD_CHANGESTATE:
-        ior->io_Actual = card_present ? 0 : 1;
+        if (unit_card(request_unit(ior)) >= 0)
+            ior->io_Actual = card_present[unit_card(request_unit(ior))] ? 0 : 1;
+        else
+            ior->io_Actual = disk_info[request_unit(ior)].sectors ? 0 : 1;
         break;
 
     case TD_CHANGENUM:
-        ior->io_Actual = card_change_num;
+        ior->io_Actual = request_unit(ior) == SD_UNIT ? card_change_num : 0;
         break;
 
     case TD_GETDRIVETYPE:
@@ -240,11 +1137,19 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
         break;
 
     case TD_REMOVE:
-        remove_int = (struct Interrupt *)ior->io_Data;
+        if (request_unit(ior) == SD_UNIT)
+            remove_int = (struct Interrupt *)ior->io_Data;
         break;
 
     case TD_ADDCHANGEINT:
-        if (change_int)
+        // Only the first card can change, so for the other units the
+        // request is only held.
+        if (request_unit(ior) != SD_UNIT)
+        {
+            ior->io_Flags &= ~IOF_QUICK;
+            ior = NULL;
+        }
+        else if (change_int)
             ior->io_Error = IOERR_ABORTED;
         else
         {
@@ -275,17 +1180,79 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
         }
         break;
 
+    case SPISD_CMD_GETSTATS:
+        get_stats(ior);
+        break;
+
+    case SPISD_CMD_RESETSTATS:
+        reset_stats();
+        break;
+
+    case SPISD_CMD_TRACE_START:
+        trace_start(ior);
+        break;
+
+    case SPISD_CMD_TRACE_STOP:
+        trace_stop(FALSE);
+        break;
+
+    case SPISD_CMD_TRACE_READ:
+        trace_read(ior);
+        break;
+
+    case SPISD_CMD_AUDIO_VOLUME:
+        if (request_unit(ior) != AUDIO_UNIT)
+            ior->io_Error = IOERR_NOCMD;
+        else
+        {
+            queue_request(ior);
+            ior = NULL;
+        }
+        break;
+
+    case SPISD_CMD_SET_KEY:
+        if (unit_card(request_unit(ior)) < 0)
+            ior->io_Error = IOERR_NOCMD;
+        else if (ior->io_Length != 0 && ior->io_Length != SPISD_KEY_SIZE)
+            ior->io_Error = IOERR_BADLENGTH;
+        else
+        {
+            queue_request(ior);
+            ior = NULL;
+        }
+        break;
+
+    case SPISD_CMD_SCAN:
+    case SPISD_CMD_COMPARE:
+    {
+        struct SpiSdScan *sc = ior->io_Data;
+
+        if (unit_card(request_unit(ior)) < 0)
+            ior->io_Error = IOERR_NOCMD;
+        else if (!sc || ((ior->io_Offset | ior->io_Length) & (SD_SECTOR_SIZE - 1)) ||
+                ((sc->sc_Mode & SPISD_SCAN_SEARCH) &&
+                    (!sc->sc_PatternLength || sc->sc_PatternLength > SPISD_SCAN_PATTERN_MAX)))
+            ior->io_Error = IOERR_BADLENGTH;
+        else
+        {
+            queue_request(ior);
+            ior = NULL;
+        }
+        break;
+    }
+
     case TD_GETGEOMETRY:
     case TD_FORMAT:
     case CMD_WRITE:
     case CMD_READ:
     case TD_READ64:
     case TD_WRITE64:
+    case TD_FORMAT64:
     case NSCMD_TD_READ64:
     case NSCMD_TD_WRITE64:
     case NSCMD_TD_FORMAT64:
-        PutMsg(&mp, (struct Message *)&ior->io_Message);
-        ior->io_Flags &= ~IOF_QUICK;
+    case SPISD_CMD_DISCARD:
+        queue_request(ior);
         ior = NULL;
         break;
 
@@ -293,8 +1260,18 @@ static void begin_io(__reg("a6") struct Library *dev, __reg("a1") struct IOStdRe
         ior->io_Error = IOERR_NOCMD;
     }
 
-    if (ior && !(ior->io_Flags & IOF_QUICK))
-        ReplyMsg(&ior->io_Message);
+    if (ior)
+    {
+        // Quick commands are traced too, except for the driver's own.
+        if (trace_on && ior->io_Command < SPISD_CMD_BASE)
+        {
+            ULONG now = timer_get_tick_count();
+            trace_add(ior, 0, now, now, now);
+        }
+
+        if (!(ior->io_Flags & IOF_QUICK))
+            ReplyMsg(&ior->io_Message);
+    }
 }
 
 static ULONG abort_io(__reg("a6") struct Library *dev, __reg("a1") struct IORequest *ior)
@@ -323,15 +1300,34 @@ static struct Library *init_device(__reg("a6") struct ExecBase *sys_base, __reg(
     if (OpenDevice(TIMERNAME, UNIT_VBLANK, (struct IORequest *)&tr, 0))
         goto fail1;
 
+    flush_tr = tr;
+    flush_tr.tr_node.io_Message.mn_ReplyPort = &flush_mp;
+
     task = CreateTask(device_name, TASK_PRIORITY, (char *)&task_run, TASK_STACK_SIZE);
     if (!task)
         goto fail2;
 
-    int res = spi_initialize(&change_isr);
+    int res = spi_initialize(&irq_isr);
     if (res < 0)
         goto fail3;
 
-    card_present = res == 1;
+    card_present[0] = res == 1;
+
+    for (int unit = SD_UNIT + 1; unit < SD_EXTRA_UNIT; unit++)
+    {
+        // A remote disk may be opened before its host serves it, the
+        // others only if they have room.
+        if (spi_disk_info(unit, &disk_info[unit]) != 0)
+            disk_info[unit].type = 0;
+        else if (!disk_info[unit].sectors && disk_info[unit].type != DISK_TYPE_REMOTE)
+            disk_info[unit].type = 0;
+    }
+
+    timer_init();
+
+    // Before the task looks for cards on the other chip selects.
+    sd_release();
+    audio_present = vs1053_open() == 0;
 
     mp.mp_Node.ln_Type = NT_MSGPORT;
     mp.mp_Flags = PA_SIGNAL;
@@ -339,12 +1335,21 @@ static struct Library *init_device(__reg("a6") struct ExecBase *sys_base, __reg(
     mp.mp_SigTask = task;
     NewList(&mp.mp_MsgList);
 
+    for (int unit = 0; unit < DEVICE_UNITS; unit++)
+        NewList(&unit_queues[unit]);
+
     timer_mp.mp_Node.ln_Type = NT_MSGPORT;
     timer_mp.mp_Flags = PA_SIGNAL;
     timer_mp.mp_SigBit = SIGB_TIMER;
     timer_mp.mp_SigTask = task;
     NewList(&timer_mp.mp_MsgList);
 
+    flush_mp.mp_Node.ln_Type = NT_MSGPORT;
+    flush_mp.mp_Flags = PA_SIGNAL;
+    flush_mp.mp_SigBit = SIGB_FLUSH;
+    flush_mp.mp_SigTask = task;
+    NewList(&flush_mp.mp_MsgList);
+
     Permit();
     return dev;
 
@@ -372,8 +1377,22 @@ static BPTR expunge(__reg("a6") struct Library *dev)
     // There is a risk that the task has an outstanding debounce timer,
     // and deleting the task at that point will probably cause a crash.
 
+    if (flush_pending)
+    {
+        AbortIO((struct IORequest *)&flush_tr);
+        WaitIO((struct IORequest *)&flush_tr);
+        flush_pending = FALSE;
+    }
+
+    flush_disks();
+    sd_stream_close();
+
     spi_shutdown();
 
+    timer_shutdown();
+
+    trace_stop(TRUE);
+
     DeleteTask(task);
 
     CloseDevice((struct IORequest *)&tr);
@@ -389,15 +1408,27 @@ static void open(__reg("a6") struct Library *dev, __reg("a1") struct IORequest *
     ior->io_Error = IOERR_OPENFAIL;
     ior->io_Message.mn_Node.ln_Type = NT_REPLYMSG;
 
-    if (unitnum != 0)
+    if (unitnum >= DEVICE_UNITS)
+        return;
+
+    // A card unit exists if the adapter has its chip select, and the audio
+    // unit if the decoder was found.
+    int card = unit_card(unitnum);
+    if (unitnum == AUDIO_UNIT ? !audio_present : card < 0 ? !disk_info[unitnum].type : card >= card_devices())
         return;
 
+    ior->io_Unit = &units[unitnum];
+    units[unitnum].unit_OpenCnt++;
+
     dev->lib_OpenCnt++;
     ior->io_Error = 0;
 }
 
 static BPTR close(__reg("a6") struct Library *dev, __reg("a1") struct IORequest *ior)
 {
+    if (ior->io_Unit)
+        ior->io_Unit->unit_OpenCnt--;
+
     ior->io_Device = NULL;
     ior->io_Unit = NULL;
 
@@ -0,0 +1,603 @@
+/*
+ * replay - runs an I/O trace recorded by spisd.device (spisdctl TRACEDUMP)
+ * through a timing model of the SD card and the CIA link, so that cache
+ * sizes, prefetch windows and request merging can be compared offline.
+ *
+ * Usage: replay [options] <trace file>
+ *
+ *   -c <list>  Read cache sizes in sectors to try, e.g. 0,64,512 (default 0)
+ *   -p <list>  Prefetch windows in sectors to try (default 0)
+ *   -m <list>  Merge limits in sectors to try, 0 disables merging (default 0)
+ *   -b <ns>    Link time per byte (default 2900)
+ *   -t <us>    Overhead per link transaction, call plus REQ/ACT handshake (default 30)
+ *   -r <us>    Card access time per read command (default 400)
+ *   -w <us>    Card busy time per written sector (default 700)
+ *   -k <us>    Time to copy one sector out of the cache (default 60)
+ *   -v         Print the measured requests
+ *
+ * Every combination of the -c, -p and -m lists is simulated and printed as
+ * one row. The model is deliberately simple: the driver serves one command
+ * at a time, in arrival order, and the card costs a fixed access time per
+ * read command and a fixed busy time per written sector. Run it once with
+ * the defaults and compare the "model" row with the "measured" row to
+ * calibrate -b, -t, -r and -w against the real hardware first.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// From spisd_cmds.h, which can't be included here as it needs the Amiga
+// headers. All fields are big endian.
+#define SPISD_TRACE_MAGIC       0x53505452
+#define SPISD_TRACE_VERSION     1
+#define FILE_HEADER_SIZE        20
+#define ENTRY_SIZE              24
+
+// io_Command values of the requests that move data.
+#define CMD_READ                2
+#define CMD_WRITE               3
+#define TD_FORMAT               10
+#define TD_READ64               24
+#define TD_WRITE64              25
+#define TD_FORMAT64             27
+#define NSCMD_TD_READ64         0xc000
+#define NSCMD_TD_WRITE64        0xc001
+#define NSCMD_TD_FORMAT64       0xc002
+
+#define SECTOR_SIZE             512
+#define MAX_CONFIGS             16
+
+// Link transactions and bytes of one SD command: deselect, select, wait
+// for ready, the 6 command bytes, and polling for the response.
+#define CMD_TRANSACTIONS        6
+#define CMD_BYTES               10
+
+enum { OP_READ, OP_WRITE, OP_OTHER };
+
+struct request {
+    int op;
+    uint16_t command;
+    uint32_t lba;
+    uint32_t sectors;
+    double arrival;         // us since the first request
+    double start;
+    double complete;
+};
+
+struct model {
+    double byte_us;
+    double transaction_us;
+    double read_access_us;
+    double write_busy_us;
+    double copy_us;
+};
+
+struct result {
+    double span;
+    double total_latency;
+    double p99_latency;
+    double max_latency;
+    uint64_t link_bytes;
+    uint32_t card_commands;
+    uint32_t sectors_read;  // Read from the card
+    uint32_t requested;     // Asked for by read requests
+    uint32_t hits;
+    uint32_t merged;
+};
+
+// LRU cache of sector numbers. Only which sectors are present matters.
+struct cache {
+    uint32_t size;
+    uint32_t used;
+    uint32_t buckets;
+    int32_t *hash;
+    struct cache_entry {
+        uint32_t lba;
+        int32_t prev, next;     // LRU list, head is most recently used
+        int32_t hnext;          // Hash chain
+    } *entries;
+    int32_t head, tail;
+};
+
+static struct request *requests;
+static uint32_t request_count;
+static uint32_t tick_freq;
+static struct model model = {2.9, 30, 400, 700, 60};
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static int command_op(uint16_t command) {
+    switch (command) {
+        case CMD_READ:
+        case TD_READ64:
+        case NSCMD_TD_READ64:
+            return OP_READ;
+        case CMD_WRITE:
+        case TD_WRITE64:
+        case NSCMD_TD_WRITE64:
+        case TD_FORMAT:
+        case TD_FORMAT64:
+        case NSCMD_TD_FORMAT64:
+            return OP_WRITE;
+    }
+    return OP_OTHER;
+}
+
+static int compare_arrival(const void *a, const void *b) {
+    const struct request *ra = a;
+    const struct request *rb = b;
+    return ra->arrival < rb->arrival ? -1 : ra->arrival > rb->arrival;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+static int load_trace(const char *path) {
+    uint8_t header[FILE_HEADER_SIZE];
+    uint8_t entry[ENTRY_SIZE];
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+            get32(header) != SPISD_TRACE_MAGIC || get32(header + 4) != SPISD_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a spisd trace\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    tick_freq = get32(header + 8);
+    uint32_t dropped = get32(header + 12);
+    uint32_t count = get32(header + 16);
+
+    if (!tick_freq) {
+        fprintf(stderr, "%s has no tick frequency\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    if (dropped)
+        fprintf(stderr, "Warning: %u requests were dropped while recording\n", dropped);
+
+    requests = calloc(count ? count : 1, sizeof(*requests));
+    if (!requests) {
+        fclose(f);
+        return -1;
+    }
+
+    // Timestamps are 32 bit tick counts that wrap, so arrivals are unwrapped
+    // relative to the previous one. Entries are stored in completion order,
+    // which is close to arrival order, so the signed difference is small.
+    uint32_t prev_arrival = 0;
+    double tick_us = 1e6 / tick_freq;
+    double arrival = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (fread(entry, 1, sizeof(entry), f) != sizeof(entry)) {
+            fprintf(stderr, "%s is truncated after %u entries\n", path, i);
+            break;
+        }
+
+        uint16_t command = get16(entry + 0);
+        int8_t error = entry[2];
+        uint32_t a = get32(entry + 12);
+        uint32_t s = get32(entry + 16);
+        uint32_t c = get32(entry + 20);
+
+        if (i)
+            arrival += (int32_t)(a - prev_arrival) * tick_us;
+        prev_arrival = a;
+
+        int op = command_op(command);
+        uint32_t length = get32(entry + 8);
+        if (op == OP_OTHER || error || length < SECTOR_SIZE)
+            continue;
+
+        struct request *r = &requests[request_count++];
+        r->op = op;
+        r->command = command;
+        r->lba = get32(entry + 4);
+        r->sectors = length / SECTOR_SIZE;
+        r->arrival = arrival;
+        r->start = arrival + (uint32_t)(s - a) * tick_us;
+        r->complete = arrival + (uint32_t)(c - a) * tick_us;
+    }
+
+    fclose(f);
+
+    qsort(requests, request_count, sizeof(*requests), compare_arrival);
+    if (request_count) {
+        double first = requests[0].arrival;
+        for (uint32_t i = 0; i < request_count; i++) {
+            requests[i].arrival -= first;
+            requests[i].start -= first;
+            requests[i].complete -= first;
+        }
+    }
+    return 0;
+}
+
+static int cache_init(struct cache *c, uint32_t size) {
+    memset(c, 0, sizeof(*c));
+    c->size = size;
+    c->head = c->tail = -1;
+    if (!size)
+        return 0;
+
+    c->buckets = 1;
+    while (c->buckets < size * 2)
+        c->buckets <<= 1;
+
+    c->hash = malloc(c->buckets * sizeof(*c->hash));
+    c->entries = malloc(size * sizeof(*c->entries));
+    if (!c->hash || !c->entries)
+        return -1;
+
+    memset(c->hash, 0xff, c->buckets * sizeof(*c->hash));
+    return 0;
+}
+
+static void cache_free(struct cache *c) {
+    free(c->hash);
+    free(c->entries);
+}
+
+static uint32_t cache_bucket(const struct cache *c, uint32_t lba) {
+    return (lba * 2654435761u) & (c->buckets - 1);
+}
+
+static int32_t cache_find(const struct cache *c, uint32_t lba) {
+    if (!c->size)
+        return -1;
+
+    for (int32_t i = c->hash[cache_bucket(c, lba)]; i >= 0; i = c->entries[i].hnext) {
+        if (c->entries[i].lba == lba)
+            return i;
+    }
+    return -1;
+}
+
+static void cache_unlink(struct cache *c, int32_t i) {
+    struct cache_entry *e = &c->entries[i];
+
+    if (e->prev >= 0)
+        c->entries[e->prev].next = e->next;
+    else
+        c->head = e->next;
+
+    if (e->next >= 0)
+        c->entries[e->next].prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void cache_push_front(struct cache *c, int32_t i) {
+    struct cache_entry *e = &c->entries[i];
+
+    e->prev = -1;
+    e->next = c->head;
+    if (c->head >= 0)
+        c->entries[c->head].prev = i;
+    c->head = i;
+    if (c->tail < 0)
+        c->tail = i;
+}
+
+static void cache_touch(struct cache *c, uint32_t lba) {
+    if (!c->size)
+        return;
+
+    int32_t i = cache_find(c, lba);
+    if (i >= 0) {
+        cache_unlink(c, i);
+        cache_push_front(c, i);
+        return;
+    }
+
+    if (c->used < c->size) {
+        i = c->used++;
+    } else {
+        // Evict the least recently used sector.
+        i = c->tail;
+        cache_unlink(c, i);
+
+        int32_t *p = &c->hash[cache_bucket(c, c->entries[i].lba)];
+        while (*p != i)
+            p = &c->entries[*p].hnext;
+        *p = c->entries[i].hnext;
+    }
+
+    c->entries[i].lba = lba;
+    uint32_t b = cache_bucket(c, lba);
+    c->entries[i].hnext = c->hash[b];
+    c->hash[b] = i;
+    cache_push_front(c, i);
+}
+
+static double command_cost(struct result *res) {
+    res->card_commands++;
+    res->link_bytes += CMD_BYTES;
+    return CMD_TRANSACTIONS * model.transaction_us + CMD_BYTES * model.byte_us;
+}
+
+// Reading n sectors with CMD17 or CMD18: per sector a token poll, the data
+// and the CRC. Multi block reads are ended with CMD12.
+static double read_cost(uint32_t n, struct result *res) {
+    double t = command_cost(res) + model.read_access_us;
+
+    t += n * (3 * model.transaction_us + (SECTOR_SIZE + 3) * model.byte_us);
+    res->link_bytes += n * (SECTOR_SIZE + 3);
+
+    if (n > 1)
+        t += command_cost(res);
+    return t;
+}
+
+// Writing n sectors with CMD24 or CMD25: per sector the token, the data,
+// the CRC, the data response and the card being busy.
+static double write_cost(uint32_t n, struct result *res) {
+    double t = command_cost(res);
+
+    t += n * (4 * model.transaction_us + (SECTOR_SIZE + 4) * model.byte_us + model.write_busy_us);
+    res->link_bytes += n * (SECTOR_SIZE + 4);
+
+    if (n > 1)
+        t += 2 * model.transaction_us + model.write_busy_us;
+    return t;
+}
+
+static int simulate(uint32_t cache_size, uint32_t prefetch, uint32_t merge_limit, struct result *res) {
+    struct cache cache;
+    double *latency = malloc((request_count ? request_count : 1) * sizeof(double));
+    double free_at = 0;
+    uint32_t next_sequential = UINT32_MAX;
+
+    memset(res, 0, sizeof(*res));
+    if (!latency || cache_init(&cache, cache_size)) {
+        free(latency);
+        cache_free(&cache);
+        return -1;
+    }
+
+    uint32_t i = 0;
+    while (i < request_count) {
+        struct request *r = &requests[i];
+        double start = r->arrival > free_at ? r->arrival : free_at;
+        uint32_t lba = r->lba;
+        uint32_t sectors = r->sectors;
+        uint32_t n = 1;
+
+        // Merge requests that were already queued when this one started,
+        // if they go in the same direction and continue where it ends.
+        while (merge_limit && i + n < request_count) {
+            struct request *next = &requests[i + n];
+            if (next->arrival > start || next->op != r->op ||
+                    next->lba != lba + sectors || sectors + next->sectors > merge_limit)
+                break;
+            sectors += next->sectors;
+            n++;
+        }
+        res->merged += n - 1;
+
+        double t = 0;
+
+        if (r->op == OP_READ) {
+            uint32_t first_miss = UINT32_MAX;
+            uint32_t last_miss = 0;
+
+            res->requested += sectors;
+
+            for (uint32_t s = 0; s < sectors; s++) {
+                if (cache_find(&cache, lba + s) >= 0) {
+                    res->hits++;
+                } else {
+                    if (first_miss == UINT32_MAX)
+                        first_miss = s;
+                    last_miss = s;
+                }
+            }
+
+            t += sectors * model.copy_us * (cache_size ? 1 : 0);
+
+            if (first_miss != UINT32_MAX) {
+                uint32_t fetch = last_miss - first_miss + 1;
+
+                // Read ahead only when the access continues a sequential run.
+                if (prefetch && lba == next_sequential)
+                    fetch += prefetch;
+
+                t += read_cost(fetch, res);
+                res->sectors_read += fetch;
+
+                for (uint32_t s = 0; s < fetch; s++)
+                    cache_touch(&cache, lba + first_miss + s);
+            }
+
+            for (uint32_t s = 0; s < sectors; s++)
+                cache_touch(&cache, lba + s);
+
+            next_sequential = lba + sectors;
+        } else {
+            // Write through, keeping the cache coherent.
+            t += write_cost(sectors, res);
+            for (uint32_t s = 0; s < sectors; s++) {
+                if (cache_find(&cache, lba + s) >= 0)
+                    cache_touch(&cache, lba + s);
+            }
+        }
+
+        free_at = start + t;
+
+        for (uint32_t k = 0; k < n; k++) {
+            double l = free_at - requests[i + k].arrival;
+            latency[i + k] = l;
+            res->total_latency += l;
+            if (l > res->max_latency)
+                res->max_latency = l;
+        }
+        i += n;
+    }
+
+    res->span = free_at;
+    if (request_count) {
+        qsort(latency, request_count, sizeof(double), compare_double);
+        res->p99_latency = latency[(uint32_t)(request_count * 0.99)];
+    }
+
+    free(latency);
+    cache_free(&cache);
+    return 0;
+}
+
+static void measured(struct result *res) {
+    double *latency = malloc((request_count ? request_count : 1) * sizeof(double));
+
+    memset(res, 0, sizeof(*res));
+    for (uint32_t i = 0; i < request_count; i++) {
+        double l = requests[i].complete - requests[i].arrival;
+        latency[i] = l;
+        res->total_latency += l;
+        if (l > res->max_latency)
+            res->max_latency = l;
+        if (requests[i].complete > res->span)
+            res->span = requests[i].complete;
+        if (requests[i].op == OP_READ)
+            res->sectors_read += requests[i].sectors;
+    }
+
+    if (request_count) {
+        qsort(latency, request_count, sizeof(double), compare_double);
+        res->p99_latency = latency[(uint32_t)(request_count * 0.99)];
+    }
+    free(latency);
+}
+
+static void print_result(const char *name, const struct result *res, int simulated) {
+    printf("%-22s %10.0f %9.0f %9.0f %9.0f", name, res->span / 1000,
+            request_count ? res->total_latency / request_count : 0, res->p99_latency, res->max_latency);
+
+    if (simulated)
+        printf(" %8u %8u %7.1f%% %7u\n", res->card_commands, res->sectors_read,
+                res->requested ? res->hits * 100.0 / res->requested : 0.0,
+                res->merged);
+    else
+        printf(" %8s %8u %8s %7s\n", "-", res->sectors_read, "-", "-");
+}
+
+static int parse_list(char *s, uint32_t *list) {
+    int n = 0;
+
+    for (char *tok = strtok(s, ","); tok && n < MAX_CONFIGS; tok = strtok(NULL, ","))
+        list[n++] = strtoul(tok, NULL, 0);
+    return n;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c <list>] [-p <list>] [-m <list>] [-b <ns>] [-t <us>] "
+            "[-r <us>] [-w <us>] [-k <us>] [-v] <trace file>\n", name);
+}
+
+int main(int argc, char **argv) {
+    uint32_t caches[MAX_CONFIGS] = {0};
+    uint32_t prefetches[MAX_CONFIGS] = {0};
+    uint32_t merges[MAX_CONFIGS] = {0};
+    int cache_count = 1, prefetch_count = 1, merge_count = 1;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:p:m:b:t:r:w:k:v")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_count = parse_list(optarg, caches);
+                break;
+            case 'p':
+                prefetch_count = parse_list(optarg, prefetches);
+                break;
+            case 'm':
+                merge_count = parse_list(optarg, merges);
+                break;
+            case 'b':
+                model.byte_us = atof(optarg) / 1000;
+                break;
+            case 't':
+                model.transaction_us = atof(optarg);
+                break;
+            case 'r':
+                model.read_access_us = atof(optarg);
+                break;
+            case 'w':
+                model.write_busy_us = atof(optarg);
+                break;
+            case 'k':
+                model.copy_us = atof(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || !cache_count || !prefetch_count || !merge_count) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (load_trace(argv[optind]))
+        return 1;
+
+    if (verbose) {
+        printf("%12s %12s %12s  %-6s %10s %6s\n", "arrival_us", "wait_us", "service_us", "op", "lba", "count");
+        for (uint32_t i = 0; i < request_count; i++) {
+            struct request *r = &requests[i];
+            printf("%12.0f %12.0f %12.0f  %-6s %10u %6u\n", r->arrival, r->start - r->arrival,
+                    r->complete - r->start, r->op == OP_READ ? "read" : "write", r->lba, r->sectors);
+        }
+        printf("\n");
+    }
+
+    printf("%u requests, timestamps at %u Hz\n\n", request_count, tick_freq);
+    printf("%-22s %10s %9s %9s %9s %8s %8s %8s %7s\n", "configuration", "span_ms",
+            "avg_us", "p99_us", "max_us", "commands", "sectors", "hits", "merged");
+
+    struct result res;
+    measured(&res);
+    print_result("measured", &res, 0);
+
+    for (int c = 0; c < cache_count; c++) {
+        for (int p = 0; p < prefetch_count; p++) {
+            for (int m = 0; m < merge_count; m++) {
+                char name[32];
+
+                if (simulate(caches[c], prefetches[p], merges[m], &res)) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+
+                if (!caches[c] && !prefetches[p] && !merges[m])
+                    strcpy(name, "model");
+                else
+                    snprintf(name, sizeof(name), "c=%u p=%u m=%u", caches[c], prefetches[p], merges[m]);
+                print_result(name, &res, 1);
+            }
+        }
+    }
+
+    return 0;
+}
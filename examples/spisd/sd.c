@@ -34,9 +34,39 @@
 #define FAST_CLOCK			3000000
 
 #define READY_TIMEOUT_MS	500
+#define ERASE_TIMEOUT_MS	3000
 #define INIT_TIMEOUT_MS		1000
 #define MAX_RESPONSE_POLLS	10
 
+/* Largest erase done with one CMD38, so that it finishes well within
+ * ERASE_TIMEOUT_MS (4 MiB, a typical allocation unit)
+ */
+#define ERASE_MAX_SECTORS	8192
+
+/* Most sectors read by one scan run: 128 KiB, which takes the SPI about
+ * 0.1 s and SHA-1 on the adapter about as long again, well within the time
+ * spi-lib waits for a run.
+ */
+#define SCAN_MAX_SECTORS	256
+
+/* Sequencer slots of the programs below */
+#define SEQ_SLOT_READ_SINGLE	0
+#define SEQ_SLOT_READ_MULTI		1
+#define SEQ_SLOT_READ_COUNTED	2
+#define SEQ_SLOT_READ_OPEN		3
+#define SEQ_SLOT_READ_CONT		4
+#define SEQ_SLOT_READ_OPEN_XTS	5
+#define SEQ_SLOT_READ_CONT_XTS	6
+#define SEQ_SLOT_WRITE_XTS		7
+#define SEQ_SLOT_SCAN			8
+#define SEQ_SLOT_SCAN_XTS		9
+#define SEQ_SLOT_COMPARE		10
+
+/* Open multiple block read or write of a card, see sd_stream_close() */
+#define STREAM_NONE			0
+#define STREAM_READ			1
+#define STREAM_WRITE		2
+
 /* MMC/SD command */
 #define CMD0	(0)			/* GO_IDLE_STATE */
 #define CMD1	(1)			/* SEND_OP_COND (MMC) */
@@ -57,9 +87,492 @@
 #define CMD33	(33)		/* ERASE_ER_BLK_END */
 #define CMD38	(38)		/* ERASE */
 #define CMD55	(55)		/* APP_CMD */
+#define	ACMD51	(0x80+51)	/* SEND_SCR (SDC) */
 #define CMD58	(58)		/* READ_OCR */
 
-static sd_card_info_t sd_card_info;
+/* State of one card, one per chip select of the adapter.
+ *
+ * selected is set while the card is selected, and busy while it may be busy
+ * after a write, an R1b command or an error. The card stays selected between
+ * the commands of a transaction, and a command only waits for the card to be
+ * ready when it may be busy. write_multi and write_failed are the state of
+ * the write begun by sd_write_start().
+ *
+ * select_pending is set when sd_select() has left asserting the chip select
+ * to the next transfer, which does it in the same adapter request. The last
+ * transfer of a transaction may likewise release it, see sd_read_end().
+ *
+ * stream is the CMD18 or CMD25 left open after a read or write, so that a
+ * request that continues at stream_next just takes or sends the next blocks.
+ * The card stays selected while it is open. stream_used is set each time
+ * the stream is opened or continued, see sd_stream_idle().
+ *
+ * seq_loaded is set when the adapter has the sequencer and the read programs
+ * are loaded, seq_counted when the CMD23 program is loaded too and the card
+ * takes CMD23, seq_stream when the stream programs are loaded too, and
+ * seq_scan when the adapter can scan and the scan programs are loaded too.
+ * The programs are the same for every card.
+ *
+ * crypt is set while the adapter has a key for the card, see sd_set_key().
+ * Its sectors are then only read and written with the XTS programs, and
+ * write_sector is the sector of the next block of a write.
+ */
+typedef struct {
+	sd_card_info_t	info;
+	int				selected;
+	int				select_pending;
+	int				busy;
+	int				write_multi;
+	int				write_failed;
+	int				stream;
+	uint32_t		stream_next;
+	int				stream_used;
+	int				seq_loaded;
+	int				seq_counted;
+	int				seq_stream;
+	int				seq_scan;
+	int				crypt;
+	uint32_t		write_sector;
+} sd_card_t;
+
+static sd_card_t sd_cards[SD_MAX_CARDS];
+static sd_card_t *card = &sd_cards[0];
+/* Set by sd_release() until sd_set_card() switches back to a card */
+static int released;
+
+/* Counted over all cards */
+static sd_stats_t sd_stats;
+
+/* The most sectors one sequencer run can return */
+static uint32_t seq_max_sectors;
+
+/* Sequencer programs that do a whole block read in one request: select and
+ * wait for ready, send the command and wait for R1, then for each block
+ * wait for the data token and read the data, skipping the CRC. Arguments
+ * 0-3 are the address, 4-5 the block count of a multiple block read.
+ * Statuses: 1 not ready, 2 bad R1, 3 no token, 4 bad token; with 2 and 4
+ * the output ends with the byte received. The ready and token waits give
+ * up after 16 * 65535 bytes, about 0.6 s at 16 MHz. seq_read_counted sets
+ * the block count with CMD23 first, so that no CMD12 is needed.
+ */
+static const uint8_t seq_read_single[] = {
+	SEQ_DESELECT,								/*  0 */
+	SEQ_SELECT,									/*  1 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  2 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  6 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/* 11 */
+	SEQ_DJNZ, 0, 6,								/* 15 */
+	SEQ_DESELECT,								/* 18 */
+	SEQ_FAIL, 1,								/* 19 */
+	SEQ_WRITE, 1, 0x51,							/* 21 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/* 24 */
+	SEQ_WRITE, 1, 0x01,							/* 27 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 30 */
+	SEQ_JNE, 0xff, 0x00, 70,					/* 35 */
+	SEQ_SETC, 0, 0x00, 0x10,					/* 39 */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/* 43 token */
+	SEQ_JNE, 0xff, 0xff, 58,					/* 48 */
+	SEQ_DJNZ, 0, 43,							/* 52 */
+	SEQ_DESELECT,								/* 55 */
+	SEQ_FAIL, 3,								/* 56 */
+	SEQ_JNE, 0xff, 0xfe, 74,					/* 58 got */
+	SEQ_READ, 0x02, 0x00,						/* 62 */
+	SEQ_SKIP, 0x00, 0x02,						/* 65 */
+	SEQ_DESELECT,								/* 68 */
+	SEQ_END,									/* 69 */
+	SEQ_OUT_LAST,								/* 70 bad_r1 */
+	SEQ_DESELECT,								/* 71 */
+	SEQ_FAIL, 2,								/* 72 */
+	SEQ_OUT_LAST,								/* 74 bad_token */
+	SEQ_DESELECT,								/* 75 */
+	SEQ_FAIL, 4,								/* 76 */
+};
+
+static const uint8_t seq_read_multi[] = {
+	SEQ_DESELECT,								/*  0 */
+	SEQ_SELECT,									/*  1 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  2 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  6 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/* 11 */
+	SEQ_DJNZ, 0, 6,								/* 15 */
+	SEQ_DESELECT,								/* 18 */
+	SEQ_FAIL, 1,								/* 19 */
+	SEQ_WRITE, 1, 0x52,							/* 21 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/* 24 */
+	SEQ_WRITE, 1, 0x01,							/* 27 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 30 */
+	SEQ_JNE, 0xff, 0x00, 92,					/* 35 */
+	SEQ_SETC_ARG, 1, 4,							/* 39 */
+	SEQ_SETC, 0, 0x00, 0x10,					/* 42 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/* 46 token */
+	SEQ_JNE, 0xff, 0xff, 61,					/* 51 */
+	SEQ_DJNZ, 0, 46,							/* 55 */
+	SEQ_DESELECT,								/* 58 */
+	SEQ_FAIL, 3,								/* 59 */
+	SEQ_JNE, 0xff, 0xfe, 96,					/* 61 got */
+	SEQ_READ, 0x02, 0x00,						/* 65 */
+	SEQ_SKIP, 0x00, 0x02,						/* 68 */
+	SEQ_DJNZ, 1, 42,							/* 71 */
+	SEQ_WRITE, 6, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x01,	/* 74 */
+	SEQ_SKIP, 0x00, 0x01,						/* 82 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 85 */
+	SEQ_DESELECT,								/* 90 */
+	SEQ_END,									/* 91 */
+	SEQ_OUT_LAST,								/* 92 bad_r1 */
+	SEQ_DESELECT,								/* 93 */
+	SEQ_FAIL, 2,								/* 94 */
+	SEQ_OUT_LAST,								/* 96 bad_token */
+	SEQ_DESELECT,								/* 97 */
+	SEQ_FAIL, 4,								/* 98 */
+};
+
+static const uint8_t seq_read_counted[] = {
+	SEQ_DESELECT,								/*   0 */
+	SEQ_SELECT,									/*   1 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*   2 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*   6 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/*  11 */
+	SEQ_DJNZ, 0, 6,								/*  15 */
+	SEQ_DESELECT,								/*  18 */
+	SEQ_FAIL, 1,								/*  19 */
+	SEQ_WRITE, 3, 0x57, 0x00, 0x00,				/*  21 cmd */
+	SEQ_WRITE_ARG, 4, 2,						/*  26 */
+	SEQ_WRITE, 1, 0x01,							/*  29 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  32 */
+	SEQ_JNE, 0xff, 0x00, 96,					/*  37 */
+	SEQ_WRITE, 1, 0x52,							/*  41 */
+	SEQ_WRITE_ARG, 0, 4,						/*  44 */
+	SEQ_WRITE, 1, 0x01,							/*  47 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  50 */
+	SEQ_JNE, 0xff, 0x00, 96,					/*  55 */
+	SEQ_SETC_ARG, 1, 4,							/*  59 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  62 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  66 token */
+	SEQ_JNE, 0xff, 0xff, 81,					/*  71 */
+	SEQ_DJNZ, 0, 66,							/*  75 */
+	SEQ_DESELECT,								/*  78 */
+	SEQ_FAIL, 3,								/*  79 */
+	SEQ_JNE, 0xff, 0xfe, 100,					/*  81 got */
+	SEQ_READ, 0x02, 0x00,						/*  85 */
+	SEQ_SKIP, 0x00, 0x02,						/*  88 */
+	SEQ_DJNZ, 1, 62,							/*  91 */
+	SEQ_DESELECT,								/*  94 */
+	SEQ_END,									/*  95 */
+	SEQ_OUT_LAST,								/*  96 bad_r1 */
+	SEQ_DESELECT,								/*  97 */
+	SEQ_FAIL, 2,								/*  98 */
+	SEQ_OUT_LAST,								/* 100 bad_token */
+	SEQ_DESELECT,								/* 101 */
+	SEQ_FAIL, 4,								/* 102 */
+};
+
+/* Read streams: seq_read_open is seq_read_multi without the CMD12 and the
+ * deselect at the end, and seq_read_cont reads the next blocks of the stream
+ * it left open, with the block count in arguments 0-1.
+ */
+static const uint8_t seq_read_open[] = {
+	SEQ_DESELECT,								/*  0 */
+	SEQ_SELECT,									/*  1 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  2 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  6 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/* 11 */
+	SEQ_DJNZ, 0, 6,								/* 15 */
+	SEQ_DESELECT,								/* 18 */
+	SEQ_FAIL, 1,								/* 19 */
+	SEQ_WRITE, 1, 0x52,							/* 21 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/* 24 */
+	SEQ_WRITE, 1, 0x01,							/* 27 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 30 */
+	SEQ_JNE, 0xff, 0x00, 75,					/* 35 */
+	SEQ_SETC_ARG, 1, 4,							/* 39 */
+	SEQ_SETC, 0, 0x00, 0x10,					/* 42 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/* 46 token */
+	SEQ_JNE, 0xff, 0xff, 61,					/* 51 */
+	SEQ_DJNZ, 0, 46,							/* 55 */
+	SEQ_DESELECT,								/* 58 */
+	SEQ_FAIL, 3,								/* 59 */
+	SEQ_JNE, 0xff, 0xfe, 79,					/* 61 got */
+	SEQ_READ, 0x02, 0x00,						/* 65 */
+	SEQ_SKIP, 0x00, 0x02,						/* 68 */
+	SEQ_DJNZ, 1, 42,							/* 71 */
+	SEQ_END,									/* 74 */
+	SEQ_OUT_LAST,								/* 75 bad_r1 */
+	SEQ_DESELECT,								/* 76 */
+	SEQ_FAIL, 2,								/* 77 */
+	SEQ_OUT_LAST,								/* 79 bad_token */
+	SEQ_DESELECT,								/* 80 */
+	SEQ_FAIL, 4,								/* 81 */
+};
+
+static const uint8_t seq_read_cont[] = {
+	SEQ_SETC_ARG, 1, 0,							/*  0 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  3 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  7 token */
+	SEQ_JNE, 0xff, 0xff, 22,					/* 12 */
+	SEQ_DJNZ, 0, 7,								/* 16 */
+	SEQ_DESELECT,								/* 19 */
+	SEQ_FAIL, 3,								/* 20 */
+	SEQ_JNE, 0xff, 0xfe, 36,					/* 22 got */
+	SEQ_READ, 0x02, 0x00,						/* 26 */
+	SEQ_SKIP, 0x00, 0x02,						/* 29 */
+	SEQ_DJNZ, 1, 3,								/* 32 */
+	SEQ_END,									/* 35 */
+	SEQ_OUT_LAST,								/* 36 bad_token */
+	SEQ_DESELECT,								/* 37 */
+	SEQ_FAIL, 4,								/* 38 */
+};
+
+/* Encrypted sectors: seq_read_open and seq_read_cont with each block
+ * decrypted by the adapter, the sector number in arguments 6-9 and 2-5.
+ */
+static const uint8_t seq_read_open_xts[] = {
+	SEQ_DESELECT,								/*  0 */
+	SEQ_SELECT,									/*  1 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  2 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  6 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/* 11 */
+	SEQ_DJNZ, 0, 6,								/* 15 */
+	SEQ_DESELECT,								/* 18 */
+	SEQ_FAIL, 1,								/* 19 */
+	SEQ_WRITE, 1, 0x52,							/* 21 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/* 24 */
+	SEQ_WRITE, 1, 0x01,							/* 27 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 30 */
+	SEQ_JNE, 0xff, 0x00, 77,					/* 35 */
+	SEQ_SETC_ARG, 1, 4,							/* 39 */
+	SEQ_SETC, 0, 0x00, 0x10,					/* 42 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/* 46 token */
+	SEQ_JNE, 0xff, 0xff, 61,					/* 51 */
+	SEQ_DJNZ, 0, 46,							/* 55 */
+	SEQ_DESELECT,								/* 58 */
+	SEQ_FAIL, 3,								/* 59 */
+	SEQ_JNE, 0xff, 0xfe, 81,					/* 61 got */
+	SEQ_READ, 0x02, 0x00,						/* 65 */
+	SEQ_XTS_OUT, 6,								/* 68 */
+	SEQ_SKIP, 0x00, 0x02,						/* 70 */
+	SEQ_DJNZ, 1, 42,							/* 73 */
+	SEQ_END,									/* 76 */
+	SEQ_OUT_LAST,								/* 77 bad_r1 */
+	SEQ_DESELECT,								/* 78 */
+	SEQ_FAIL, 2,								/* 79 */
+	SEQ_OUT_LAST,								/* 81 bad_token */
+	SEQ_DESELECT,								/* 82 */
+	SEQ_FAIL, 4,								/* 83 */
+};
+
+static const uint8_t seq_read_cont_xts[] = {
+	SEQ_SETC_ARG, 1, 0,							/*  0 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  3 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  7 token */
+	SEQ_JNE, 0xff, 0xff, 22,					/* 12 */
+	SEQ_DJNZ, 0, 7,								/* 16 */
+	SEQ_DESELECT,								/* 19 */
+	SEQ_FAIL, 3,								/* 20 */
+	SEQ_JNE, 0xff, 0xfe, 38,					/* 22 got */
+	SEQ_READ, 0x02, 0x00,						/* 26 */
+	SEQ_XTS_OUT, 2,								/* 29 */
+	SEQ_SKIP, 0x00, 0x02,						/* 31 */
+	SEQ_DJNZ, 1, 3,								/* 34 */
+	SEQ_END,									/* 37 */
+	SEQ_OUT_LAST,								/* 38 bad_token */
+	SEQ_DESELECT,								/* 39 */
+	SEQ_FAIL, 4,								/* 40 */
+};
+
+/* Writes the blocks of a CMD24 or CMD25 that sd_write_start() has sent,
+ * each encrypted by the adapter. Arguments: sector (4), data token (1) and
+ * block count (2). The card is left selected and busy with the last block.
+ */
+static const uint8_t seq_write_xts[] = {
+	SEQ_SETC_ARG, 1, 5,							/*  0 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  3 block */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  7 ready */
+	SEQ_JEQ, 0xff, 0xff, 21,					/* 12 */
+	SEQ_DJNZ, 0, 7,								/* 16 */
+	SEQ_FAIL, 1,								/* 19 */
+	SEQ_XTS_IN, 0,								/* 21 */
+	SEQ_WRITE_ARG, 4, 1,						/* 23 token */
+	SEQ_WRITE_IN, 0x02, 0x00,					/* 26 */
+	SEQ_WRITE, 2, 0xff, 0xff,					/* 29 crc */
+	SEQ_SKIP, 0x00, 0x01,						/* 33 data response */
+	SEQ_JNE, 0x1f, 0x05, 44,					/* 36 */
+	SEQ_DJNZ, 1, 3,								/* 40 */
+	SEQ_END,									/* 43 */
+	SEQ_OUT_LAST,								/* 44 bad_response */
+	SEQ_FAIL, 2,								/* 45 */
+};
+
+/* Scans by the adapter, see protocol/scan.h: seq_read_multi with each
+ * block scanned instead of returned, the state record of the scan taken
+ * from the input first and returned at the end. seq_scan_xts decrypts each
+ * block first, the sector number in arguments 6-9. seq_compare reads the
+ * blocks at the address in arguments 6-9 into the reference first, then
+ * compares the blocks at arguments 0-3 with it.
+ */
+static const uint8_t seq_scan[] = {
+	SEQ_SCAN_START,								/*   0 */
+	SEQ_DESELECT,								/*   1 */
+	SEQ_SELECT,									/*   2 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*   3 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*   7 ready */
+	SEQ_JEQ, 0xff, 0xff, 22,					/*  12 */
+	SEQ_DJNZ, 0, 7,								/*  16 */
+	SEQ_DESELECT,								/*  19 */
+	SEQ_FAIL, 1,								/*  20 */
+	SEQ_WRITE, 1, 0x52,							/*  22 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/*  25 */
+	SEQ_WRITE, 1, 0x01,							/*  28 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  31 */
+	SEQ_JNE, 0xff, 0x00, 96,					/*  36 */
+	SEQ_SETC_ARG, 1, 4,							/*  40 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  43 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  47 token */
+	SEQ_JNE, 0xff, 0xff, 62,					/*  52 */
+	SEQ_DJNZ, 0, 47,							/*  56 */
+	SEQ_DESELECT,								/*  59 */
+	SEQ_FAIL, 3,								/*  60 */
+	SEQ_JNE, 0xff, 0xfe, 100,					/*  62 got */
+	SEQ_READ, 0x02, 0x00,						/*  66 */
+	SEQ_SCAN, SCAN_FEED,						/*  69 */
+	SEQ_SKIP, 0x00, 0x02,						/*  71 */
+	SEQ_DJNZ, 1, 43,							/*  74 */
+	SEQ_WRITE, 6, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x01,	/*  77 */
+	SEQ_SKIP, 0x00, 0x01,						/*  85 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  88 */
+	SEQ_DESELECT,								/*  93 */
+	SEQ_SCAN_END,								/*  94 */
+	SEQ_END,									/*  95 */
+	SEQ_OUT_LAST,								/*  96 bad_r1 */
+	SEQ_DESELECT,								/*  97 */
+	SEQ_FAIL, 2,								/*  98 */
+	SEQ_OUT_LAST,								/* 100 bad_token */
+	SEQ_DESELECT,								/* 101 */
+	SEQ_FAIL, 4,								/* 102 */
+};
+
+static const uint8_t seq_scan_xts[] = {
+	SEQ_SCAN_START,								/*   0 */
+	SEQ_DESELECT,								/*   1 */
+	SEQ_SELECT,									/*   2 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*   3 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*   7 ready */
+	SEQ_JEQ, 0xff, 0xff, 22,					/*  12 */
+	SEQ_DJNZ, 0, 7,								/*  16 */
+	SEQ_DESELECT,								/*  19 */
+	SEQ_FAIL, 1,								/*  20 */
+	SEQ_WRITE, 1, 0x52,							/*  22 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/*  25 */
+	SEQ_WRITE, 1, 0x01,							/*  28 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  31 */
+	SEQ_JNE, 0xff, 0x00, 98,					/*  36 */
+	SEQ_SETC_ARG, 1, 4,							/*  40 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  43 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  47 token */
+	SEQ_JNE, 0xff, 0xff, 62,					/*  52 */
+	SEQ_DJNZ, 0, 47,							/*  56 */
+	SEQ_DESELECT,								/*  59 */
+	SEQ_FAIL, 3,								/*  60 */
+	SEQ_JNE, 0xff, 0xfe, 102,					/*  62 got */
+	SEQ_READ, 0x02, 0x00,						/*  66 */
+	SEQ_XTS_OUT, 6,								/*  69 */
+	SEQ_SCAN, SCAN_FEED,						/*  71 */
+	SEQ_SKIP, 0x00, 0x02,						/*  73 */
+	SEQ_DJNZ, 1, 43,							/*  76 */
+	SEQ_WRITE, 6, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x01,	/*  79 */
+	SEQ_SKIP, 0x00, 0x01,						/*  87 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  90 */
+	SEQ_DESELECT,								/*  95 */
+	SEQ_SCAN_END,								/*  96 */
+	SEQ_END,									/*  97 */
+	SEQ_OUT_LAST,								/*  98 bad_r1 */
+	SEQ_DESELECT,								/*  99 */
+	SEQ_FAIL, 2,								/* 100 */
+	SEQ_OUT_LAST,								/* 102 bad_token */
+	SEQ_DESELECT,								/* 103 */
+	SEQ_FAIL, 4,								/* 104 */
+};
+
+static const uint8_t seq_compare[] = {
+	SEQ_SCAN_START,								/*   0 */
+	SEQ_DESELECT,								/*   1 */
+	SEQ_SELECT,									/*   2 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*   3 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*   7 ready */
+	SEQ_JEQ, 0xff, 0xff, 22,					/*  12 */
+	SEQ_DJNZ, 0, 7,								/*  16 */
+	SEQ_DESELECT,								/*  19 */
+	SEQ_FAIL, 1,								/*  20 */
+	SEQ_WRITE, 1, 0x52,							/*  22 cmd */
+	SEQ_WRITE_ARG, 6, 4,						/*  25 */
+	SEQ_WRITE, 1, 0x01,							/*  28 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  31 */
+	SEQ_JNE, 0xff, 0x00, 186,					/*  36 */
+	SEQ_SETC_ARG, 1, 4,							/*  40 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  43 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/*  47 token */
+	SEQ_JNE, 0xff, 0xff, 62,					/*  52 */
+	SEQ_DJNZ, 0, 47,							/*  56 */
+	SEQ_DESELECT,								/*  59 */
+	SEQ_FAIL, 3,								/*  60 */
+	SEQ_JNE, 0xff, 0xfe, 190,					/*  62 got */
+	SEQ_READ, 0x02, 0x00,						/*  66 */
+	SEQ_SCAN, SCAN_REF,							/*  69 */
+	SEQ_SKIP, 0x00, 0x02,						/*  71 */
+	SEQ_DJNZ, 1, 43,							/*  74 */
+	SEQ_WRITE, 6, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x01,	/*  77 */
+	SEQ_SKIP, 0x00, 0x01,						/*  85 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/*  88 */
+	SEQ_SETC, 0, 0x00, 0x10,					/*  93 */
+	SEQ_UNTIL_EQ, 0xff, 0xff, 0xff, 0xff,		/*  97 ready */
+	SEQ_JEQ, 0xff, 0xff, 112,					/* 102 */
+	SEQ_DJNZ, 0, 97,							/* 106 */
+	SEQ_DESELECT,								/* 109 */
+	SEQ_FAIL, 1,								/* 110 */
+	SEQ_WRITE, 1, 0x52,							/* 112 cmd */
+	SEQ_WRITE_ARG, 0, 4,						/* 115 */
+	SEQ_WRITE, 1, 0x01,							/* 118 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 121 */
+	SEQ_JNE, 0xff, 0x00, 186,					/* 126 */
+	SEQ_SETC_ARG, 1, 4,							/* 130 */
+	SEQ_SETC, 0, 0x00, 0x10,					/* 133 block */
+	SEQ_UNTIL_NE, 0xff, 0xff, 0xff, 0xff,		/* 137 token */
+	SEQ_JNE, 0xff, 0xff, 152,					/* 142 */
+	SEQ_DJNZ, 0, 137,							/* 146 */
+	SEQ_DESELECT,								/* 149 */
+	SEQ_FAIL, 3,								/* 150 */
+	SEQ_JNE, 0xff, 0xfe, 190,					/* 152 got */
+	SEQ_READ, 0x02, 0x00,						/* 156 */
+	SEQ_SCAN, SCAN_CMP,							/* 159 */
+	SEQ_SKIP, 0x00, 0x02,						/* 161 */
+	SEQ_DJNZ, 1, 133,							/* 164 */
+	SEQ_WRITE, 6, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x01,	/* 167 */
+	SEQ_SKIP, 0x00, 0x01,						/* 175 */
+	SEQ_UNTIL_EQ, 0x80, 0x00, 0x00, 0x0a,		/* 178 */
+	SEQ_DESELECT,								/* 183 */
+	SEQ_SCAN_END,								/* 184 */
+	SEQ_END,									/* 185 */
+	SEQ_OUT_LAST,								/* 186 bad_r1 */
+	SEQ_DESELECT,								/* 187 */
+	SEQ_FAIL, 2,								/* 188 */
+	SEQ_OUT_LAST,								/* 190 bad_token */
+	SEQ_DESELECT,								/* 191 */
+	SEQ_FAIL, 4,								/* 192 */
+};
+
+/* AU_SIZE of SD_STATUS in sectors, 16 KiB to 64 MiB */
+static const uint32_t au_size_sectors[16] = {
+	0, 32, 64, 128, 256, 512, 1024, 2048,
+	4096, 8192, 16384, 24576, 32768, 49152, 65536, 131072,
+};
+
+/* SPEED_CLASS of SD_STATUS */
+static const uint8_t speed_classes[5] = {0, 2, 4, 6, 10};
+
+/* Timeouts in timer ticks, computed once by sd_open() since the tick
+ * frequency is only known at run time.
+ */
+static uint32_t ready_timeout_ticks;
+static uint32_t erase_timeout_ticks;
 
 /*! Utility function for parsing CSD fields */
 static int sd_parse_csd(sd_card_info_t *ci, const uint32_t *bits)
@@ -134,6 +647,17 @@ static int sd_parse_csd(sd_card_info_t *ci, const uint32_t *bits)
 	return 0;
 }
 
+/*! Utility function for parsing SD_STATUS fields */
+static void sd_parse_status(sd_card_info_t *ci, const uint8_t *status)
+{
+	ci->au_sectors = au_size_sectors[status[10] >> 4];
+	ci->speed_class = status[8] < sizeof(speed_classes) ? speed_classes[status[8]] : 0;
+
+	INFO("AU %u sectors, speed class %u\n",
+			(unsigned int)ci->au_sectors,
+			(unsigned int)ci->speed_class);
+}
+
 /*! Utility function for parsing CID fields */
 static int sd_parse_cid(sd_card_info_t *ci, const uint32_t *bits)
 {
@@ -175,14 +699,49 @@ static int sd_parse_cid(sd_card_info_t *ci, const uint32_t *bits)
 }
 
 
-static int sd_wait_ready(void)
+/* A read or write that may be the first since sd_select() */
+static void sd_spi_read(uint8_t *buf, uint32_t size)
+{
+	if (card->select_pending) {
+		card->select_pending = 0;
+		spi_read_sel(buf, size);
+	} else {
+		spi_read(buf, size);
+	}
+}
+
+static void sd_spi_write(const uint8_t *buf, uint32_t size)
+{
+	if (card->select_pending) {
+		card->select_pending = 0;
+		spi_write_sel(buf, size);
+	} else {
+		spi_write(buf, size);
+	}
+}
+
+/* The last read of a transaction, which also deselects the card if deselect
+ * is set.
+ */
+static void sd_read_end(uint8_t *buf, uint32_t size, int deselect)
+{
+	if (deselect) {
+		spi_read_desel(buf, size);
+		card->selected = 0;
+	} else {
+		spi_read(buf, size);
+	}
+}
+
+static int sd_wait_ready(uint32_t timeout_ticks)
 {
 	uint32_t timeout;
 	uint8_t in;
 
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
+	timeout = timer_get_tick_count() + timeout_ticks;
 	do {
-		spi_read(&in, 1);
+		sd_spi_read(&in, 1);
+		sd_stats.ready_polls++;
 	} while (in != 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
 
 	return (in == 0xff) ? 0 : sdError_Timeout;
@@ -190,30 +749,42 @@ static int sd_wait_ready(void)
 
 static void sd_deselect(void)
 {
-	spi_deselect();
+	if (card->selected && !card->select_pending) {
+		spi_deselect();
+	}
+	card->selected = 0;
+	card->select_pending = 0;
 }
 
+/* Selects the card unless it already is, and waits for it to be ready if it
+ * may be busy.
+ */
 static int sd_select(void)
 {
-	spi_select();
-	if (sd_wait_ready() == 0) {
+	if (!card->selected) {
+		card->selected = 1;
+		card->select_pending = 1;
+	}
+	if (!card->busy || sd_wait_ready(ready_timeout_ticks) == 0) {
+		card->busy = 0;
 		return 0;
 	}
-	spi_deselect();
+	sd_deselect();
 
 	ERROR("Timeout waiting for card ready\n");
 	return sdError_Timeout;
 }
 
-static int sd_read_block(uint8_t *buf, unsigned int size)
+static int sd_read_block(uint8_t *buf, unsigned int size, int deselect)
 {
 	uint32_t timeout;
 	uint8_t token, crc[2];
 
 	/* Wait for data start token */
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
+	timeout = timer_get_tick_count() + ready_timeout_ticks;
 	do {
 		spi_read(&token, 1);
+		sd_stats.token_polls++;
 	} while (token == 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
 	if (token != 0xfe) {
 		ERROR("No data token received\n");
@@ -222,30 +793,36 @@ static int sd_read_block(uint8_t *buf, unsigned int size)
 
 	/* Read data */
 	spi_read(buf, size);
-	spi_read(crc, 2);
+	sd_read_end(crc, 2, deselect);
 
 	return 0;
 }
 
-static int sd_write_block(const uint8_t *buf, uint8_t token)
+static int sd_write_block(const uint8_t *buf, uint8_t token, int deselect)
 {
 	uint8_t crc[2] = {0xff, 0xff};
+	uint8_t start[2] = {0xff, 0xff};
 	uint8_t resp;
 
-	if (sd_wait_ready() < 0) {
+	/* Wait for the previous block to be programmed */
+	if (card->busy && sd_wait_ready(ready_timeout_ticks) < 0) {
 		ERROR("Card not ready\n");
 		return sdError_Timeout;
 	}
 
-	/* Send token */
-	spi_write(&token, 1);
+	/* Send token, after the byte the card needs following the command
+	 * response (Nwr)
+	 */
+	start[1] = token;
+	spi_write(start, 2);
+	card->busy = 1;
 	if (token == 0xfd) {
 		/* After sending STOP_TRAN, a byte needs to be read before the card
 		 * goes busy. This byte is undefined, so unless we read it now, the
 		 * next sd_wait_ready() will read it and could erronously decide
 		 * that the card is immediately ready.
 		 */
-		spi_read(&resp, 1);
+		sd_read_end(&resp, 1, deselect);
 	}
 	else {
 		/* Send data */
@@ -253,7 +830,7 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
 		spi_write(crc, 2); /* dummy */
 
 		/* Receive data response */
-		spi_read(&resp, 1);
+		sd_read_end(&resp, 1, deselect);
 		if ((resp & 0x1f) != 0x05) {
 			ERROR("Bad response\n");
 			return sdError_BadResponse;
@@ -278,14 +855,17 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 		}
 	}
 
-	/* Select the card and wait for ready except for abort */
+	/* Select the card and wait for ready except for abort, which is sent
+	 * while the card is sending data
+	 */
 	if (cmd != CMD12) {
-		sd_deselect();
 		if (sd_select() < 0) {
 			return 0xff;
 		}
 	}
 
+	sd_stats.commands++;
+
 	/* Build command */
 	buf[0] = 0x40 | cmd;
 	buf[1] = (uint8_t)(arg >> 24);
@@ -299,24 +879,184 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 	} else {
 		buf[5] = 0x01; /* Dummy CRC and stop */
 	}
-	spi_write(buf, sizeof(buf));
+	sd_spi_write(buf, sizeof(buf));
 
 	/* Receive command response */
+	res = 0xff;
+	n = 0;
 	if (cmd == CMD12) {
-		/* Skip first byte */
-		spi_read(&res, 1);
+		/* Skip first byte, and leave the card to finish with busy */
+		spi_read(buf, 2);
+		res = buf[1];
+		sd_stats.response_polls++;
+		card->busy = 1;
+		n = 1;
+	} else if (cmd == CMD38) {
+		/* R1b, the card is busy until the erase is done */
+		card->busy = 1;
 	}
 
-	for (n = 0; n < MAX_RESPONSE_POLLS; n++) {
+	for (; n < MAX_RESPONSE_POLLS && (res & 0x80); n++) {
 		spi_read(&res, 1);
-		if (!(res & 0x80)) {
-			break;
-		}
+		sd_stats.response_polls++;
+	}
+	if (res & 0x80) {
+		card->busy = 1;
 	}
 
 	return res;
 }
 
+/* Loads the read programs into the adapter's sequencer, if it has one with
+ * room for them.
+ */
+static void sd_seq_init(void)
+{
+	const struct spi_caps *caps = spi_get_caps();
+
+	card->seq_loaded = 0;
+	card->seq_counted = 0;
+	card->seq_stream = 0;
+	card->seq_scan = 0;
+	if (caps->seq_slots <= SEQ_SLOT_READ_MULTI || caps->buffer_size < SD_SECTOR_SIZE) {
+		return;
+	}
+
+	if (spi_seq_load(SEQ_SLOT_READ_SINGLE, seq_read_single, sizeof(seq_read_single)) < 0 ||
+			spi_seq_load(SEQ_SLOT_READ_MULTI, seq_read_multi, sizeof(seq_read_multi)) < 0) {
+		ERROR("Failed to load sequencer programs\n");
+		return;
+	}
+
+	if (card->info.set_block_count && caps->seq_slots > SEQ_SLOT_READ_COUNTED &&
+			spi_seq_load(SEQ_SLOT_READ_COUNTED, seq_read_counted, sizeof(seq_read_counted)) == 0) {
+		card->seq_counted = 1;
+	}
+
+	if (caps->seq_slots > SEQ_SLOT_READ_CONT &&
+			spi_seq_load(SEQ_SLOT_READ_OPEN, seq_read_open, sizeof(seq_read_open)) == 0 &&
+			spi_seq_load(SEQ_SLOT_READ_CONT, seq_read_cont, sizeof(seq_read_cont)) == 0) {
+		card->seq_stream = 1;
+	}
+
+	if ((caps->features & CAPS_FEATURE_SCAN) && caps->seq_slots > SEQ_SLOT_COMPARE &&
+			spi_seq_load(SEQ_SLOT_SCAN, seq_scan, sizeof(seq_scan)) == 0 &&
+			spi_seq_load(SEQ_SLOT_SCAN_XTS, seq_scan_xts, sizeof(seq_scan_xts)) == 0 &&
+			spi_seq_load(SEQ_SLOT_COMPARE, seq_compare, sizeof(seq_compare)) == 0) {
+		card->seq_scan = 1;
+	}
+
+	seq_max_sectors = caps->buffer_size / SD_SECTOR_SIZE;
+	card->seq_loaded = 1;
+}
+
+/* Takes the result of a sequencer read that should have returned size
+ * bytes. After a failure the card is taken to be selected and busy, so that
+ * it is deselected and waited for.
+ */
+static int sd_seq_result(int status, unsigned long out_len, unsigned long size)
+{
+	if (status == SEQ_STATUS_OK && out_len == size) {
+		/* The card is ready after a read */
+		card->busy = 0;
+		return 0;
+	}
+
+	ERROR("Sequencer read failed (%d)\n", status);
+	card->busy = 1;
+	card->selected = 1;
+	if (status == 1 || status == 3 || status == SPI_SEQ_TIMEOUT) {
+		return sdError_Timeout;
+	}
+	return sdError_BadResponse;
+}
+
+/* Reads count (at most seq_max_sectors) sectors with one sequencer run.
+ * The card is deselected unless the run failed.
+ */
+static int sd_seq_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	uint8_t args[6];
+	unsigned long out_len;
+	int status;
+
+	if (card->info.type != sdCardType_SDHC) {
+		sector <<= 9;
+	}
+
+	args[0] = (uint8_t)(sector >> 24);
+	args[1] = (uint8_t)(sector >> 16);
+	args[2] = (uint8_t)(sector >> 8);
+	args[3] = (uint8_t)(sector >> 0);
+	args[4] = (uint8_t)(count >> 8);
+	args[5] = (uint8_t)(count >> 0);
+
+	if (count == 1) {
+		status = spi_seq_run(SEQ_SLOT_READ_SINGLE, args, 4, 0, 0, buf, SD_SECTOR_SIZE, &out_len);
+		sd_stats.commands++;
+	} else {
+		status = spi_seq_run(card->seq_counted ? SEQ_SLOT_READ_COUNTED : SEQ_SLOT_READ_MULTI,
+				args, 6, 0, 0, buf, count * SD_SECTOR_SIZE, &out_len);
+		sd_stats.commands += 2;
+	}
+
+	return sd_seq_result(status, out_len, count * SD_SECTOR_SIZE);
+}
+
+/* Reads count (at most seq_max_sectors) sectors of the read stream with one
+ * sequencer run, opening it at sector first unless it is open. The card is
+ * left selected unless the run failed.
+ */
+static int sd_seq_read_stream(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	uint8_t args[10];
+	uint8_t *lba;
+	uint32_t addr = sector;
+	unsigned long out_len;
+	int slot, argc, status;
+
+	if (card->stream == STREAM_READ) {
+		args[0] = (uint8_t)(count >> 8);
+		args[1] = (uint8_t)(count >> 0);
+		lba = &args[2];
+		slot = card->crypt ? SEQ_SLOT_READ_CONT_XTS : SEQ_SLOT_READ_CONT;
+	} else {
+		if (card->info.type != sdCardType_SDHC) {
+			addr <<= 9;
+		}
+
+		args[0] = (uint8_t)(addr >> 24);
+		args[1] = (uint8_t)(addr >> 16);
+		args[2] = (uint8_t)(addr >> 8);
+		args[3] = (uint8_t)(addr >> 0);
+		args[4] = (uint8_t)(count >> 8);
+		args[5] = (uint8_t)(count >> 0);
+		lba = &args[6];
+		slot = card->crypt ? SEQ_SLOT_READ_OPEN_XTS : SEQ_SLOT_READ_OPEN;
+		sd_stats.commands++;
+	}
+
+	/* The sector number that the XTS programs decrypt the first block for */
+	lba[0] = (uint8_t)(sector >> 24);
+	lba[1] = (uint8_t)(sector >> 16);
+	lba[2] = (uint8_t)(sector >> 8);
+	lba[3] = (uint8_t)(sector >> 0);
+	argc = card->crypt ? lba - args + 4 : lba - args;
+
+	status = spi_seq_run(slot, args, argc, 0, 0, buf, count * SD_SECTOR_SIZE, &out_len);
+
+	int err = sd_seq_result(status, out_len, count * SD_SECTOR_SIZE);
+	if (err < 0) {
+		card->stream = STREAM_NONE;
+		return err;
+	}
+
+	card->stream = STREAM_READ;
+	card->selected = 1;
+	card->select_pending = 0;
+	return 0;
+}
+
 static uint32_t sd_get_r7_resp(void)
 {
 	uint8_t buf[4];
@@ -327,7 +1067,7 @@ static uint32_t sd_get_r7_resp(void)
 
 int sd_open(void)
 {
-	sd_card_info_t *ci = &sd_card_info;
+	sd_card_info_t *ci = &card->info;
 	uint32_t timeout;
 	uint8_t cmd;
 	uint32_t resp[4];
@@ -335,14 +1075,27 @@ int sd_open(void)
 
 	FUNCTION_TRACE;
 
+	ready_timeout_ticks = TIMER_MILLIS(READY_TIMEOUT_MS);
+	erase_timeout_ticks = TIMER_MILLIS(ERASE_TIMEOUT_MS);
+	card->seq_loaded = 0;
+	card->busy = 1;
+	card->stream = STREAM_NONE;
+
 	spi_set_speed(SPI_SPEED_SLOW);
 	ci->type = sdCardType_None;
 	//ci->capacity = 0;
 	ci->total_sectors = 0;
 	ci->block_size = sdBlockSize_512;
+	ci->set_block_count = 0;
+	ci->can_erase = 0;
+	ci->erased_byte = 0;
+	ci->au_sectors = 0;
+	ci->speed_class = 0;
 
 	/* Send dummy clocks with CS high (doing this sends 96 clocks) */
-	sd_deselect();
+	spi_deselect();
+	card->selected = 0;
+	card->select_pending = 0;
 	sd_get_r7_resp();
 	sd_get_r7_resp();
 	sd_get_r7_resp();
@@ -358,6 +1111,7 @@ int sd_open(void)
 				/* Wait for card ready */
 				timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
 				while (sd_send_cmd(ACMD41, (1ul << 30)) > 0) {
+					sd_stats.retries++;
 					if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
 						/* Init timed out - invalidate card */
 						ERROR("Init timed out\n");
@@ -395,6 +1149,7 @@ int sd_open(void)
 			/* Wait for card ready */
 			timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
 			while (sd_send_cmd(cmd, 0) > 0) {
+				sd_stats.retries++;
 				if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
 					/* Init timed out - invalidate card */
 					ERROR("Init timed out\n");
@@ -417,7 +1172,7 @@ int sd_open(void)
 
 		/* Read and decode card info */
 		if (sd_send_cmd(CMD10, 0) == 0) {
-			err = sd_read_block((uint8_t*)&resp, sizeof(resp));
+			err = sd_read_block((uint8_t*)&resp, sizeof(resp), 0);
 			if (err < 0) {
 				ERROR("Read CID failed\n");
 			}
@@ -429,7 +1184,7 @@ int sd_open(void)
 		}
 		if (err == 0) {
 			if (sd_send_cmd(CMD9, 0) == 0) {
-				err = sd_read_block((uint8_t*)&resp, sizeof(resp));
+				err = sd_read_block((uint8_t*)&resp, sizeof(resp), 0);
 				if (err < 0) {
 					ERROR("Read CSD failed\n");
 				}
@@ -440,9 +1195,41 @@ int sd_open(void)
 		if (err == 0) {
 			err = sd_parse_csd(ci, resp);
 		}
+		if (err == 0 && ci->type != sdCardType_MMC) {
+			/* The SCR says whether the card takes CMD23, and what erased
+			 * blocks read as. Cards before version 3.0 don't take CMD23,
+			 * so a failure here is not an error.
+			 */
+			if (sd_send_cmd(ACMD51, 0) == 0 && sd_read_block((uint8_t*)&resp, 8, 0) == 0) {
+				const uint8_t *scr = (const uint8_t*)resp;
+
+				ci->set_block_count = (scr[3] >> 1) & 0x1;
+				ci->erased_byte = (scr[1] & 0x80) ? 0xff : 0x00;
+
+				/* Erase is command class 5 */
+				ci->can_erase = (ci->csd.card_command_classes >> 5) & 0x1;
+			}
+			TRACE("CMD23 %ssupported\n", ci->set_block_count ? "" : "not ");
+
+			/* SD_STATUS has the allocation unit size and speed class. Its
+			 * response is R2, one status byte more than R1.
+			 */
+			if (sd_send_cmd(ACMD13, 0) == 0) {
+				uint8_t status[64];
+
+				spi_read(status, 1);
+				if (status[0] == 0 && sd_read_block(status, sizeof(status), 0) == 0) {
+					sd_parse_status(ci, status);
+				}
+			}
+		}
 
 		/* Switch to fast clock */
 		spi_set_speed(SPI_SPEED_FAST);
+
+		if (err == 0) {
+			sd_seq_init();
+		}
 	} else {
 		/* Card not present */
 		err = sdError_NoCard;
@@ -453,61 +1240,172 @@ int sd_open(void)
 	return err;
 }
 
+/* Ends the stream of the current card, if one is open: a read with CMD12,
+ * a write with the STOP_TRAN token. The card is deselected.
+ */
+int sd_stream_close(void)
+{
+	int err = 0;
+
+	if (card->stream == STREAM_READ) {
+		if (sd_send_cmd(CMD12, 0) != 0) {
+			err = sdError_BadResponse;
+		}
+	} else if (card->stream == STREAM_WRITE) {
+		err = sd_write_block(0, 0xfd, 1);
+	}
+	card->stream = STREAM_NONE;
+
+	sd_deselect();
+
+	return err;
+}
+
+/* Closes the stream of the current card unless a read or a write has used
+ * it since the last call. Returns 1 if it is still open.
+ */
+int sd_stream_idle(void)
+{
+	if (card->stream == STREAM_NONE) {
+		return 0;
+	}
+	if (card->stream_used) {
+		card->stream_used = 0;
+		return 1;
+	}
+	sd_stream_close();
+	return 0;
+}
+
+/* Reads the next count blocks of the read stream */
+static int sd_stream_read(uint8_t *buf, uint32_t count)
+{
+	int err = 0;
+
+	while (count-- && err == 0) {
+		err = sd_read_block(buf, SD_SECTOR_SIZE, 0);
+		buf += SD_SECTOR_SIZE;
+	}
+	return err;
+}
+
+/* A read that continues the read stream takes the next blocks of it, any
+ * other read closes the stream. A read of more than one block opens a new
+ * stream and leaves it open. With the sequencer, a card is only read with
+ * streams if the adapter has room for their programs. An encrypted card is
+ * always read with streams, even a single block.
+ */
 int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
 {
-	sd_card_info_t *ci = &sd_card_info;
+	sd_card_info_t *ci = &card->info;
+	uint32_t addr = sector;
 	int err = 0;
 
 	if (ci->type == sdCardType_None) {
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
+
+	if (card->crypt && !card->seq_loaded) {
+		return sdError_Unsupported;
+	}
+
+	if (card->stream != STREAM_READ || sector != card->stream_next) {
+		sd_stream_close();
+	}
+
+	if (card->seq_loaded) {
+		/* Let the adapter run the whole command */
+		while (count) {
+			uint32_t n = count < seq_max_sectors ? count : seq_max_sectors;
+
+			if (card->crypt || (card->seq_stream && (card->stream == STREAM_READ || count > 1))) {
+				err = sd_seq_read_stream(buf, sector, n);
+			} else {
+				err = sd_seq_read(buf, sector, n);
+			}
+			if (err < 0) {
+				sd_deselect();
+				break;
+			}
+			buf += n * SD_SECTOR_SIZE;
+			sector += n;
+			count -= n;
+		}
+		if (card->stream == STREAM_READ) {
+			card->stream_next = sector;
+			card->stream_used = 1;
+		}
+		return err;
+	}
+
 	if (ci->type != sdCardType_SDHC) {
 		/* Convert sector to byte addressing (x512) */
-		sector <<= 9;
+		addr <<= 9;
 	}
 
-	if (count == 1) {
+	if (card->stream == STREAM_READ) {
+		err = sd_stream_read(buf, count);
+	} else if (count == 1) {
 		/* Read single sector */
-		if (sd_send_cmd(CMD17, sector) == 0) {
-			err = sd_read_block(buf, SD_SECTOR_SIZE);
+		if (sd_send_cmd(CMD17, addr) == 0) {
+			err = sd_read_block(buf, SD_SECTOR_SIZE, 1);
 		} else {
 			err = sdError_BadResponse;
 		}
 	} else if (count > 1) {
-		/* Read multiple sectors */
-		if (sd_send_cmd(CMD18, sector) == 0) {
-			do {
-				err = sd_read_block(buf, SD_SECTOR_SIZE);
-				if (err < 0) {
-					break;
-				}
-				buf += SD_SECTOR_SIZE;
-			} while (--count);
-
-			/* Send CMD12 stop transmission */
-			if (err == 0) {
-				err = sd_send_cmd(CMD12, 0);
-			}
+		/* Read multiple sectors, until sd_stream_close() */
+		if (sd_send_cmd(CMD18, addr) == 0) {
+			card->stream = STREAM_READ;
+			err = sd_stream_read(buf, count);
 		} else {
 			err = sdError_BadResponse;
 		}
 	}
 
-	sd_deselect();
+	if (err == 0 && card->stream == STREAM_READ) {
+		card->stream_next = sector + count;
+		card->stream_used = 1;
+	} else {
+		card->stream = STREAM_NONE;
+		sd_deselect();
+	}
 
 	return err;
 }
 
-int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+int sd_write_start(uint32_t sector, uint32_t count)
 {
-	sd_card_info_t *ci = &sd_card_info;
-	int err = 0;
+	sd_card_info_t *ci = &card->info;
+	uint8_t cmd;
+
+	card->write_multi = 0;
+	card->write_failed = 1;
 
 	if (ci->type == sdCardType_None) {
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
+	if (card->crypt && !card->seq_loaded) {
+		return sdError_Unsupported;
+	}
+	card->write_sector = sector;
+
+	/* Continue the write stream, or close the stream that is open. A write
+	 * that starts an allocation unit gets a CMD25 of its own, with the
+	 * pre-erase count for it.
+	 */
+	if (card->stream == STREAM_WRITE && sector == card->stream_next &&
+			(ci->au_sectors == 0 || sector % ci->au_sectors != 0)) {
+		card->stream_next += count;
+		card->stream_used = 1;
+		card->write_multi = 1;
+		card->write_failed = 0;
+		return 0;
+	}
+	sd_stream_close();
+
+	card->stream_next = sector + count;
 	if (ci->type != sdCardType_SDHC) {
 		/* Convert sector to byte addressing (x512) */
 		sector <<= 9;
@@ -515,33 +1413,172 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
 
 	if (count == 1) {
 		/* Write single sector */
-		if (sd_send_cmd(CMD24, sector) == 0) {
-			err = sd_write_block(buf, 0xfe);
-		} else {
-			err = sdError_BadResponse;
-		}
-	} else if (count > 1) {
+		cmd = CMD24;
+	} else {
 		if (ci->type == sdCardType_SD1_x || ci->type == sdCardType_SD2_0 || ci->type == sdCardType_SDHC) {
 			/* Pre-defined sector count */
 			sd_send_cmd(ACMD23, count);
 		}
 		/* Write multiple sectors */
-		if (sd_send_cmd(CMD25, sector) == 0) {
-			do {
-				err = sd_write_block(buf, 0xfc);
-				if (err < 0) {
-					break;
-				}
-				buf += SD_SECTOR_SIZE;
-			} while (--count);
+		cmd = CMD25;
+	}
+
+	if (sd_send_cmd(cmd, sector) != 0) {
+		sd_deselect();
+		return sdError_BadResponse;
+	}
+
+	card->write_multi = count > 1;
+	card->write_failed = 0;
+	if (card->write_multi) {
+		card->stream = STREAM_WRITE;
+		card->stream_used = 1;
+	}
+	return 0;
+}
 
-			/* Send STOP_TRAN */
-			if (err == 0) {
-				err = sd_write_block(0, 0xfd);
+/* Writes count blocks of the current write with sequencer runs, in which
+ * the adapter encrypts each block before it sends it.
+ */
+static int sd_seq_write_xts(const uint8_t *buf, uint32_t count)
+{
+	uint8_t args[7];
+	uint8_t resp;
+	unsigned long out_len;
+
+	while (count) {
+		uint32_t n = count < seq_max_sectors ? count : seq_max_sectors;
+		uint32_t sector = card->write_sector;
+
+		args[0] = (uint8_t)(sector >> 24);
+		args[1] = (uint8_t)(sector >> 16);
+		args[2] = (uint8_t)(sector >> 8);
+		args[3] = (uint8_t)(sector >> 0);
+		args[4] = card->write_multi ? 0xfc : 0xfe;
+		args[5] = (uint8_t)(n >> 8);
+		args[6] = (uint8_t)(n >> 0);
+
+		int status = spi_seq_run(SEQ_SLOT_WRITE_XTS, args, sizeof(args), buf, n * SD_SECTOR_SIZE, &resp, 1, &out_len);
+		card->busy = 1;
+		if (status != SEQ_STATUS_OK) {
+			ERROR("Sequencer write failed (%d)\n", status);
+			card->write_failed = 1;
+			if (status == 1 || status == SPI_SEQ_TIMEOUT) {
+				return sdError_Timeout;
 			}
-		} else {
+			return sdError_BadResponse;
+		}
+
+		buf += n * SD_SECTOR_SIZE;
+		card->write_sector += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int sd_write_blocks(const uint8_t *buf, uint32_t count)
+{
+	int err;
+
+	if (card->write_failed) {
+		return sdError_BadResponse;
+	}
+	if (card->crypt) {
+		return sd_seq_write_xts(buf, count);
+	}
+
+	while (count--) {
+		err = sd_write_block(buf, card->write_multi ? 0xfc : 0xfe, !card->write_multi);
+		if (err < 0) {
+			card->write_failed = 1;
+			return err;
+		}
+		buf += SD_SECTOR_SIZE;
+	}
+
+	return 0;
+}
+
+/* Ends a write. A multiple block write that went well is left open as the
+ * write stream, for the next write to continue or sd_stream_close() to end
+ * with STOP_TRAN.
+ */
+int sd_write_stop(void)
+{
+	if (card->write_multi && !card->write_failed) {
+		card->write_multi = 0;
+		return 0;
+	}
+	card->write_multi = 0;
+	card->stream = STREAM_NONE;
+
+	sd_deselect();
+
+	return 0;
+}
+
+int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	int err, stop;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	err = sd_write_start(sector, count);
+	if (err < 0) {
+		return err;
+	}
+
+	err = sd_write_blocks(buf, count);
+	stop = sd_write_stop();
+
+	return err < 0 ? err : stop;
+}
+
+int sd_erase(uint32_t sector, uint32_t count)
+{
+	sd_card_info_t *ci = &card->info;
+	int err = 0;
+
+	if (ci->type == sdCardType_None) {
+		ERROR("No card\n");
+		return sdError_NoCard;
+	}
+	if (!ci->can_erase) {
+		return sdError_Unsupported;
+	}
+
+	sd_stream_close();
+
+	while (count && err == 0) {
+		uint32_t n = count < ERASE_MAX_SECTORS ? count : ERASE_MAX_SECTORS;
+		uint32_t first = sector;
+		uint32_t last = sector + n - 1;
+
+		if (ci->type != sdCardType_SDHC) {
+			/* Convert sector to byte addressing (x512) */
+			first <<= 9;
+			last <<= 9;
+		}
+
+		if (sd_send_cmd(CMD32, first) != 0 || sd_send_cmd(CMD33, last) != 0 ||
+				sd_send_cmd(CMD38, 0) != 0) {
 			err = sdError_BadResponse;
+			break;
 		}
+
+		/* Wait here, the erase may take longer than a command's ready wait */
+		if (sd_wait_ready(erase_timeout_ticks) < 0) {
+			ERROR("Erase timed out\n");
+			err = sdError_Timeout;
+			break;
+		}
+		card->busy = 0;
+
+		sector += n;
+		count -= n;
 	}
 
 	sd_deselect();
@@ -549,7 +1586,217 @@ int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
 	return err;
 }
 
+/* Makes card n, on chip select n of the adapter, the current card. The
+ * stream of the card that was current is closed and it is deselected first,
+ * so it can finish programming while the new one is used.
+ */
+int sd_set_card(int n)
+{
+	if (n < 0 || n >= SD_MAX_CARDS) {
+		return sdError_Unsupported;
+	}
+	if (&sd_cards[n] == card && !released) {
+		return 0;
+	}
+
+	sd_stream_close();
+	if (spi_select_device(n) < 0) {
+		return sdError_Unsupported;
+	}
+
+	card = &sd_cards[n];
+	released = 0;
+	return 0;
+}
+
+/* Deselects the current card so that another device on the SPI can be used.
+ * The next sd_set_card() switches the adapter back to a card.
+ */
+void sd_release(void)
+{
+	sd_stream_close();
+	released = 1;
+}
+
+/* Has the adapter encrypt the sectors of the current card with key, AES-128
+ * in XTS mode with the sector number as the tweak (see protocol/crypt.h),
+ * or goes back to plain sectors if key is NULL. The key stays with the card
+ * through card changes. The adapter needs the CRYPT command and room in its
+ * sequencer for the XTS programs.
+ */
+int sd_set_key(const uint8_t *key)
+{
+	const struct spi_caps *caps = spi_get_caps();
+
+	sd_stream_close();
+
+	if (!key) {
+		card->crypt = 0;
+		spi_crypt_key(0);
+		return 0;
+	}
+
+	if (!card->seq_loaded || caps->seq_slots <= SEQ_SLOT_WRITE_XTS) {
+		return sdError_Unsupported;
+	}
+	if (spi_seq_load(SEQ_SLOT_READ_OPEN_XTS, seq_read_open_xts, sizeof(seq_read_open_xts)) != 0 ||
+			spi_seq_load(SEQ_SLOT_READ_CONT_XTS, seq_read_cont_xts, sizeof(seq_read_cont_xts)) != 0 ||
+			spi_seq_load(SEQ_SLOT_WRITE_XTS, seq_write_xts, sizeof(seq_write_xts)) != 0 ||
+			spi_crypt_key(key) != 0) {
+		return sdError_Unsupported;
+	}
+
+	card->crypt = 1;
+	return 0;
+}
+
+/* Runs a scan program on count sectors, carrying on the scan in state. The
+ * address and any other arguments are in args, the count is filled in. The
+ * state is only updated if the run succeeded.
+ */
+static int sd_seq_scan(int slot, uint8_t *args, int argc, uint8_t *state, uint32_t count)
+{
+	uint8_t out[SCAN_STATE_SIZE];
+	unsigned long out_len;
+
+	args[4] = (uint8_t)(count >> 8);
+	args[5] = (uint8_t)(count >> 0);
+
+	int status = spi_seq_run(slot, args, argc, state, SCAN_STATE_SIZE, out, sizeof(out), &out_len);
+	sd_stats.commands += slot == SEQ_SLOT_COMPARE ? 4 : 2;
+
+	int err = sd_seq_result(status, out_len, SCAN_STATE_SIZE);
+	if (err == 0) {
+		memcpy(state, out, SCAN_STATE_SIZE);
+	}
+	return err;
+}
+
+/* Puts the address of sector into args, as the card takes it */
+static void sd_seq_address(uint8_t *args, uint32_t sector)
+{
+	if (card->info.type != sdCardType_SDHC) {
+		sector <<= 9;
+	}
+
+	args[0] = (uint8_t)(sector >> 24);
+	args[1] = (uint8_t)(sector >> 16);
+	args[2] = (uint8_t)(sector >> 8);
+	args[3] = (uint8_t)(sector >> 0);
+}
+
+/* Set when the 64 bit offset at state + field is not SCAN_NONE. A scan
+ * that has not started yet, with a byte count of 0, has none.
+ */
+static int sd_scan_has(const uint8_t *state, int field)
+{
+	int started = 0;
+
+	for (int i = 0; i < 8; i++) {
+		started |= state[SCAN_STATE_BYTES + i];
+	}
+	for (int i = 0; i < 8 && started; i++) {
+		if (state[field + i] != 0xff) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Has the adapter read count sectors from sector and scan them, carrying on
+ * the scan in state, a SCAN_STATE_SIZE byte record laid out in
+ * protocol/scan.h. Only the record crosses the parallel port. A search that
+ * computes no digests stops once it has found the pattern. done is set to
+ * the sectors scanned. The adapter needs CAPS_FEATURE_SCAN and room in its
+ * sequencer for the scan programs.
+ */
+int sd_scan(uint8_t *state, uint32_t sector, uint32_t count, uint32_t *done)
+{
+	uint8_t args[10];
+	int err = 0;
+
+	*done = 0;
+	if (card->info.type == sdCardType_None) {
+		return sdError_NoCard;
+	}
+	if (!card->seq_scan) {
+		return sdError_Unsupported;
+	}
+
+	int stop = (state[SCAN_STATE_MODE] & (SCAN_CRC32 | SCAN_SHA1)) == 0;
+
+	sd_stream_close();
+
+	while (*done < count && err == 0) {
+		if (stop && sd_scan_has(state, SCAN_STATE_FOUND)) {
+			break;
+		}
+
+		uint32_t n = count - *done < SCAN_MAX_SECTORS ? count - *done : SCAN_MAX_SECTORS;
+		uint32_t first = sector + *done;
+
+		sd_seq_address(args, first);
+		if (card->crypt) {
+			/* The sector number that seq_scan_xts decrypts the first block for */
+			args[6] = (uint8_t)(first >> 24);
+			args[7] = (uint8_t)(first >> 16);
+			args[8] = (uint8_t)(first >> 8);
+			args[9] = (uint8_t)(first >> 0);
+			err = sd_seq_scan(SEQ_SLOT_SCAN_XTS, args, 10, state, n);
+		} else {
+			err = sd_seq_scan(SEQ_SLOT_SCAN, args, 6, state, n);
+		}
+
+		if (err == 0) {
+			*done += n;
+		}
+	}
+
+	return err;
+}
+
+/* Has the adapter compare count sectors from sector with as many from
+ * other, carrying on the scan in state as sd_scan() does, and stops at the
+ * first difference. Each run holds as many sectors of other as the adapter
+ * can buffer. Not for an encrypted card, whose two copies of the same data
+ * differ.
+ */
+int sd_compare(uint8_t *state, uint32_t sector, uint32_t other, uint32_t count, uint32_t *done)
+{
+	uint8_t args[10];
+	int err = 0;
+
+	*done = 0;
+	if (card->info.type == sdCardType_None) {
+		return sdError_NoCard;
+	}
+	if (!card->seq_scan || card->crypt) {
+		return sdError_Unsupported;
+	}
+
+	sd_stream_close();
+
+	while (*done < count && err == 0 && !sd_scan_has(state, SCAN_STATE_MISMATCH)) {
+		uint32_t n = count - *done < seq_max_sectors ? count - *done : seq_max_sectors;
+
+		sd_seq_address(args, sector + *done);
+		sd_seq_address(&args[6], other + *done);
+		err = sd_seq_scan(SEQ_SLOT_COMPARE, args, 10, state, n);
+
+		if (err == 0) {
+			*done += n;
+		}
+	}
+
+	return err;
+}
+
 const sd_card_info_t* sd_get_card_info(void)
 {
-	return &sd_card_info;
+	return &card->info;
+}
+
+sd_stats_t* sd_get_stats(void)
+{
+	return &sd_stats;
 }
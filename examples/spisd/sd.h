@@ -25,6 +25,9 @@
 #define SD_SECTOR_SIZE		512
 #define SD_SECTOR_SHIFT		9
 
+/* Most cards, one per chip select of the adapter */
+#define SD_MAX_CARDS		4
+
 typedef enum {
 	sdError_OK = 0,
 	sdError_NoCard = -1,
@@ -107,14 +110,40 @@ typedef struct {
 	//uint64_t			capacity;
 	uint32_t		total_sectors;
 	sd_blocksize_t		block_size;
+	uint8_t			set_block_count;	/*!< CMD23 SET_BLOCK_COUNT supported */
+	uint8_t			can_erase;			/*!< CMD32/33/38 erase supported */
+	uint8_t			erased_byte;		/*!< what erased blocks read as, 0x00 or 0xff */
+	uint32_t		au_sectors;			/*!< allocation unit in sectors, 0 if unknown */
+	uint8_t			speed_class;		/*!< SD speed class (2, 4, 6, 10), 0 if none */
 	sd_card_csd_t		csd;
 	sd_card_cid_t		cid;
 } sd_card_info_t;
 
+typedef struct {
+	uint32_t	commands;					/*!< SD commands issued (including CMD55) */
+	uint32_t	response_polls;				/*!< bytes read while waiting for a command response */
+	uint32_t	ready_polls;				/*!< bytes read while waiting for the card to be ready */
+	uint32_t	token_polls;				/*!< bytes read while waiting for a data start token */
+	uint32_t	retries;					/*!< repeated commands while waiting for card initialization */
+} sd_stats_t;
+
+/* The functions below work on the current card, set with sd_set_card() */
+int sd_set_card(int n);
+void sd_release(void);
 int sd_open(void);
 void sd_close(void);
 int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
 int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+int sd_write_start(uint32_t sector, uint32_t count);
+int sd_write_blocks(const uint8_t *buf, uint32_t count);
+int sd_write_stop(void);
+int sd_stream_close(void);
+int sd_stream_idle(void);
+int sd_set_key(const uint8_t *key);
+int sd_scan(uint8_t *state, uint32_t sector, uint32_t count, uint32_t *done);
+int sd_compare(uint8_t *state, uint32_t sector, uint32_t other, uint32_t count, uint32_t *done);
+int sd_erase(uint32_t sector, uint32_t count);
 const sd_card_info_t* sd_get_card_info(void);
+sd_stats_t* sd_get_stats(void);
 
 #endif
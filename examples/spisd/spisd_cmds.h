@@ -0,0 +1,165 @@
+/*
+ * Device specific commands understood by spisd.device.
+ *
+ * These are listed in the result of NSCMD_DEVICEQUERY, so a program can
+ * check that the driver it has opened supports them before using them.
+ */
+#ifndef SPISD_CMDS_H_
+#define SPISD_CMDS_H_
+
+#include <exec/types.h>
+
+#define SPISD_CMD_BASE          0xe000
+
+// io_Data = struct SpiSdStats *, io_Length = size of the buffer.
+// Copies as much of the counters as fits, io_Actual = bytes copied.
+#define SPISD_CMD_GETSTATS      (SPISD_CMD_BASE + 0)
+
+// Clears all counters.
+#define SPISD_CMD_RESETSTATS    (SPISD_CMD_BASE + 1)
+
+// Starts recording every IORequest in a RAM ring, io_Length = number of
+// entries to allocate (0 selects a default, more than 65536 fails with
+// IOERR_BADLENGTH). Restarting discards the ring.
+#define SPISD_CMD_TRACE_START   (SPISD_CMD_BASE + 2)
+
+// Stops recording. The ring is kept until the entries in it have been read
+// with SPISD_CMD_TRACE_READ, then freed.
+#define SPISD_CMD_TRACE_STOP    (SPISD_CMD_BASE + 3)
+
+// io_Data = buffer, io_Length = size of the buffer. Fills in a struct
+// SpiSdTraceInfo followed by as many struct SpiSdTraceEntry as fit, in the
+// order the requests completed, and removes them from the ring. Sort them by
+// te_Arrival for the order they were issued in. io_Actual = bytes filled.
+#define SPISD_CMD_TRACE_READ    (SPISD_CMD_BASE + 4)
+
+// io_Offset = byte offset, io_Actual = its high 32 bits as in TD_READ64,
+// io_Length = bytes, both multiples of 512. Erases the sectors, telling the
+// card that their data is no longer needed; they then read as all zeros or
+// all ones, depending on the card. io_Actual = io_Length. Counted as a
+// format.
+#define SPISD_CMD_DISCARD       (SPISD_CMD_BASE + 5)
+
+// Audio unit only. io_Offset = SCI_VOL of the decoder, left << 8 | right,
+// the attenuation of each channel in 0.5 dB steps.
+#define SPISD_CMD_AUDIO_VOLUME  (SPISD_CMD_BASE + 6)
+
+// SD card units only. io_Data = key, io_Length = SPISD_KEY_SIZE: the
+// adapter encrypts the sectors of the card from then on, with AES-128 in
+// XTS mode and the sector number as the tweak; the key is the data key
+// followed by the tweak key. io_Length = 0 goes back to plain sectors. The
+// key stays with the unit through card changes. Fails with IOERR_NOCMD if
+// the adapter can't encrypt.
+#define SPISD_CMD_SET_KEY       (SPISD_CMD_BASE + 7)
+
+#define SPISD_KEY_SIZE          32
+
+// SD card units only. io_Offset = byte offset, io_Actual = its high 32 bits
+// as in TD_READ64, io_Length = bytes, both multiples of 512, io_Data =
+// struct SpiSdScan. The adapter reads the sectors and scans them as sc_Mode
+// says, and only the result crosses the parallel port. A scan is carried on
+// over several requests by passing the same struct to each. io_Actual =
+// bytes scanned, which is less than io_Length if a search without
+// SPISD_SCAN_CRC32 or SPISD_SCAN_SHA1 found the pattern. Fails with
+// IOERR_NOCMD if the adapter can't scan.
+#define SPISD_CMD_SCAN          (SPISD_CMD_BASE + 8)
+
+// As SPISD_CMD_SCAN, but compares the sectors with as many from byte offset
+// sc_Other instead, and stops at the first difference. Fails with
+// IOERR_NOCMD on an encrypted unit.
+#define SPISD_CMD_COMPARE       (SPISD_CMD_BASE + 9)
+
+// sc_Mode bits.
+#define SPISD_SCAN_CRC32        (1 << 0)    // CRC-32 as in zip and Ethernet
+#define SPISD_SCAN_SHA1         (1 << 1)
+#define SPISD_SCAN_SEARCH       (1 << 2)    // First match of sc_Pattern
+
+#define SPISD_SCAN_PATTERN_MAX  32
+
+// Unit of the VS1053 audio decoder. CMD_WRITE sends any number of bytes of
+// an MP3, Ogg Vorbis, AAC, WMA or WAV stream, and is replied when the
+// decoder has taken them, so a player keeps two writes queued. CMD_UPDATE
+// ends the stream, and CMD_RESET resets the decoder.
+#define SPISD_AUDIO_UNIT        7
+
+// Request classes counted in ss_Requests and ss_Latency.
+#define SPISD_OP_READ           0
+#define SPISD_OP_WRITE          1
+#define SPISD_OP_FORMAT         2
+#define SPISD_OP_OTHER          3
+#define SPISD_OP_COUNT          4
+
+// Bucket n of the latency histogram counts requests that took less than
+// 2^(n+8) microseconds (and at least 2^(n+7) for n > 0). The last bucket
+// counts everything slower than that.
+#define SPISD_LATENCY_BUCKETS   12
+
+struct SpiSdStats
+{
+    ULONG ss_Size;                  // sizeof(struct SpiSdStats) of the driver
+    ULONG ss_Requests[SPISD_OP_COUNT];
+    ULONG ss_Errors;                // requests that completed with io_Error set
+    ULONG ss_SectorsRead;
+    ULONG ss_SectorsWritten;
+    ULONG ss_SdCommands;            // commands sent to the card, CMD55 included
+    ULONG ss_ResponsePolls;         // bytes read while waiting for R1
+    ULONG ss_ReadyWaitPolls;        // bytes read while waiting for card not busy
+    ULONG ss_TokenWaitPolls;        // bytes read while waiting for a data token
+    ULONG ss_Retries;               // repeated init commands (ACMD41/CMD1)
+    ULONG ss_Latency[SPISD_OP_COUNT][SPISD_LATENCY_BUCKETS];
+    ULONG ss_SectorsErased;         // by discards and formats of erased data
+};
+
+// Set sc_Bytes to 0 and sc_Mode, and the pattern for a search, to start a
+// scan; the driver sets up the rest. 64 bit values are high, then low. From
+// sc_Mode on this is the state record of protocol/scan.h.
+struct SpiSdScan
+{
+    ULONG sc_Other[2];              // byte offset of the sectors compared with
+    UBYTE sc_Mode;                  // SPISD_SCAN_ bits
+    UBYTE sc_Match;                 // private
+    UBYTE sc_PatternLength;         // 1-SPISD_SCAN_PATTERN_MAX with SPISD_SCAN_SEARCH
+    UBYTE sc_Pad;
+    UBYTE sc_Pattern[SPISD_SCAN_PATTERN_MAX];
+    ULONG sc_Bytes[2];              // bytes scanned or compared so far
+    ULONG sc_Found[2];              // offset into the scan of the first match, all ones if none
+    ULONG sc_Mismatch[2];           // offset into the compare of the first difference, all ones if none
+    ULONG sc_Crc32;                 // of the bytes scanned
+    ULONG sc_Sha1State[5];          // private
+    UBYTE sc_Sha1[20];              // of the bytes scanned
+};
+
+struct SpiSdTraceInfo
+{
+    ULONG ti_TickFreq;              // frequency of the timestamps in Hz
+    ULONG ti_Dropped;               // entries lost because the ring was full
+    ULONG ti_Count;                 // number of entries that follow
+};
+
+struct SpiSdTraceEntry
+{
+    UWORD te_Command;               // io_Command
+    BYTE te_Error;                  // io_Error
+    UBYTE te_Unit;
+    ULONG te_Lba;                   // first sector, for reads, writes and formats
+    ULONG te_Length;                // io_Length
+    ULONG te_Arrival;               // timestamp when BeginIO() got the request
+    ULONG te_Start;                 // timestamp when the driver started on it
+    ULONG te_Complete;              // timestamp when it was replied
+};
+
+// File written by "spisdctl TRACEDUMP", read by host/replay. All fields are
+// big endian, as on the Amiga. The header is followed by th_Count entries.
+#define SPISD_TRACE_MAGIC       0x53505452  // 'SPTR'
+#define SPISD_TRACE_VERSION     1
+
+struct SpiSdTraceFileHeader
+{
+    ULONG th_Magic;
+    ULONG th_Version;
+    ULONG th_TickFreq;
+    ULONG th_Dropped;
+    ULONG th_Count;
+};
+
+#endif
@@ -19,14 +19,136 @@
 
 #include <stdint.h>
 
+#include <exec/types.h>
+#include <exec/execbase.h>
+#include <exec/interrupts.h>
+#include <hardware/cia.h>
+#include <resources/cia.h>
+#include <proto/exec.h>
+
+#include "cia_protos.h"
+
 //#include "common.h"
 #include "timer.h"
 
+#define CIAA_BASE	0xbfe001
+#define CIAB_BASE	0xbfd000
+
+/* Counting 65536 E-clock cycles per underflow, with the number of
+ * underflows in the upper 16 bits.
+ */
+#define TIMER_LATCH	0xffff
+
+/* Most ticks a call to timer_get_tick_count() can fall behind another one
+ * that interrupted it, about 5.8 ms.
+ */
+#define TIMER_RACE_TICKS	0x1000
+
 static volatile uint8_t * const todl = (volatile uint8_t*)0xbfe801;
 static volatile uint8_t * const todm = (volatile uint8_t*)0xbfe901;
 static volatile uint8_t * const todh = (volatile uint8_t*)0xbfea01;
 
-uint32_t timer_get_tick_count(void)
+uint32_t timer_tick_freq = 50;
+
+static struct Library *timer_resource;
+static int timer_icr_bit;
+static volatile uint8_t *timer_lo;
+static volatile uint8_t *timer_hi;
+static volatile uint8_t *timer_cr;
+static uint8_t timer_cr_keep;
+static volatile uint32_t timer_wraps;
+static uint32_t timer_last;
+static struct Interrupt timer_interrupt;
+
+static const char timer_name[] = "spisd timer";
+
+static void timer_isr(void)
+{
+	timer_wraps += 0x10000;
+}
+
+/* Candidate timers in order of preference. CIA-A timer A is left alone
+ * since the keyboard uses it.
+ */
+static const struct {
+	const char *resource;
+	uint32_t base;
+	int icr_bit;
+} timer_candidates[] = {
+	{ CIABNAME, CIAB_BASE, CIAICRB_TA },
+	{ CIABNAME, CIAB_BASE, CIAICRB_TB },
+	{ CIAANAME, CIAA_BASE, CIAICRB_TB },
+};
+
+int timer_init(void)
+{
+	int i;
+
+	timer_interrupt.is_Node.ln_Type = NT_INTERRUPT;
+	timer_interrupt.is_Node.ln_Name = (char *)timer_name;
+	timer_interrupt.is_Code = timer_isr;
+
+	for (i = 0; i < sizeof(timer_candidates) / sizeof(timer_candidates[0]); i++) {
+		struct Library *res = (struct Library *)OpenResource(timer_candidates[i].resource);
+		volatile struct CIA *cia = (volatile struct CIA *)timer_candidates[i].base;
+
+		if (!res) {
+			continue;
+		}
+
+		Disable();
+		if (AddICRVector(res, timer_candidates[i].icr_bit, &timer_interrupt)) {
+			/* Timer in use by someone else */
+			Enable();
+			continue;
+		}
+
+		if (timer_candidates[i].icr_bit == CIAICRB_TA) {
+			timer_lo = &cia->ciatalo;
+			timer_hi = &cia->ciatahi;
+			timer_cr = &cia->ciacra;
+			timer_cr_keep = 0xc0; /* SPMODE, TODIN */
+		} else {
+			timer_lo = &cia->ciatblo;
+			timer_hi = &cia->ciatbhi;
+			timer_cr = &cia->ciacrb;
+			timer_cr_keep = CIACRBF_ALARM;
+		}
+
+		/* Stop, continuous mode, count E-clock cycles */
+		*timer_cr &= timer_cr_keep;
+		*timer_lo = TIMER_LATCH & 0xff;
+		*timer_hi = TIMER_LATCH >> 8;
+		timer_wraps = 0;
+		timer_last = 0;
+		*timer_cr = (*timer_cr & timer_cr_keep) | CIACRAF_LOAD | CIACRAF_START;
+
+		timer_resource = res;
+		timer_icr_bit = timer_candidates[i].icr_bit;
+		AbleICR(res, CIAICRF_SETCLR | (1 << timer_icr_bit));
+		Enable();
+
+		timer_tick_freq = SysBase->ex_EClockFrequency ? SysBase->ex_EClockFrequency : 709379;
+		return 0;
+	}
+
+	timer_tick_freq = SysBase->VBlankFrequency ? SysBase->VBlankFrequency : 50;
+	return 1;
+}
+
+void timer_shutdown(void)
+{
+	if (!timer_resource) {
+		return;
+	}
+
+	AbleICR(timer_resource, 1 << timer_icr_bit);
+	*timer_cr &= timer_cr_keep;
+	RemICRVector(timer_resource, timer_icr_bit, &timer_interrupt);
+	timer_resource = NULL;
+}
+
+static uint32_t timer_get_tod_count(void)
 {
 	uint8_t l,m,h;
 
@@ -37,6 +159,49 @@ uint32_t timer_get_tick_count(void)
 	return ((uint32_t)h << 16) | ((uint32_t)m << 8) | (uint32_t)l;
 }
 
+uint32_t timer_get_tick_count(void)
+{
+	uint32_t wraps, ticks;
+	uint8_t h, l;
+
+	if (!timer_resource) {
+		return timer_get_tod_count();
+	}
+
+	/* The timer counts down. Re-read if the low byte wrapped between
+	 * reading the high and low bytes, or if an underflow was counted
+	 * while reading.
+	 */
+	do {
+		wraps = timer_wraps;
+		h = *timer_hi;
+		l = *timer_lo;
+		if (*timer_hi != h) {
+			h = *timer_hi;
+			l = *timer_lo;
+		}
+	} while (wraps != timer_wraps);
+
+	ticks = wraps | (uint16_t)~(((uint16_t)h << 8) | l);
+
+	/* An underflow whose interrupt hasn't run yet leaves wraps one
+	 * behind the timer, so the ticks fall behind the last ones returned
+	 * by about as much as the timer had counted in that wrap. Ticks only
+	 * a little behind are from a call that another one interrupted, and
+	 * are held at the last ones returned.
+	 */
+	if ((int32_t)(ticks - timer_last) < 0) {
+		if (timer_last - ticks > TIMER_RACE_TICKS) {
+			ticks += 0x10000;
+		} else {
+			ticks = timer_last;
+		}
+	}
+	timer_last = ticks;
+
+	return ticks;
+}
+
 void timer_delay(uint32_t ticks)
 {
 	uint32_t timeout = timer_get_tick_count() + ticks;
@@ -22,23 +22,44 @@
 
 #include <stdint.h>
 
-#ifndef TIMER_TICK_FREQ
-/*! Tick frequency in Hz - defines timer resolution */
-#define TIMER_TICK_FREQ			50
-#endif
+/*!
+ * Tick frequency in Hz - defines timer resolution. This is the E-clock
+ * frequency (about 709 kHz on PAL, 716 kHz on NTSC) when a free running
+ * CIA timer could be allocated by timer_init(), and the vertical blank
+ * frequency (50/60 Hz) of the CIA-A TOD counter otherwise.
+ */
+extern uint32_t timer_tick_freq;
+#define TIMER_TICK_FREQ			timer_tick_freq
 
-/*! Helper macro calculates number of ticks in specified ms (rounds up) */
+/*! Helper macro calculates number of ticks in specified ms (rounds up), ms <= 5000 */
 #define TIMER_MILLIS(ms)		(((uint32_t)(ms) * (TIMER_TICK_FREQ) + 999ul) / 1000ul)
 
 /*! Helper macro calculates number of ticks in specified s */
 #define TIMER_SECONDS(s)		((uint32_t)(s) * (TIMER_TICK_FREQ))
 
 /*! Helper macro converts ticks back to milliseconds (rounds down) */
-#define TIMER_TO_MILLIS(ticks)	((uint32_t)(ticks) * 1000ul / (TIMER_TICK_FREQ))
+#define TIMER_TO_MILLIS(ticks)	((TIMER_TICK_FREQ) >= 1000ul ? \
+									(uint32_t)(ticks) / ((TIMER_TICK_FREQ) / 1000ul) : \
+									(uint32_t)(ticks) * 1000ul / (TIMER_TICK_FREQ))
+
+/*! Helper macro converts ticks back to microseconds (rounds down), ticks < 4000000 */
+#define TIMER_TO_MICROS(ticks)	((TIMER_TICK_FREQ) >= 1000ul ? \
+									(uint32_t)(ticks) * 1000ul / ((TIMER_TICK_FREQ) / 1000ul) : \
+									(uint32_t)(ticks) * (1000000ul / (TIMER_TICK_FREQ)))
 
 /*! Helper macro converts ticks back to seconds (rounds down) */
 #define TIMER_TO_SECONDS(ticks)	((uint32_t)(ticks) / (TIMER_TICK_FREQ))
 
+/*!
+ * Sets up the timebase. Tries to allocate a free running CIA timer that
+ * counts E-clock cycles, and falls back on the 50/60 Hz TOD counter if
+ * none is available.
+ *
+ * \return				0 if a CIA timer is used, 1 for the TOD fallback
+ */
+int timer_init(void);
+void timer_shutdown(void);
+
 /*!
  * Returns current 32-bit tick counter in
  * increments of TIMER_TICK_FREQ
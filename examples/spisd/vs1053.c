@@ -0,0 +1,183 @@
+/*
+ * VS1053 audio decoder on the SPI adapter, for the audio unit of
+ * spisd.device. The driver task does the streaming: it sends a burst with
+ * vs1053_send() each time the adapter reports DREQ high, and otherwise
+ * waits for the adapter's IRQ. The functions here are the rest, which poll
+ * DREQ and only run when the decoder is set up or a stream ends.
+ *
+ * The command interface is run at the slow SPI clock, since SCI reads take
+ * at most CLKI / 7, and the data interface at the fast one.
+ */
+
+#include <stdint.h>
+
+#include "spi.h"
+#include "timer.h"
+#include "vs1053.h"
+
+#define DREQ_TIMEOUT_MS		100
+
+/* SCI instructions */
+#define SCI_WRITE			0x02
+#define SCI_READ			0x03
+
+/* SCI registers */
+#define SCI_MODE			0x00
+#define SCI_STATUS			0x01
+#define SCI_CLOCKF			0x03
+#define SCI_WRAM			0x06
+#define SCI_WRAMADDR		0x07
+#define SCI_VOL				0x0b
+
+#define SM_RESET			0x0004
+#define SM_CANCEL			0x0008
+#define SM_SDINEW			0x0800
+
+/* SS_VER field of SCI_STATUS */
+#define SS_VER(status)		(((status) >> 4) & 15)
+#define SS_VER_VS1053		4
+
+/* SC_MULT = 4.5x, CLKI = 55.3 MHz with the usual 12.288 MHz crystal */
+#define CLOCKF_VALUE		0xc000
+
+/* Where the decoder keeps the byte a stream must be padded with */
+#define END_FILL_BYTE_ADDR	0x1e06
+
+/* Most end fill bytes sent after SM_CANCEL before it must have cleared */
+#define CANCEL_MAX_BYTES	2048
+
+#define VOLUME_DEFAULT		0x2020
+
+static uint8_t end_fill[VS1053_BURST];
+
+static int wait_dreq(void)
+{
+	uint32_t timeout = timer_get_tick_count() + TIMER_MILLIS(DREQ_TIMEOUT_MS);
+
+	do {
+		int status = spi_dreq(0);
+		if (status < 0) {
+			return vsError_NoDecoder;
+		}
+		if (status & DREQ_STATUS_HIGH) {
+			return vsError_OK;
+		}
+	} while ((int32_t)(timer_get_tick_count() - timeout) < 0);
+
+	return vsError_Timeout;
+}
+
+/* Writes a register, and waits for the decoder to have taken it */
+static int sci_write(uint8_t reg, uint16_t value)
+{
+	uint8_t cmd[4] = {SCI_WRITE, reg, value >> 8, value};
+
+	spi_select_device(VS1053_SCI_DEVICE);
+	spi_write_sel_desel(cmd, sizeof(cmd));
+	return wait_dreq();
+}
+
+static uint16_t sci_read(uint8_t reg)
+{
+	uint8_t cmd[2] = {SCI_READ, reg};
+	uint8_t value[2];
+
+	spi_select_device(VS1053_SCI_DEVICE);
+	spi_write_sel(cmd, sizeof(cmd));
+	spi_read_desel(value, sizeof(value));
+	return (value[0] << 8) | value[1];
+}
+
+/* Soft resets the decoder and sets its clock, which is done after every
+ * reset. The SDI clock may only be fast with the clock multiplier set.
+ */
+int vs1053_reset(void)
+{
+	int res;
+
+	if ((res = sci_write(SCI_MODE, SM_SDINEW | SM_RESET)) != vsError_OK) {
+		return res;
+	}
+	if ((res = sci_write(SCI_CLOCKF, CLOCKF_VALUE)) != vsError_OK) {
+		return res;
+	}
+
+	sci_write(SCI_WRAMADDR, END_FILL_BYTE_ADDR);
+	uint8_t fill = sci_read(SCI_WRAM);
+	for (int i = 0; i < VS1053_BURST; i++) {
+		end_fill[i] = fill;
+	}
+
+	return sci_write(SCI_VOL, VOLUME_DEFAULT);
+}
+
+/* Looks for a VS1053 on the chip selects, which needs an adapter with a
+ * DREQ input and devices for both, and sets it up.
+ */
+int vs1053_open(void)
+{
+	if (spi_get_caps()->devices <= VS1053_SDI_DEVICE || spi_dreq(0) < 0) {
+		return vsError_NoDecoder;
+	}
+
+	spi_select_device(VS1053_SCI_DEVICE);
+	spi_set_speed(SPI_SPEED_SLOW);
+	spi_select_device(VS1053_SDI_DEVICE);
+	spi_set_speed(SPI_SPEED_SLOW);
+
+	/* Nothing on the chip select reads as all ones */
+	if (SS_VER(sci_read(SCI_STATUS)) != SS_VER_VS1053) {
+		return vsError_NoDecoder;
+	}
+
+	int res = vs1053_reset();
+	if (res == vsError_OK) {
+		spi_select_device(VS1053_SDI_DEVICE);
+		spi_set_speed(SPI_SPEED_FAST);
+	}
+	return res;
+}
+
+/* volume is SCI_VOL, left << 8 | right, in steps of -0.5 dB from full */
+int vs1053_set_volume(uint16_t volume)
+{
+	return sci_write(SCI_VOL, volume);
+}
+
+/* Sends at most VS1053_BURST end fill bytes, once DREQ is high */
+void vs1053_send_end_fill(uint32_t size)
+{
+	vs1053_send(end_fill, size);
+}
+
+/* Ends a stream whose end fill has been sent, so that the decoder is ready
+ * for the next one. If the decoder doesn't stop it is reset.
+ */
+int vs1053_cancel(void)
+{
+	int res;
+
+	if ((res = sci_write(SCI_MODE, SM_SDINEW | SM_CANCEL)) != vsError_OK) {
+		return res;
+	}
+
+	for (int sent = 0; sent < CANCEL_MAX_BYTES; sent += VS1053_BURST) {
+		if ((res = wait_dreq()) != vsError_OK) {
+			return res;
+		}
+		vs1053_send_end_fill(VS1053_BURST);
+
+		if (!(sci_read(SCI_MODE) & SM_CANCEL)) {
+			return vsError_OK;
+		}
+	}
+
+	return vs1053_reset();
+}
+
+/* Sends at most VS1053_BURST bytes of a stream, once DREQ is high */
+void vs1053_send(const uint8_t *buf, uint32_t size)
+{
+	spi_select_device(VS1053_SDI_DEVICE);
+	spi_write_sel_desel(buf, size);
+}
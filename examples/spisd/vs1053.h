@@ -0,0 +1,38 @@
+/*
+ * VS1053 audio decoder on the SPI adapter.
+ *
+ * The decoder takes two chip selects: its command interface (SCI, xCS) is
+ * on device VS1053_SCI_DEVICE and its data interface (SDI, xDCS) on device
+ * VS1053_SDI_DEVICE. Its DREQ output goes to the adapter's DREQ input, see
+ * protocol/dreq.h, which the functions below poll and spisd.device arms to
+ * wake it through IRQ.
+ */
+
+#ifndef VS1053_H_
+#define VS1053_H_
+
+#include <stdint.h>
+
+#define VS1053_SCI_DEVICE	2
+#define VS1053_SDI_DEVICE	3
+
+/* Bytes that may be sent to SDI each time DREQ is high */
+#define VS1053_BURST		32
+
+/* End fill bytes that play out the last frame of a stream */
+#define VS1053_END_FILL		2052
+
+typedef enum {
+	vsError_OK = 0,
+	vsError_NoDecoder = -1,
+	vsError_Timeout = -2,
+} vs_error_t;
+
+int vs1053_open(void);
+int vs1053_reset(void);
+int vs1053_set_volume(uint16_t volume);
+int vs1053_cancel(void);
+void vs1053_send(const uint8_t *buf, uint32_t size);
+void vs1053_send_end_fill(uint32_t size);
+
+#endif
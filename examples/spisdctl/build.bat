@@ -0,0 +1 @@
+vc spisdctl.c -I../spisd -O2 -lamiga -o spisdctl
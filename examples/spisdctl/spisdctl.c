@@ -0,0 +1,538 @@
+/*
+ * Written in October 2026.
+ *
+ * spisdctl - sends the device specific commands of spisd.device.
+ */
+#include <exec/types.h>
+#include <exec/errors.h>
+#include <exec/io.h>
+#include <exec/memory.h>
+#include <devices/newstyle.h>
+#include <dos/dos.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "spisd_cmds.h"
+
+static const char template[] = "COMMAND/A,ARGS/M,DEVICE/K,UNIT/K/N";
+
+enum {
+    ARG_COMMAND,
+    ARG_ARGS,
+    ARG_DEVICE,
+    ARG_UNIT,
+    ARG_COUNT
+};
+
+// Entries fetched per SPISD_CMD_TRACE_READ.
+#define TRACE_CHUNK 256
+
+// Sectors per SPISD_CMD_SCAN or SPISD_CMD_COMPARE, 4 MB, which the adapter
+// gets through in a few seconds, so that CTRL-C is noticed and the unit's
+// other requests get a turn.
+#define SCAN_CHUNK 8192
+
+static const char *op_names[SPISD_OP_COUNT] = {"read", "write", "format", "other"};
+
+static struct MsgPort *port;
+static struct IOStdReq *ior;
+
+static BOOL name_equals(const char *a, const char *b)
+{
+    for (; *a && *b; a++, b++)
+    {
+        if ((*a | 0x20) != (*b | 0x20))
+            return FALSE;
+    }
+    return *a == *b;
+}
+
+static int do_command(UWORD command, APTR data, ULONG length)
+{
+    ior->io_Command = command;
+    ior->io_Data = data;
+    ior->io_Length = length;
+    ior->io_Offset = 0;
+    return DoIO((struct IORequest *)ior);
+}
+
+static BOOL is_supported(UWORD command)
+{
+    struct NSDeviceQueryResult result;
+
+    memset(&result, 0, sizeof(result));
+    if (do_command(NSCMD_DEVICEQUERY, &result, sizeof(result)) || !result.nsdqr_SupportedCommands)
+        return FALSE;
+
+    for (const UWORD *cmd = result.nsdqr_SupportedCommands; *cmd; cmd++)
+    {
+        if (*cmd == command)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int cmd_stats()
+{
+    struct SpiSdStats stats;
+
+    memset(&stats, 0, sizeof(stats));
+    if (do_command(SPISD_CMD_GETSTATS, &stats, sizeof(stats)))
+        return RETURN_ERROR;
+
+    printf("Requests:");
+    for (int op = 0; op < SPISD_OP_COUNT; op++)
+        printf(" %s %lu", op_names[op], stats.ss_Requests[op]);
+    printf("\n");
+
+    printf("Errors:          %lu\n", stats.ss_Errors);
+    printf("Sectors read:    %lu\n", stats.ss_SectorsRead);
+    printf("Sectors written: %lu\n", stats.ss_SectorsWritten);
+    printf("Sectors erased:  %lu\n", stats.ss_SectorsErased);
+    printf("SD commands:     %lu\n", stats.ss_SdCommands);
+    printf("Response polls:  %lu\n", stats.ss_ResponsePolls);
+    printf("Ready polls:     %lu\n", stats.ss_ReadyWaitPolls);
+    printf("Token polls:     %lu\n", stats.ss_TokenWaitPolls);
+    printf("Retries:         %lu\n", stats.ss_Retries);
+
+    printf("\nLatency     ");
+    for (int op = 0; op < SPISD_OP_COUNT; op++)
+        printf(" %8s", op_names[op]);
+    printf("\n");
+
+    for (int bucket = 0; bucket < SPISD_LATENCY_BUCKETS; bucket++)
+    {
+        ULONG limit = 1UL << (bucket + 8);
+
+        if (bucket == SPISD_LATENCY_BUCKETS - 1)
+            printf(">=%6lu us ", limit >> 1);
+        else
+            printf(" <%6lu us ", limit);
+
+        for (int op = 0; op < SPISD_OP_COUNT; op++)
+            printf(" %8lu", stats.ss_Latency[op][bucket]);
+        printf("\n");
+    }
+
+    return RETURN_OK;
+}
+
+static int cmd_reset()
+{
+    return do_command(SPISD_CMD_RESETSTATS, NULL, 0) ? RETURN_ERROR : RETURN_OK;
+}
+
+static int cmd_trace_start(char **args)
+{
+    LONG entries = 0;
+
+    if (args[0] && StrToLong(args[0], &entries) < 0)
+    {
+        printf("Bad number of entries %s\n", args[0]);
+        return RETURN_ERROR;
+    }
+
+    return do_command(SPISD_CMD_TRACE_START, NULL, entries) ? RETURN_ERROR : RETURN_OK;
+}
+
+static int cmd_trace_stop()
+{
+    return do_command(SPISD_CMD_TRACE_STOP, NULL, 0) ? RETURN_ERROR : RETURN_OK;
+}
+
+static int cmd_trace_dump(const char *path)
+{
+    ULONG size = sizeof(struct SpiSdTraceInfo) + TRACE_CHUNK * sizeof(struct SpiSdTraceEntry);
+    struct SpiSdTraceFileHeader header;
+    int rc = RETURN_ERROR;
+
+    struct SpiSdTraceInfo *info = AllocMem(size, MEMF_PUBLIC);
+    if (!info)
+        return RETURN_ERROR;
+
+    BPTR fh = Open(path, MODE_NEWFILE);
+    if (!fh)
+    {
+        printf("Could not open %s\n", path);
+        goto fail1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.th_Magic = SPISD_TRACE_MAGIC;
+    header.th_Version = SPISD_TRACE_VERSION;
+
+    // Written again with the final counts once the ring is empty.
+    if (Write(fh, &header, sizeof(header)) != sizeof(header))
+        goto fail2;
+
+    while (1)
+    {
+        if (do_command(SPISD_CMD_TRACE_READ, info, size))
+            goto fail2;
+
+        header.th_TickFreq = info->ti_TickFreq;
+        header.th_Dropped += info->ti_Dropped;
+
+        if (!info->ti_Count)
+            break;
+
+        LONG bytes = info->ti_Count * sizeof(struct SpiSdTraceEntry);
+        if (Write(fh, info + 1, bytes) != bytes)
+            goto fail2;
+
+        header.th_Count += info->ti_Count;
+    }
+
+    Seek(fh, 0, OFFSET_BEGINNING);
+    if (Write(fh, &header, sizeof(header)) != sizeof(header))
+        goto fail2;
+
+    printf("Wrote %lu entries to %s", header.th_Count, path);
+    if (header.th_Dropped)
+        printf(", %lu were dropped because the ring was full", header.th_Dropped);
+    printf("\n");
+    rc = RETURN_OK;
+
+fail2:
+    Close(fh);
+
+fail1:
+    FreeMem(info, size);
+    return rc;
+}
+
+static int cmd_discard(char **args)
+{
+    LONG first, count;
+
+    if (!args[0] || !args[1] || StrToLong(args[0], &first) < 0 || StrToLong(args[1], &count) < 0)
+    {
+        printf("DISCARD needs a first sector and a sector count\n");
+        return RETURN_ERROR;
+    }
+
+    ior->io_Command = SPISD_CMD_DISCARD;
+    ior->io_Data = NULL;
+    ior->io_Length = (ULONG)count << 9;
+    ior->io_Offset = (ULONG)first << 9;
+    ior->io_Actual = (ULONG)first >> 23;
+    if (DoIO((struct IORequest *)ior))
+        return RETURN_ERROR;
+
+    printf("Discarded %ld sectors from sector %ld\n", count, first);
+    return RETURN_OK;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static int cmd_key(char **args)
+{
+    UBYTE key[SPISD_KEY_SIZE];
+    const char *p = args[0];
+    int rc = RETURN_ERROR;
+
+    if (p && name_equals(p, "OFF"))
+    {
+        if (do_command(SPISD_CMD_SET_KEY, NULL, 0))
+            return RETURN_ERROR;
+        printf("Sectors are no longer encrypted\n");
+        return RETURN_OK;
+    }
+
+    if (!p || strlen(p) != 2 * SPISD_KEY_SIZE)
+    {
+        printf("KEY needs %d hex digits, or OFF\n", 2 * SPISD_KEY_SIZE);
+        return RETURN_ERROR;
+    }
+
+    for (int i = 0; i < SPISD_KEY_SIZE; i++)
+    {
+        int hi = hex_digit(p[2 * i]);
+        int lo = hex_digit(p[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            printf("KEY needs %d hex digits, or OFF\n", 2 * SPISD_KEY_SIZE);
+            goto done;
+        }
+        key[i] = (hi << 4) | lo;
+    }
+
+    if (do_command(SPISD_CMD_SET_KEY, key, SPISD_KEY_SIZE) == 0)
+    {
+        printf("Sectors are encrypted by the adapter\n");
+        rc = RETURN_OK;
+    }
+
+done:
+    memset(key, 0, sizeof(key));
+    return rc;
+}
+
+static BOOL scan_has(const ULONG *offset)
+{
+    return (offset[0] & offset[1]) != 0xffffffff;
+}
+
+// Sends command for count sectors from first, in chunks that carry the
+// scan on in sc, and stops early once a match or a difference is found.
+static int run_scan(UWORD command, struct SpiSdScan *sc, ULONG first, ULONG other, ULONG count)
+{
+    sc->sc_Bytes[0] = sc->sc_Bytes[1] = 0;
+
+    while (count)
+    {
+        ULONG n = count < SCAN_CHUNK ? count : SCAN_CHUNK;
+
+        if (CheckSignal(SIGBREAKF_CTRL_C))
+        {
+            ior->io_Error = IOERR_ABORTED;
+            return RETURN_WARN;
+        }
+
+        sc->sc_Other[0] = other >> 23;
+        sc->sc_Other[1] = other << 9;
+        ior->io_Command = command;
+        ior->io_Data = sc;
+        ior->io_Length = n << 9;
+        ior->io_Offset = first << 9;
+        ior->io_Actual = first >> 23;
+        if (DoIO((struct IORequest *)ior))
+            return RETURN_ERROR;
+
+        if (scan_has(sc->sc_Found) || scan_has(sc->sc_Mismatch))
+            break;
+
+        first += n;
+        other += n;
+        count -= n;
+    }
+
+    return RETURN_OK;
+}
+
+// Sector and byte of an offset into a scan that started at sector first.
+static void print_offset(const char *what, const ULONG *offset, ULONG first)
+{
+    printf("%s at sector %lu byte %lu\n", what,
+        first + ((offset[0] << 23) | (offset[1] >> 9)), offset[1] & 511);
+}
+
+static int cmd_hash(char **args)
+{
+    struct SpiSdScan sc;
+    LONG first, count;
+
+    if (!args[0] || !args[1] || StrToLong(args[0], &first) < 0 || StrToLong(args[1], &count) < 0)
+    {
+        printf("HASH needs a first sector and a sector count\n");
+        return RETURN_ERROR;
+    }
+
+    memset(&sc, 0, sizeof(sc));
+    sc.sc_Mode = SPISD_SCAN_CRC32 | SPISD_SCAN_SHA1;
+    int rc = run_scan(SPISD_CMD_SCAN, &sc, first, 0, count);
+    if (rc != RETURN_OK)
+        return rc;
+
+    printf("CRC-32 %08lx\nSHA-1  ", sc.sc_Crc32);
+    for (int i = 0; i < sizeof(sc.sc_Sha1); i++)
+        printf("%02x", sc.sc_Sha1[i]);
+    printf("\n");
+    return RETURN_OK;
+}
+
+static int cmd_search(char **args)
+{
+    struct SpiSdScan sc;
+    LONG first, count;
+    const char *p = args[0] && args[1] ? args[2] : NULL;
+    int len = p ? strlen(p) : 0;
+
+    if (!p || StrToLong(args[0], &first) < 0 || StrToLong(args[1], &count) < 0 ||
+        !len || (len & 1) || len > 2 * SPISD_SCAN_PATTERN_MAX)
+    {
+        printf("SEARCH needs a first sector, a sector count and up to %d bytes as hex digits\n",
+            SPISD_SCAN_PATTERN_MAX);
+        return RETURN_ERROR;
+    }
+
+    memset(&sc, 0, sizeof(sc));
+    for (int i = 0; i < len / 2; i++)
+    {
+        int hi = hex_digit(p[2 * i]);
+        int lo = hex_digit(p[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            printf("SEARCH needs the pattern as hex digits\n");
+            return RETURN_ERROR;
+        }
+        sc.sc_Pattern[i] = (hi << 4) | lo;
+    }
+    sc.sc_Mode = SPISD_SCAN_SEARCH;
+    sc.sc_PatternLength = len / 2;
+
+    int rc = run_scan(SPISD_CMD_SCAN, &sc, first, 0, count);
+    if (rc != RETURN_OK)
+        return rc;
+
+    if (scan_has(sc.sc_Found))
+        print_offset("Found", sc.sc_Found, first);
+    else
+        printf("Not found\n");
+    return RETURN_OK;
+}
+
+static int cmd_compare(char **args)
+{
+    struct SpiSdScan sc;
+    LONG first, other, count;
+
+    if (!args[0] || !args[1] || !args[2] || StrToLong(args[0], &first) < 0 ||
+        StrToLong(args[1], &other) < 0 || StrToLong(args[2], &count) < 0)
+    {
+        printf("COMPARE needs two first sectors and a sector count\n");
+        return RETURN_ERROR;
+    }
+
+    memset(&sc, 0, sizeof(sc));
+    int rc = run_scan(SPISD_CMD_COMPARE, &sc, first, other, count);
+    if (rc != RETURN_OK)
+        return rc;
+
+    if (scan_has(sc.sc_Mismatch))
+        print_offset("First difference", sc.sc_Mismatch, first);
+    else
+        printf("The sectors are the same\n");
+    return RETURN_OK;
+}
+
+struct command
+{
+    const char *name;
+    UWORD device_command;
+    int (*handler)(char **args);
+};
+
+static int stats_handler(char **args)
+{
+    return cmd_stats();
+}
+
+static int reset_handler(char **args)
+{
+    return cmd_reset();
+}
+
+static int trace_start_handler(char **args)
+{
+    return cmd_trace_start(args);
+}
+
+static int trace_stop_handler(char **args)
+{
+    return cmd_trace_stop();
+}
+
+static int trace_dump_handler(char **args)
+{
+    if (!args[0])
+    {
+        printf("TRACEDUMP needs a file name\n");
+        return RETURN_ERROR;
+    }
+    return cmd_trace_dump(args[0]);
+}
+
+static const struct command commands[] =
+{
+    {"STATS", SPISD_CMD_GETSTATS, stats_handler},
+    {"RESET", SPISD_CMD_RESETSTATS, reset_handler},
+    {"TRACESTART", SPISD_CMD_TRACE_START, trace_start_handler},
+    {"TRACESTOP", SPISD_CMD_TRACE_STOP, trace_stop_handler},
+    {"TRACEDUMP", SPISD_CMD_TRACE_READ, trace_dump_handler},
+    {"DISCARD", SPISD_CMD_DISCARD, cmd_discard},
+    {"KEY", SPISD_CMD_SET_KEY, cmd_key},
+    {"HASH", SPISD_CMD_SCAN, cmd_hash},
+    {"SEARCH", SPISD_CMD_SCAN, cmd_search},
+    {"COMPARE", SPISD_CMD_COMPARE, cmd_compare},
+    {NULL, 0, NULL}
+};
+
+int main()
+{
+    LONG args[ARG_COUNT] = {0};
+    struct RDArgs *rdargs;
+    int rc = RETURN_FAIL;
+
+    rdargs = ReadArgs(template, args, NULL);
+    if (!rdargs)
+    {
+        PrintFault(IoErr(), "spisdctl");
+        return RETURN_FAIL;
+    }
+
+    const char *name = (const char *)args[ARG_COMMAND];
+    const char *device = args[ARG_DEVICE] ? (const char *)args[ARG_DEVICE] : "spisd.device";
+    ULONG unit = args[ARG_UNIT] ? *(LONG *)args[ARG_UNIT] : 0;
+    char *no_args[] = {NULL};
+    char **cmd_args = args[ARG_ARGS] ? (char **)args[ARG_ARGS] : no_args;
+
+    const struct command *cmd = commands;
+    while (cmd->name && !name_equals(cmd->name, name))
+        cmd++;
+
+    if (!cmd->name)
+    {
+        printf("Unknown command %s, use one of:", name);
+        for (cmd = commands; cmd->name; cmd++)
+            printf(" %s", cmd->name);
+        printf("\n");
+        goto fail1;
+    }
+
+    port = CreateMsgPort();
+    if (!port)
+        goto fail1;
+
+    ior = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+    if (!ior)
+        goto fail2;
+
+    if (OpenDevice(device, unit, (struct IORequest *)ior, 0))
+    {
+        printf("Could not open %s unit %lu\n", device, unit);
+        goto fail3;
+    }
+
+    if (!is_supported(cmd->device_command))
+        printf("%s does not support %s\n", device, cmd->name);
+    else
+    {
+        rc = cmd->handler(cmd_args);
+        if (rc != RETURN_OK)
+            printf("%s failed (error %d)\n", cmd->name, ior->io_Error);
+    }
+
+    CloseDevice((struct IORequest *)ior);
+
+fail3:
+    DeleteIORequest((struct IORequest *)ior);
+
+fail2:
+    DeleteMsgPort(port);
+
+fail1:
+    FreeArgs(rdargs);
+    return rc;
+}
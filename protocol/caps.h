@@ -0,0 +1,44 @@
+/*
+ * Layout of the capability record returned by the GET_CAPS control command.
+ * Shared by the adapter firmware and spi-lib, so it must stay plain C.
+ *
+ * The record is a byte string; 16 and 32 bit fields are big endian. The
+ * first byte is the length of the record, fields are only ever appended,
+ * and a reader treats fields beyond the length it got as zero.
+ */
+#ifndef PROTOCOL_CAPS_H_
+#define PROTOCOL_CAPS_H_
+
+// Byte offsets of the fields.
+#define CAPS_LENGTH             0   // Number of bytes in the record
+#define CAPS_LAYOUT             1   // CAPS_LAYOUT_VERSION
+#define CAPS_FIRMWARE_ID        2   // CAPS_FIRMWARE_...
+#define CAPS_FIRMWARE_VERSION   3   // 16 bit, major << 8 | minor
+#define CAPS_SPI_FAST_KHZ       5   // 16 bit, SPI clock in fast mode
+#define CAPS_SPI_SLOW_KHZ       7   // 16 bit, SPI clock in slow mode
+#define CAPS_CONTROL_CMDS       9   // 32 bit, bit c set if control command c is supported
+#define CAPS_MAX_TRANSFER       13  // 16 bit, largest READ2/WRITE2 in bytes
+#define CAPS_BUFFER_SIZE        15  // 16 bit, bytes the adapter can buffer, 0 if none
+#define CAPS_FEATURES           17  // 16 bit, CAPS_FEATURE_... bits
+#define CAPS_SEQ_SLOTS          19  // Sequencer program slots, 0 if none
+#define CAPS_SEQ_SLOT_SIZE      20  // 16 bit, bytes per slot
+#define CAPS_DEVICES            22  // SPI devices with a chip select each, 0 means 1
+#define CAPS_REQ_LATENCY        23  // 16 bit, most ns from REQ to the command being taken, 0 if unbounded
+
+#define CAPS_SIZE               25
+
+#define CAPS_LAYOUT_VERSION     1
+
+// Firmware IDs. CAPS_FIRMWARE_LEGACY is never sent, spi-lib uses it for
+// an adapter that doesn't know GET_CAPS.
+#define CAPS_FIRMWARE_LEGACY    0
+#define CAPS_FIRMWARE_AVR       1
+#define CAPS_FIRMWARE_RP2040    2
+
+// Feature bits.
+#define CAPS_FEATURE_SPI_BUFFERED   (1 << 0)    // SPI shifts while waiting for CLK
+#define CAPS_FEATURE_TRACE          (1 << 1)    // Built with request tracing
+#define CAPS_FEATURE_ACT_HANDSHAKE  (1 << 2)    // Slow mode signals each byte on ACT
+#define CAPS_FEATURE_SCAN           (1 << 3)    // Sequencer has the SCAN instructions, see scan.h
+
+#endif
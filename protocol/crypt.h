@@ -0,0 +1,22 @@
+/*
+ * Sector encryption done by the adapter, keyed with the CRYPT control
+ * command and applied by the SEQ_XTS_IN and SEQ_XTS_OUT instructions of the
+ * sequencer. Shared by the adapter firmware and the Amiga drivers, so it
+ * must stay plain C.
+ *
+ * Sectors are encrypted with AES-128 in XTS mode (IEEE 1619): the data
+ * unit is a 512 byte sector, and its tweak is the sector number, little
+ * endian. The key is the data key followed by the tweak key. Each SPI device
+ * has a key of its own, set while it is the current device.
+ */
+#ifndef PROTOCOL_CRYPT_H_
+#define PROTOCOL_CRYPT_H_
+
+#define CRYPT_SECTOR_SIZE       512
+#define CRYPT_KEY_SIZE          32
+
+// First parameter byte of CRYPT.
+#define CRYPT_OP_CLEAR          0   // Forget the key of the current device
+#define CRYPT_OP_SET_KEY        1   // CRYPT_KEY_SIZE key bytes follow
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * Block devices kept by the adapter itself, served with the DISK control
+ * command. Shared by the adapter firmware and the Amiga drivers, so it must
+ * stay plain C.
+ *
+ * Units are numbered from 1, so that they can be the unit numbers of
+ * spisd.device, where unit 0 is the SD card. 32 bit fields are big endian.
+ */
+#ifndef PROTOCOL_DISK_H_
+#define PROTOCOL_DISK_H_
+
+#define DISK_SECTOR_SHIFT       9
+#define DISK_SECTOR_SIZE        (1 << DISK_SECTOR_SHIFT)
+
+// Operations. A request moves at most CAPS_BUFFER_SIZE bytes of sectors.
+#define DISK_OP_INFO            0   // Returns the DISK_INFO_ record
+#define DISK_OP_READ            1   // Returns count sectors from lba
+#define DISK_OP_WRITE           2   // Takes count sectors to write at lba
+#define DISK_OP_FLUSH           3   // Puts writes the unit has buffered in place
+
+// Byte offsets in the record returned by DISK_OP_INFO.
+#define DISK_INFO_SECTORS       0   // 32 bit, size of the unit
+#define DISK_INFO_ERASES        4   // 32 bit, erases done since the adapter started
+#define DISK_INFO_TYPE          8   // DISK_TYPE_...
+
+#define DISK_INFO_SIZE          9
+
+#define DISK_TYPE_RAM           1   // Lost when the adapter loses power
+#define DISK_TYPE_FLASH         2   // Erased in blocks, writes are buffered until flushed
+#define DISK_TYPE_REMOTE        3   // Served by another machine, writes are buffered
+                                    // until flushed, and the size is 0 while it is away
+
+// Statuses.
+#define DISK_STATUS_OK          0x00
+#define DISK_STATUS_BAD_REQUEST 0xf0    // No such unit or operation, or too many sectors
+#define DISK_STATUS_RANGE       0xf1    // Sectors past the end of the unit
+#define DISK_STATUS_IO_ERROR    0xf2    // The unit failed to write
+
+#endif
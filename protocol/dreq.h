@@ -0,0 +1,17 @@
+/*
+ * Reply of the DREQ control command, which lets a peripheral's data request
+ * line (the DREQ of a VS1053 decoder, say) wake the Amiga through IRQ
+ * instead of being polled. Shared by the adapter firmware and spi-lib, so it
+ * must stay plain C.
+ *
+ * IRQ is shared with the card detect switch. DREQ releases IRQ unless a card
+ * change is waiting for CARD_PRESENT, and then sets DREQ_STATUS_CARD_CHANGE
+ * so that the Amiga knows to ask.
+ */
+#ifndef PROTOCOL_DREQ_H_
+#define PROTOCOL_DREQ_H_
+
+#define DREQ_STATUS_HIGH        (1 << 0)    // DREQ is high
+#define DREQ_STATUS_CARD_CHANGE (1 << 1)    // IRQ was asserted for the card detect switch
+
+#endif
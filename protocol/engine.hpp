@@ -0,0 +1,932 @@
+/*
+ * The adapter side of the parallel port protocol, shared by the AVR and the
+ * RP2040 firmware.
+ *
+ * Engine<P> is specialised by the compiler for a platform policy P, a struct
+ * of constants and inline static functions that give access to the pins and
+ * to the SPI peripheral of one MCU. See README.md in this directory for the
+ * protocol and for what a policy has to provide. Everything is inlined into
+ * the request handler of the firmware, so the byte loops compile to the same
+ * instructions a hand written loop for that MCU would.
+ */
+#ifndef PROTOCOL_ENGINE_HPP_
+#define PROTOCOL_ENGINE_HPP_
+
+#include <stdint.h>
+
+#include "caps.h"
+#include "crypt.h"
+#include "disk.h"
+#include "dreq.h"
+#include "loopback.h"
+
+#define PROTOCOL_INLINE inline __attribute__((always_inline))
+
+#include "sequencer.hpp"
+
+namespace protocol {
+
+// First command byte.
+constexpr uint8_t CMD_LONG      = 0x80; // 10xxxxxx: READ2/WRITE2, a second byte follows
+constexpr uint8_t CMD_READ      = 0x40; // 01xxxxxx: READ1, otherwise WRITE1
+constexpr uint8_t CMD_CONTROL   = 0xc0; // 11cccccx: control command c, argument x
+
+// Second byte of READ2/WRITE2.
+constexpr uint8_t CMD2_READ     = 0x80;
+
+// Control commands.
+constexpr uint8_t CTRL_SELECT       = 0;    // x = 1 select, 0 deselect
+constexpr uint8_t CTRL_CARD_PRESENT = 1;
+constexpr uint8_t CTRL_SPEED        = 2;    // x = 1 fast, 0 slow
+constexpr uint8_t CTRL_GET_CAPS     = 3;    // x = 0
+constexpr uint8_t CTRL_SEQ_LOAD     = 4;    // x = 0
+constexpr uint8_t CTRL_SEQ_RUN      = 5;    // x = 0
+constexpr uint8_t CTRL_EXCHANGE     = 6;    // x = 0
+constexpr uint8_t CTRL_LOOPBACK     = 7;    // x = 1 enter, 0 leave
+constexpr uint8_t CTRL_STATUS       = 8;    // x = 0
+constexpr uint8_t CTRL_DISK         = 9;    // x = 0
+constexpr uint8_t CTRL_DEVICE       = 10;   // x = 0
+constexpr uint8_t CTRL_XFER         = 11;   // x = 1 read, 0 write
+constexpr uint8_t CTRL_DREQ         = 12;   // x = 1 arm, 0 don't
+constexpr uint8_t CTRL_CRYPT        = 13;   // x = 0
+
+// Header byte of XFER: SDLccccc, and with L a second byte with the low 8
+// bits of the count.
+constexpr uint8_t XFER_SELECT   = 0x80; // Assert the chip select before the first byte
+constexpr uint8_t XFER_DESELECT = 0x40; // Release it after the last byte
+constexpr uint8_t XFER_LONG     = 0x20; // ccccc are the high bits of the count
+
+// Largest READ2/WRITE2, 13 bits of count.
+constexpr uint16_t MAX_TRANSFER = 8192;
+
+// Default implementations of the optional parts of a platform policy.
+struct PlatformDefaults {
+    // Reported by GET_CAPS, see caps.h. A policy must also provide
+    // FIRMWARE_ID, FIRMWARE_VERSION, SPI_FAST_KHZ and SPI_SLOW_KHZ.
+    // BUFFER_SIZE is the largest EXCHANGE, 0 leaves EXCHANGE out.
+    static constexpr uint16_t BUFFER_SIZE = 0;
+    static constexpr uint16_t FEATURES = 0;
+
+    // Number of sequencer program slots, 0 if the platform has no room
+    // for the sequencer. See sequencer.hpp for what else it needs.
+    static constexpr uint8_t SEQ_SLOTS = 0;
+    static constexpr uint16_t SEQ_SLOT_SIZE = 0;
+
+    // Number of block devices kept by the adapter, see disk.h. With units
+    // the policy also provides disk_info(), disk_read(), disk_write() and
+    // disk_flush(), which are only called for units 1 to DISK_UNITS and
+    // return a DISK_STATUS_ value. Sectors are moved through the EXCHANGE
+    // buffer, so BUFFER_SIZE must be at least one sector.
+    static constexpr uint8_t DISK_UNITS = 0;
+
+    // Number of SPI devices, each with its own chip select. With more than
+    // one the policy also provides select_device(), which makes select()
+    // drive the chip select of that device from then on.
+    static constexpr uint8_t DEVICES = 1;
+    static PROTOCOL_INLINE void select_device(uint8_t) {}
+
+    // Most nanoseconds from REQ being asserted in fast mode to the command
+    // byte having been taken off the data lines, provided the previous
+    // request ended at least two E-cycles before. 0 if there is no bound,
+    // which makes the Amiga wait for ACT before it goes on.
+    static constexpr uint16_t REQ_LATENCY_NS = 0;
+
+    // Set if the adapter has a DREQ input, see dreq.h. The policy then also
+    // provides dreq(arm), which releases IRQ unless a card change is waiting,
+    // arms an IRQ for when DREQ next goes high if arm is set, and returns the
+    // DREQ_STATUS_ bits.
+    static constexpr bool HAS_DREQ = false;
+    static PROTOCOL_INLINE uint8_t dreq(bool) { return 0; }
+
+    // Set if the sequencer can encrypt sectors, see crypt.h. The policy
+    // then also provides xts_set_key(key), which sets the key of the current
+    // device or forgets it if key is null, and xts_encrypt(sector, lba) and
+    // xts_decrypt(sector, lba), which work on one sector in place with the
+    // key of the current device and return false if it has none.
+    static constexpr bool HAS_XTS = false;
+    static PROTOCOL_INLINE void xts_set_key(const uint8_t *) {}
+    static PROTOCOL_INLINE bool xts_encrypt(uint8_t *, uint32_t) { return false; }
+    static PROTOCOL_INLINE bool xts_decrypt(uint8_t *, uint32_t) { return false; }
+
+    // Set if the sequencer has the SCAN instructions, see scan.h, which
+    // take another SEQ_IO_SIZE bytes of RAM for the reference of a compare.
+    static constexpr bool HAS_SCAN = false;
+
+    // Set if the SPI can hold one more byte to send while it is shifting,
+    // so the engine can keep it busy while it waits for CLK.
+    static constexpr bool SPI_BUFFERED = false;
+
+    // Called before a read or write starts using the SPI, to finish what a
+    // previous request left behind in a buffered SPI.
+    static PROTOCOL_INLINE void spi_begin() {}
+
+    // Hooks for recording a trace of the requests. cycles_t values are
+    // only passed from wait_start to the matching wait_end.
+    using cycles_t = uint32_t;
+    static PROTOCOL_INLINE void trace_act() {}
+    static PROTOCOL_INLINE void trace_second_byte(uint8_t) {}
+    static PROTOCOL_INLINE void trace_count(uint32_t) {}
+    static PROTOCOL_INLINE void trace_byte_done() {}
+    static PROTOCOL_INLINE void trace_aborted() {}
+    static PROTOCOL_INLINE cycles_t trace_wait_start() { return 0; }
+    static PROTOCOL_INLINE void trace_clk_wait_end(cycles_t) {}
+    static PROTOCOL_INLINE void trace_spi_wait_end(cycles_t) {}
+};
+
+template <typename P>
+class Engine {
+public:
+    using pins_t = typename P::pins_t;
+    using count_t = typename P::count_t;
+
+    // Serves one request. pins is a sample of the pins taken after REQ was
+    // seen asserted, with the command byte on the data lines. Returns when
+    // the request is done or, on platforms that poll REQ, when the Amiga
+    // released REQ early. ACT is left asserted and the data lines may be
+    // left as outputs, restoring them is up to the caller.
+    static PROTOCOL_INLINE void handle_request(pins_t pins) {
+        uint8_t cmd = P::data(pins);
+
+        count_t count;
+        bool read;
+        bool deselect = false;
+
+        if ((cmd & CMD_CONTROL) == CMD_CONTROL) {
+            if (((cmd >> 1) & 0x1f) != CTRL_XFER) {
+                control(pins, (cmd >> 1) & 0x1f, cmd & 1);
+                return;
+            }
+
+            // XFER shares the byte loops with READ and WRITE.
+            P::act();
+            P::trace_act();
+            read = cmd & 1;
+            if (!xfer_header(pins, cmd, count, deselect))
+                return;
+        } else if (!(cmd & CMD_LONG)) { // READ1 or WRITE1
+            count = cmd & 0x3f;
+            P::act();
+            P::trace_act();
+            read = cmd & CMD_READ;
+        } else { // READ2 or WRITE2
+            count = (count_t)(cmd & 0x3f) << 7;
+            P::act();
+            P::trace_act();
+
+            if (!wait_clk(pins))
+                return;
+
+            cmd = P::data(pins);
+            P::trace_second_byte(cmd);
+            count |= cmd & 0x7f;
+            read = cmd & CMD2_READ;
+        }
+
+        P::trace_count(count + 1);
+
+        if (handshake)
+            transfer<true>(pins, cmd, count, read, deselect);
+        else
+            transfer<false>(pins, cmd, count, read, deselect);
+    }
+
+private:
+    using Seq = Sequencer<P>;
+
+    static constexpr uint32_t CONTROL_CMDS =
+        (1 << CTRL_SELECT) | (1 << CTRL_CARD_PRESENT) | (1 << CTRL_SPEED) | (1 << CTRL_GET_CAPS) |
+        (1 << CTRL_LOOPBACK) | (1 << CTRL_STATUS) | (1 << CTRL_XFER) |
+        (P::SEQ_SLOTS ? (1 << CTRL_SEQ_LOAD) | (1 << CTRL_SEQ_RUN) : 0) |
+        (P::BUFFER_SIZE ? (1 << CTRL_EXCHANGE) : 0) |
+        (P::DISK_UNITS ? (1 << CTRL_DISK) : 0) |
+        (P::DEVICES > 1 ? (1 << CTRL_DEVICE) : 0) |
+        (P::HAS_DREQ ? (1 << CTRL_DREQ) : 0) |
+        (P::HAS_XTS ? (1 << CTRL_CRYPT) : 0);
+
+    static_assert(!P::HAS_XTS || P::SEQ_SLOTS, "sectors are encrypted by the sequencer");
+    static_assert(!P::HAS_SCAN || P::SEQ_SLOTS, "scans are run by the sequencer");
+    static_assert(!P::DISK_UNITS || P::BUFFER_SIZE >= DISK_SECTOR_SIZE, "disk sectors go through the buffer");
+    static_assert(P::DEVICES >= 1, "there is at least the device on SS");
+
+    static inline uint8_t exchange_buf[P::BUFFER_SIZE ? P::BUFFER_SIZE : 1];
+
+    // Set in slow mode, where reads and writes signal each byte on ACT.
+    // The adapter starts out in slow mode.
+    static inline bool handshake = true;
+
+    // The device SELECT and the transfers go to, and the speed SPEED last
+    // set for each device.
+    static inline uint8_t device = 0;
+    static inline bool device_fast[P::DEVICES];
+
+    // Set in loopback mode, and its counters, see loopback.h.
+    static inline bool loopback = false;
+    static inline uint16_t lb_sum1, lb_sum2;
+    static inline uint32_t lb_written, lb_read, lb_stalls;
+
+    static constexpr uint16_t FEATURES =
+        P::FEATURES | CAPS_FEATURE_ACT_HANDSHAKE | (P::SPI_BUFFERED ? CAPS_FEATURE_SPI_BUFFERED : 0) |
+        (P::HAS_SCAN ? CAPS_FEATURE_SCAN : 0);
+
+    static constexpr uint8_t caps[CAPS_SIZE] = {
+        CAPS_SIZE,
+        CAPS_LAYOUT_VERSION,
+        P::FIRMWARE_ID,
+        P::FIRMWARE_VERSION >> 8, P::FIRMWARE_VERSION & 0xff,
+        P::SPI_FAST_KHZ >> 8, P::SPI_FAST_KHZ & 0xff,
+        P::SPI_SLOW_KHZ >> 8, P::SPI_SLOW_KHZ & 0xff,
+        CONTROL_CMDS >> 24, (CONTROL_CMDS >> 16) & 0xff, (CONTROL_CMDS >> 8) & 0xff, CONTROL_CMDS & 0xff,
+        MAX_TRANSFER >> 8, MAX_TRANSFER & 0xff,
+        P::BUFFER_SIZE >> 8, P::BUFFER_SIZE & 0xff,
+        FEATURES >> 8, FEATURES & 0xff,
+        P::SEQ_SLOTS,
+        P::SEQ_SLOT_SIZE >> 8, P::SEQ_SLOT_SIZE & 0xff,
+        P::DEVICES,
+        P::REQ_LATENCY_NS >> 8, P::REQ_LATENCY_NS & 0xff,
+    };
+
+    // Waits for the Amiga to toggle CLK and updates pins with the sample in
+    // which it changed. Returns false if REQ was released first, which is
+    // only checked on platforms where P::POLL_REQ is set. The others abandon
+    // the request from the REQ interrupt, and with LATE_SAMPLE leave taking
+    // the new sample to late_sample(), after the time critical writes.
+    template <bool LATE_SAMPLE = false>
+    static PROTOCOL_INLINE bool wait_clk(pins_t &pins) {
+        if constexpr (P::POLL_REQ) {
+            const pins_t prev_clk = P::clk(pins);
+            while (1) {
+                pins_t now = P::sample();
+                if (P::clk(now) != prev_clk) {
+                    pins = now;
+                    return true;
+                }
+
+                if (P::req_released(now)) {
+                    P::trace_aborted();
+                    return false;
+                }
+            }
+        } else {
+            if (P::clk(pins)) {
+                while (P::clk(P::sample()))
+                    ;
+            } else {
+                while (!P::clk(P::sample()))
+                    ;
+            }
+            if constexpr (!LATE_SAMPLE)
+                pins = P::sample();
+            return true;
+        }
+    }
+
+    static PROTOCOL_INLINE void late_sample(pins_t &pins) {
+        if constexpr (!P::POLL_REQ)
+            pins = P::sample();
+    }
+
+    // Receives a byte the Amiga writes with a CLK toggle, as in a write.
+    static PROTOCOL_INLINE bool receive(pins_t &pins, uint8_t &value) {
+        if (!wait_clk(pins))
+            return false;
+        value = P::data(pins);
+        return true;
+    }
+
+    static PROTOCOL_INLINE bool receive16(pins_t &pins, uint16_t &value) {
+        uint8_t hi, lo;
+        if (!receive(pins, hi) || !receive(pins, lo))
+            return false;
+        value = (hi << 8) | lo;
+        return true;
+    }
+
+    static PROTOCOL_INLINE void spi_wait() {
+        auto t = P::trace_wait_start();
+        P::spi_wait();
+        P::trace_spi_wait_end(t);
+    }
+
+    // XFER: the header byte and, for a long count, its low byte. Asserts
+    // the chip select if asked to, and leaves last at the byte the Amiga
+    // wrote last.
+    static PROTOCOL_INLINE bool xfer_header(pins_t &pins, uint8_t &last, count_t &count, bool &deselect) {
+        uint8_t header;
+
+        if (!receive(pins, header))
+            return false;
+        P::trace_second_byte(header);
+
+        count = header & 0x1f;
+        last = header;
+        if (header & XFER_LONG) {
+            if (!receive(pins, last))
+                return false;
+            count = (count << 8) | last;
+        }
+
+        if (header & XFER_SELECT)
+            P::select(true);
+        deselect = header & XFER_DESELECT;
+        return true;
+    }
+
+    // With deselect, the chip select is released after the last byte. In
+    // a read that is as soon as the byte is on the data lines, the Amiga
+    // has an E-cycle more before it releases REQ. In a write the byte must
+    // be shifted out first, so ACT is toggled once more after it and the
+    // Amiga waits for that.
+    template <bool HANDSHAKE>
+    static PROTOCOL_INLINE void transfer(pins_t pins, uint8_t last, count_t count, bool read, bool deselect) {
+        bool done;
+
+        if (loopback) {
+            if (read)
+                done = loopback_read<HANDSHAKE>(pins, last, count);
+            else
+                done = loopback_write<HANDSHAKE>(pins, count);
+        } else {
+            if (read)
+                done = read_bytes<HANDSHAKE>(pins, last, count);
+            else
+                done = write_bytes<HANDSHAKE>(pins, count);
+        }
+
+        if (!deselect || !done)
+            return;
+
+        P::select(false);
+        if (!read) {
+            // ACT was asserted by the command and, with HANDSHAKE, has
+            // changed level once per byte.
+            if (HANDSHAKE && !(count & 1))
+                P::act();
+            else
+                P::act_release();
+        }
+    }
+
+    // Counts a stall if CLK has already toggled when the adapter is ready
+    // for the next byte.
+    static PROTOCOL_INLINE void check_stall(pins_t pins) {
+        if (P::clk(P::sample()) != P::clk(pins))
+            lb_stalls++;
+    }
+
+    // READ1/READ2 in loopback mode: the pattern instead of SPI data.
+    template <bool HANDSHAKE>
+    static PROTOCOL_INLINE bool loopback_read(pins_t pins, uint8_t last, count_t count) {
+        uint8_t value = LOOPBACK_SEED;
+
+        lb_read += (uint32_t)count + 1;
+
+        typename P::Output out(pins, last);
+
+        while (1) {
+            auto next = out.prepare(value);
+            value = LOOPBACK_NEXT(value);
+
+            if constexpr (HANDSHAKE)
+                P::act_release();
+
+            check_stall(pins);
+            if (!wait_clk(pins))
+                return false;
+
+            out.drive(next);
+            if constexpr (HANDSHAKE)
+                P::act();
+
+            if (!count)
+                break;
+            count--;
+        }
+        return true;
+    }
+
+    // WRITE1/WRITE2 in loopback mode: the bytes are summed instead of sent.
+    template <bool HANDSHAKE>
+    static PROTOCOL_INLINE bool loopback_write(pins_t pins, count_t count) {
+        bool released = false;
+
+        lb_written += (uint32_t)count + 1;
+
+        while (1) {
+            check_stall(pins);
+            if (!wait_clk(pins))
+                return false;
+
+            lb_sum1 += P::data(pins);
+            lb_sum2 += lb_sum1;
+
+            if constexpr (HANDSHAKE) {
+                released = !released;
+                if (released)
+                    P::act_release();
+                else
+                    P::act();
+            }
+
+            if (!count)
+                break;
+            count--;
+        }
+        return true;
+    }
+
+    // READ1/READ2 and XFER reads: clock count + 1 bytes in from the SPI and
+    // hand each one to the Amiga when it toggles CLK. Returns false if the
+    // request was abandoned. The next SPI transfer is started as soon as the
+    // byte is on the data lines, or with a buffered SPI as soon as the
+    // previous byte has been received, so that it shifts while the Amiga
+    // takes the current one. last is the byte the Amiga is still driving,
+    // the data lines start out driving the same value.
+    //
+    // With HANDSHAKE, ACT is released when the next byte has been received
+    // and asserted again when it is on the data lines, so the Amiga can
+    // wait for ACT to go high before each CLK toggle.
+    template <bool HANDSHAKE>
+    static PROTOCOL_INLINE bool read_bytes(pins_t pins, uint8_t last, count_t count) {
+        P::spi_begin();
+        P::spi_start(0xff);
+        if constexpr (P::SPI_BUFFERED) {
+            if (count)
+                P::spi_start(0xff);
+        }
+
+        typename P::Output out(pins, last);
+
+        while (1) {
+            spi_wait();
+
+            auto next = out.prepare(P::spi_data());
+
+            // One byte is already shifting, start the one after it.
+            if constexpr (P::SPI_BUFFERED) {
+                if (count >= 2)
+                    P::spi_start(0xff);
+            }
+
+            if constexpr (HANDSHAKE)
+                P::act_release();
+
+            auto t = P::trace_wait_start();
+            if (!wait_clk<true>(pins))
+                return false;
+            P::trace_clk_wait_end(t);
+
+            out.drive(next);
+            late_sample(pins);
+            if constexpr (HANDSHAKE)
+                P::act();
+            P::trace_byte_done();
+
+            if (!count)
+                break;
+
+            if constexpr (!P::SPI_BUFFERED)
+                P::spi_start(0xff);
+            count--;
+        }
+        return true;
+    }
+
+    // WRITE1/WRITE2 and XFER writes: send count + 1 bytes from the Amiga to
+    // the SPI. A buffered SPI is not waited for, the received bytes are
+    // discarded by the next spi_begin().
+    //
+    // With HANDSHAKE, ACT changes level when each byte has been sent, so
+    // the Amiga can wait for it before the next CLK toggle.
+    template <bool HANDSHAKE>
+    static PROTOCOL_INLINE bool write_bytes(pins_t pins, count_t count) {
+        bool released = false;
+
+        P::spi_begin();
+
+        while (1) {
+            auto t = P::trace_wait_start();
+            if (!wait_clk(pins))
+                return false;
+            P::trace_clk_wait_end(t);
+
+            P::spi_start(P::data(pins));
+            if constexpr (!P::SPI_BUFFERED || HANDSHAKE) {
+                spi_wait();
+                (void)P::spi_data();
+            }
+            P::trace_byte_done();
+
+            if constexpr (HANDSHAKE) {
+                released = !released;
+                if (released)
+                    P::act_release();
+                else
+                    P::act();
+            }
+
+            if (!count)
+                break;
+
+            count--;
+        }
+        return true;
+    }
+
+    // SEQ_LOAD: slot, length (16 bit), program. The slot is left empty
+    // unless the whole program fits and arrives.
+    static void seq_load(pins_t pins) {
+        uint8_t slot;
+        uint16_t len;
+
+        if (!receive(pins, slot) || slot >= P::SEQ_SLOTS)
+            return;
+
+        Seq::length[slot] = 0;
+
+        if (!receive16(pins, len) || len > P::SEQ_SLOT_SIZE)
+            return;
+
+        for (uint16_t i = 0; i < len; i++) {
+            if (!receive(pins, Seq::program[slot][i]))
+                return;
+        }
+
+        Seq::length[slot] = len;
+    }
+
+    // SEQ_RUN: slot, argument count, arguments, input length (16 bit),
+    // input. The Amiga then turns the data lines around and toggles CLK
+    // once. The adapter runs the program, drives the status byte and
+    // releases ACT. The Amiga then clocks out the output length (16 bit)
+    // and the output.
+    static void seq_run(pins_t pins) {
+        uint8_t slot, argc, value;
+        uint16_t in_len, out_len;
+
+        if (!receive(pins, slot) || !receive(pins, argc))
+            return;
+
+        for (uint8_t i = 0; i < argc; i++) {
+            if (!receive(pins, value))
+                return;
+            if (i < SEQ_MAX_ARGS)
+                Seq::args[i] = value;
+        }
+
+        if (!receive16(pins, in_len))
+            return;
+
+        for (uint16_t i = 0; i < in_len; i++) {
+            if (!receive(pins, value))
+                return;
+            if (i < P::SEQ_IO_SIZE)
+                Seq::in[i] = value;
+        }
+
+        if (!wait_clk(pins))
+            return;
+
+        uint16_t status;
+        if (slot >= P::SEQ_SLOTS || argc > SEQ_MAX_ARGS || in_len > P::SEQ_IO_SIZE) {
+            status = SEQ_STATUS_BAD_REQUEST;
+            out_len = 0;
+        } else {
+            status = Seq::run(slot, in_len, out_len);
+            if (status == Seq::ABORTED)
+                return;
+        }
+
+        // The program may have changed SS, so the outputs are set up from a
+        // new sample.
+        pins = P::sample();
+        typename P::Output out(pins, status);
+        out.drive(out.prepare(status));
+        P::act_release();
+
+        const uint8_t len[2] = {(uint8_t)(out_len >> 8), (uint8_t)out_len};
+        for (uint8_t i = 0; i < 2; i++) {
+            auto next = out.prepare(len[i]);
+            if (!wait_clk(pins))
+                return;
+            out.drive(next);
+        }
+
+        for (uint16_t i = 0; i < out_len; i++) {
+            auto next = out.prepare(Seq::out[i]);
+            if (!wait_clk(pins))
+                return;
+            out.drive(next);
+        }
+    }
+
+    // EXCHANGE: size - 1 (16 bit), then the bytes to send, written by the
+    // Amiga as in a write. Each is sent on the SPI as it arrives and the
+    // byte received for it is kept, so that the Amiga can turn the data
+    // lines around once and clock them all out as in a read.
+    static void exchange(pins_t pins) {
+        uint16_t count;
+
+        if (!receive16(pins, count) || count >= P::BUFFER_SIZE)
+            return;
+
+        P::spi_begin();
+
+        for (uint16_t i = 0; i <= count; i++) {
+            if (!wait_clk(pins))
+                return;
+            P::spi_start(P::data(pins));
+            spi_wait();
+            exchange_buf[i] = P::spi_data();
+            P::trace_byte_done();
+        }
+
+        typename P::Output out(pins, P::data(pins));
+
+        for (uint16_t i = 0; i <= count; i++) {
+            auto next = out.prepare(exchange_buf[i]);
+            if (!wait_clk(pins))
+                return;
+            out.drive(next);
+        }
+    }
+
+    // DISK: unit, operation, lba (32 bit), sector count, and for a write
+    // the sectors. Then framed like the end of SEQ_RUN: the Amiga turns the
+    // data lines around and toggles CLK once, the adapter does the operation,
+    // drives the status byte and releases ACT, and unless the status is an
+    // error the Amiga clocks out the sectors read or the info record.
+    static void disk(pins_t pins) {
+        uint8_t unit, op, count, value;
+        uint32_t lba = 0;
+
+        if (!receive(pins, unit) || !receive(pins, op))
+            return;
+
+        for (uint8_t i = 0; i < 4; i++) {
+            if (!receive(pins, value))
+                return;
+            lba = (lba << 8) | value;
+        }
+
+        if (!receive(pins, count))
+            return;
+
+        const uint32_t size = (uint32_t)count << DISK_SECTOR_SHIFT;
+
+        if (op == DISK_OP_WRITE) {
+            for (uint32_t i = 0; i < size; i++) {
+                if (!receive(pins, value))
+                    return;
+                if (i < P::BUFFER_SIZE)
+                    exchange_buf[i] = value;
+            }
+        }
+
+        if (!wait_clk(pins))
+            return;
+
+        uint8_t status;
+        uint32_t out_len = 0;
+
+        if (unit == 0 || unit > P::DISK_UNITS || size > P::BUFFER_SIZE) {
+            status = DISK_STATUS_BAD_REQUEST;
+        } else {
+            switch (op) {
+                case DISK_OP_INFO: {
+                    uint32_t sectors, erases;
+                    uint8_t type;
+
+                    status = P::disk_info(unit, sectors, erases, type);
+
+                    const uint32_t fields[2] = {sectors, erases};
+                    for (uint8_t i = 0; i < DISK_INFO_TYPE; i++)
+                        exchange_buf[i] = fields[i >> 2] >> (24 - 8 * (i & 3));
+                    exchange_buf[DISK_INFO_TYPE] = type;
+                    out_len = DISK_INFO_SIZE;
+                    break;
+                }
+
+                case DISK_OP_READ:
+                    status = P::disk_read(unit, lba, count, exchange_buf);
+                    out_len = size;
+                    break;
+
+                case DISK_OP_WRITE:
+                    status = P::disk_write(unit, lba, count, exchange_buf);
+                    break;
+
+                case DISK_OP_FLUSH:
+                    status = P::disk_flush(unit);
+                    break;
+
+                default:
+                    status = DISK_STATUS_BAD_REQUEST;
+                    break;
+            }
+        }
+
+        typename P::Output out(pins, status);
+        out.drive(out.prepare(status));
+        P::act_release();
+
+        if (status != DISK_STATUS_OK)
+            return;
+
+        for (uint32_t i = 0; i < out_len; i++) {
+            auto next = out.prepare(exchange_buf[i]);
+            if (!wait_clk(pins))
+                return;
+            out.drive(next);
+        }
+    }
+
+    // DEVICE: the number of the device to talk to from now on, written as
+    // in a write. The chip select of the current device is released first,
+    // so that at most one is ever asserted, and the SPI clock and the slow
+    // mode handshake are switched to what SPEED last set for the new device.
+    static void select_device(pins_t pins) {
+        uint8_t value;
+
+        if (!receive(pins, value) || value >= P::DEVICES)
+            return;
+
+        P::select(false);
+        P::select_device(value);
+        device = value;
+        P::set_speed(device_fast[value]);
+        handshake = !device_fast[value];
+    }
+
+    // CRYPT: operation, and for CRYPT_OP_SET_KEY the key, written as in a
+    // write. A key that doesn't arrive whole is not set.
+    static void crypt(pins_t pins) {
+        uint8_t op;
+        uint8_t key[CRYPT_KEY_SIZE];
+
+        if (!receive(pins, op))
+            return;
+
+        if (op == CRYPT_OP_CLEAR) {
+            P::xts_set_key(nullptr);
+        } else if (op == CRYPT_OP_SET_KEY) {
+            uint8_t i = 0;
+            while (i < CRYPT_KEY_SIZE && receive(pins, key[i]))
+                i++;
+            if (i == CRYPT_KEY_SIZE)
+                P::xts_set_key(key);
+
+            // Not left behind on the stack.
+            for (uint8_t &b : key)
+                *(volatile uint8_t *)&b = 0;
+        }
+    }
+
+    static PROTOCOL_INLINE void control(pins_t pins, uint8_t cmd, bool arg) {
+        switch (cmd) {
+            case CTRL_SELECT:
+                P::select(arg);
+                P::act();
+                P::trace_act();
+                break;
+
+            case CTRL_CARD_PRESENT: {
+                P::irq_release();
+                P::act();
+                P::trace_act();
+
+                if (!wait_clk(pins))
+                    return;
+
+                typename P::Output out(pins, 0);
+                out.drive(out.prepare(P::card_present() ? 1 : 0));
+                break;
+            }
+
+            case CTRL_SPEED:
+                P::set_speed(arg);
+                handshake = !arg;
+                if constexpr (P::DEVICES > 1)
+                    device_fast[device] = arg;
+                P::act();
+                P::trace_act();
+                break;
+
+            case CTRL_GET_CAPS: {
+                // Like a read of CAPS_SIZE bytes; the Amiga may stop
+                // early by releasing REQ.
+                P::act();
+                P::trace_act();
+
+                typename P::Output out(pins, P::data(pins));
+
+                for (uint8_t i = 0; i < CAPS_SIZE; i++) {
+                    auto next = out.prepare(caps[i]);
+                    if (!wait_clk(pins))
+                        return;
+                    out.drive(next);
+                }
+                break;
+            }
+
+            case CTRL_LOOPBACK:
+                loopback = arg;
+                if (arg) {
+                    lb_sum1 = 0;
+                    lb_sum2 = 0;
+                    lb_written = 0;
+                    lb_read = 0;
+                    lb_stalls = 0;
+                }
+                P::act();
+                P::trace_act();
+                break;
+
+            case CTRL_STATUS: {
+                // Read like GET_CAPS.
+                P::act();
+                P::trace_act();
+
+                const uint32_t fields[LOOPBACK_STATUS_SIZE / 4] = {
+                    ((uint32_t)lb_sum2 << 16) | lb_sum1, lb_written, lb_read, lb_stalls,
+                };
+
+                typename P::Output out(pins, P::data(pins));
+
+                for (uint8_t i = 0; i < LOOPBACK_STATUS_SIZE; i++) {
+                    auto next = out.prepare(fields[i >> 2] >> (24 - 8 * (i & 3)));
+                    if (!wait_clk(pins))
+                        return;
+                    out.drive(next);
+                }
+                break;
+            }
+
+            case CTRL_SEQ_LOAD:
+                if constexpr (P::SEQ_SLOTS > 0) {
+                    P::act();
+                    P::trace_act();
+                    seq_load(pins);
+                }
+                break;
+
+            case CTRL_SEQ_RUN:
+                if constexpr (P::SEQ_SLOTS > 0) {
+                    P::act();
+                    P::trace_act();
+                    seq_run(pins);
+                }
+                break;
+
+            case CTRL_EXCHANGE:
+                if constexpr (P::BUFFER_SIZE > 0) {
+                    P::act();
+                    P::trace_act();
+                    exchange(pins);
+                }
+                break;
+
+            case CTRL_DISK:
+                if constexpr (P::DISK_UNITS > 0) {
+                    P::act();
+                    P::trace_act();
+                    disk(pins);
+                }
+                break;
+
+            case CTRL_DEVICE:
+                if constexpr (P::DEVICES > 1) {
+                    P::act();
+                    P::trace_act();
+                    select_device(pins);
+                }
+                break;
+
+            case CTRL_DREQ:
+                // Read like CARD_PRESENT.
+                if constexpr (P::HAS_DREQ) {
+                    uint8_t status = P::dreq(arg);
+                    P::act();
+                    P::trace_act();
+
+                    if (!wait_clk(pins))
+                        return;
+
+                    typename P::Output out(pins, 0);
+                    out.drive(out.prepare(status));
+                }
+                break;
+
+            case CTRL_CRYPT:
+                if constexpr (P::HAS_XTS) {
+                    P::act();
+                    P::trace_act();
+                    crypt(pins);
+                }
+                break;
+        }
+    }
+};
+
+} // namespace protocol
+
+#endif
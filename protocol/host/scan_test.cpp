@@ -0,0 +1,119 @@
+/*
+ * Runs the scans of scanner.hpp on the host: the same data scanned in one
+ * piece and in chunks carried on through the state record, as sd_scan()
+ * does on the Amiga, must give the same results.
+ *
+ * Build and run with "make test".
+ */
+#include <stdio.h>
+#include <string.h>
+
+#define PROTOCOL_INLINE inline __attribute__((always_inline))
+
+#include "scanner.hpp"
+
+struct Host {
+    static constexpr uint16_t SEQ_IO_SIZE = 512;
+};
+
+using Scanner = protocol::Scanner<Host>;
+
+static int failures;
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const uint8_t *p) { return ((uint64_t)get32(p) << 32) | get32(p + 4); }
+
+static void new_scan(uint8_t *state, uint8_t mode, const char *pattern) {
+    memset(state, 0, SCAN_STATE_SIZE);
+    state[SCAN_STATE_MODE] = mode;
+    state[SCAN_STATE_PATTERN_LEN] = strlen(pattern);
+    memcpy(state + SCAN_STATE_PATTERN, pattern, strlen(pattern));
+}
+
+// Scans size bytes of data chunk bytes at a time, with a new start() for
+// every chunk. Returns false if start() refused the state.
+static bool scan(uint8_t *state, const uint8_t *data, uint32_t size, uint32_t chunk) {
+    for (uint32_t pos = 0; pos < size; pos += chunk) {
+        if (!Scanner::start(state))
+            return false;
+        Scanner::feed(data + pos, size - pos < chunk ? size - pos : chunk);
+        Scanner::end(state);
+    }
+    return true;
+}
+
+static void check(const char *name, uint8_t mode, const char *pattern, const uint8_t *data, uint32_t size,
+        uint32_t chunk) {
+    uint8_t whole[SCAN_STATE_SIZE], chunked[SCAN_STATE_SIZE];
+
+    new_scan(whole, mode, pattern);
+    new_scan(chunked, mode, pattern);
+
+    if (!scan(whole, data, size, size)) {
+        printf("%s: refused in one piece\n", name);
+        failures++;
+        return;
+    }
+
+    if (!scan(chunked, data, size, chunk)) {
+        printf("%s: refused after %lu bytes\n", name, (unsigned long)get64(chunked + SCAN_STATE_BYTES));
+        failures++;
+        return;
+    }
+
+    if (memcmp(whole + SCAN_STATE_BYTES, chunked + SCAN_STATE_BYTES, SCAN_STATE_SIZE - SCAN_STATE_BYTES)) {
+        printf("%s: chunks of %lu differ from one piece\n", name, (unsigned long)chunk);
+        failures++;
+    }
+}
+
+int main() {
+    static uint8_t data[1024];
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    // A match in the first chunk, with the other scans going on after it.
+    memcpy(data + 20, "needle", 6);
+
+    check("CRC32", SCAN_CRC32, "", data, sizeof(data), 64);
+    check("SHA1", SCAN_SHA1, "", data, sizeof(data), 64);
+    check("SEARCH", SCAN_SEARCH, "needle", data, sizeof(data), 64);
+    check("SEARCH|CRC32", SCAN_SEARCH | SCAN_CRC32, "needle", data, sizeof(data), 64);
+    check("SEARCH|SHA1", SCAN_SEARCH | SCAN_SHA1, "needle", data, sizeof(data), 128);
+    check("SEARCH|CRC32 across chunks", SCAN_SEARCH | SCAN_CRC32, "needle", data + 4, sizeof(data) - 4, 19);
+
+    uint8_t state[SCAN_STATE_SIZE];
+    new_scan(state, SCAN_SEARCH | SCAN_CRC32, "needle");
+    scan(state, data, sizeof(data), 64);
+    if (get64(state + SCAN_STATE_FOUND) != 20) {
+        printf("SEARCH: found at %lu, not 20\n", (unsigned long)get64(state + SCAN_STATE_FOUND));
+        failures++;
+    }
+
+    // CRC-32 of "123456789".
+    new_scan(state, SCAN_CRC32, "");
+    scan(state, (const uint8_t *)"123456789", 9, 4);
+    if (get32(state + SCAN_STATE_CRC32) != 0xcbf43926) {
+        printf("CRC32: %08lx, not cbf43926\n", (unsigned long)get32(state + SCAN_STATE_CRC32));
+        failures++;
+    }
+
+    // SHA-1 of "abc".
+    static const uint8_t abc_sha1[20] = {0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+        0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d};
+    new_scan(state, SCAN_SHA1, "");
+    scan(state, (const uint8_t *)"abc", 3, 3);
+    if (memcmp(state + SCAN_STATE_SHA1, abc_sha1, 20)) {
+        printf("SHA1: wrong digest of \"abc\"\n");
+        failures++;
+    }
+
+    if (failures)
+        return 1;
+
+    printf("scan_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Loopback mode, used to measure and check the parallel port link without
+ * the SPI: a READ returns a pattern made by the adapter, and the bytes of a
+ * WRITE are summed instead of being sent. Shared by the adapter firmware and
+ * spi-lib, so it must stay plain C.
+ *
+ * The pattern is an 8 bit Galois LFSR that starts over at LOOPBACK_SEED in
+ * every READ. The checksum is a Fletcher style pair of 16 bit sums over all
+ * bytes written since loopback mode was entered, without the modulo.
+ */
+#ifndef PROTOCOL_LOOPBACK_H_
+#define PROTOCOL_LOOPBACK_H_
+
+#define LOOPBACK_SEED           0x01
+#define LOOPBACK_NEXT(x)        ((unsigned char)(((x) >> 1) ^ (((x) & 1) ? 0xb8 : 0)))
+
+// Byte offsets in the record returned by the STATUS control command. All
+// fields are 32 bit, big endian, and count from when loopback mode was last
+// entered.
+#define LOOPBACK_STATUS_SUM     0   // sum2 << 16 | sum1 of the bytes written
+#define LOOPBACK_STATUS_WRITTEN 4   // bytes written
+#define LOOPBACK_STATUS_READ    8   // bytes read
+#define LOOPBACK_STATUS_STALLS  12  // bytes for which CLK had already toggled
+                                    // when the adapter got ready for them
+
+#define LOOPBACK_STATUS_SIZE    16
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Scans done by the adapter on the data a sequencer program reads, so that
+ * only the result crosses the link: the CRC-32 and SHA-1 of the data, the
+ * first match of a byte pattern, and the first difference from data read
+ * before. Shared by the adapter firmware and the Amiga drivers, so it must
+ * stay plain C.
+ *
+ * A scan is carried in a state record of SCAN_STATE_SIZE bytes. SEQ_SCAN_START
+ * takes it from the input stream, each SEQ_SCAN adds the output so far to
+ * it, and SEQ_SCAN_END appends it to the output. Nothing is kept on the
+ * adapter between runs, so a scan longer than one run is carried on by
+ * giving the record the last run returned to the next one.
+ *
+ * A record with a byte count of 0 starts a new scan: only the mode and the
+ * pattern need to be set, SEQ_SCAN_START sets up the rest. Offsets are from
+ * the first byte of the scan. SHA-1 is only carried in whole 64 byte
+ * blocks, so a scan with SCAN_SHA1 can only be carried on after a multiple
+ * of 64 bytes.
+ *
+ * Fields are big endian, 32 and 64 bit ones at offsets that are multiples
+ * of 4, so that a C struct on the Amiga can have the same layout.
+ */
+#ifndef PROTOCOL_SCAN_H_
+#define PROTOCOL_SCAN_H_
+
+// Mode bits, what SCAN_FEED data is scanned for.
+#define SCAN_CRC32              (1 << 0)    // CRC-32 (IEEE 802.3)
+#define SCAN_SHA1               (1 << 1)    // SHA-1
+#define SCAN_SEARCH             (1 << 2)    // First match of the pattern
+
+// Operand of SEQ_SCAN, what is done with the output.
+#define SCAN_FEED               0   // Scan it as the mode says
+#define SCAN_REF                1   // Append it to the reference, at most SEQ_IO_SIZE bytes
+#define SCAN_CMP                2   // Compare it with the next bytes of the reference
+
+#define SCAN_PATTERN_MAX        32
+
+// Byte offsets of the fields of the state record.
+#define SCAN_STATE_MODE         0   // SCAN_ bits
+#define SCAN_STATE_MATCH        1   // Pattern bytes matched by the last bytes scanned
+#define SCAN_STATE_PATTERN_LEN  2   // 1-SCAN_PATTERN_MAX with SCAN_SEARCH
+#define SCAN_STATE_PATTERN      4   // SCAN_PATTERN_MAX bytes
+#define SCAN_STATE_BYTES        36  // 64 bit, bytes fed and compared
+#define SCAN_STATE_FOUND        44  // 64 bit, offset of the first match, SCAN_NONE if none
+#define SCAN_STATE_MISMATCH     52  // 64 bit, offset of the first difference, SCAN_NONE if none
+#define SCAN_STATE_CRC32        60  // 32 bit, CRC-32 of the bytes fed
+#define SCAN_STATE_SHA1_H       64  // SHA-1 chaining value, 5 x 32 bit
+#define SCAN_STATE_SHA1         84  // SHA-1 of the bytes fed, 20 bytes
+
+#define SCAN_STATE_SIZE         104
+
+// Offsets of both halves of SCAN_STATE_FOUND and SCAN_STATE_MISMATCH are
+// all ones when there is none.
+#define SCAN_NONE               0xffffffffUL
+
+#endif
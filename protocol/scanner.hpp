@@ -0,0 +1,289 @@
+/*
+ * Scans for the SEQ_SCAN instructions of the sequencer, see scan.h: the
+ * CRC-32 and SHA-1 of the data, a search for a pattern, and a compare with a
+ * reference read before. Sequencer<P> only uses this class when P::HAS_SCAN
+ * is set, and the reference takes another P::SEQ_IO_SIZE bytes of RAM.
+ */
+#ifndef PROTOCOL_SCANNER_HPP_
+#define PROTOCOL_SCANNER_HPP_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+
+namespace protocol {
+
+template <typename P>
+class Scanner {
+public:
+    // Takes the state record of a scan. Returns false if it can't be
+    // carried on: a search without a pattern, or SHA-1 part way through a
+    // block.
+    static bool start(const uint8_t *state) {
+        mode = state[SCAN_STATE_MODE];
+        pattern_len = state[SCAN_STATE_PATTERN_LEN];
+        memcpy(pattern, state + SCAN_STATE_PATTERN, SCAN_PATTERN_MAX);
+        bytes = get64(state + SCAN_STATE_BYTES);
+        sha1_len = 0;
+        ref_len = ref_pos = 0;
+
+        if (bytes == 0) {
+            match = 0;
+            found = mismatch = NONE;
+            crc = 0xffffffff;
+            memcpy(sha1_h, SHA1_INIT, sizeof(sha1_h));
+        } else {
+            match = state[SCAN_STATE_MATCH];
+            found = get64(state + SCAN_STATE_FOUND);
+            mismatch = get64(state + SCAN_STATE_MISMATCH);
+            crc = ~get32(state + SCAN_STATE_CRC32);
+            for (uint8_t i = 0; i < 5; i++)
+                sha1_h[i] = get32(state + SCAN_STATE_SHA1_H + 4 * i);
+        }
+
+        if (mode & SCAN_SEARCH) {
+            // All of the pattern is matched once it has been found, and
+            // the other scans go on.
+            if (!pattern_len || pattern_len > SCAN_PATTERN_MAX || match > pattern_len ||
+                (match == pattern_len && found == NONE))
+                return false;
+
+            // Knuth-Morris-Pratt: fail[i] is the longest proper prefix of
+            // the pattern that ends its first i + 1 bytes.
+            fail[0] = 0;
+            for (uint8_t i = 1, k = 0; i < pattern_len; i++) {
+                while (k && pattern[i] != pattern[k])
+                    k = fail[k - 1];
+                if (pattern[i] == pattern[k])
+                    k++;
+                fail[i] = k;
+            }
+        }
+
+        return !(mode & SCAN_SHA1) || !(bytes & 63);
+    }
+
+    // SCAN_FEED
+    static void feed(const uint8_t *data, uint16_t n) {
+        if (mode & SCAN_CRC32)
+            crc32(data, n);
+        if (mode & SCAN_SHA1)
+            sha1(data, n);
+        if ((mode & SCAN_SEARCH) && found == NONE)
+            search(data, n);
+        bytes += n;
+    }
+
+    // SCAN_REF. Returns false if the reference has no room.
+    static bool store(const uint8_t *data, uint16_t n) {
+        if (n > P::SEQ_IO_SIZE - ref_len)
+            return false;
+        memcpy(ref + ref_len, data, n);
+        ref_len += n;
+        return true;
+    }
+
+    // SCAN_CMP. Returns false if the reference is shorter than data. The
+    // reference is empty again once all of it has been compared.
+    static bool compare(const uint8_t *data, uint16_t n) {
+        if (n > ref_len - ref_pos)
+            return false;
+
+        if (mismatch == NONE && memcmp(data, ref + ref_pos, n)) {
+            uint16_t i = 0;
+            while (data[i] == ref[ref_pos + i])
+                i++;
+            mismatch = bytes + i;
+        }
+
+        ref_pos += n;
+        if (ref_pos == ref_len)
+            ref_pos = ref_len = 0;
+        bytes += n;
+        return true;
+    }
+
+    // Writes the state record, SCAN_STATE_SIZE bytes.
+    static void end(uint8_t *state) {
+        state[SCAN_STATE_MODE] = mode;
+        state[SCAN_STATE_MATCH] = match;
+        state[SCAN_STATE_PATTERN_LEN] = pattern_len;
+        state[SCAN_STATE_PATTERN_LEN + 1] = 0;
+        memcpy(state + SCAN_STATE_PATTERN, pattern, SCAN_PATTERN_MAX);
+        put64(state + SCAN_STATE_BYTES, bytes);
+        put64(state + SCAN_STATE_FOUND, found);
+        put64(state + SCAN_STATE_MISMATCH, mismatch);
+        put32(state + SCAN_STATE_CRC32, ~crc);
+
+        uint32_t h[5];
+        for (uint8_t i = 0; i < 5; i++) {
+            put32(state + SCAN_STATE_SHA1_H + 4 * i, sha1_h[i]);
+            h[i] = sha1_h[i];
+        }
+
+        // The digest pads a copy of the last block, so that the scan can
+        // go on.
+        uint8_t block[64];
+        memcpy(block, sha1_buf, sha1_len);
+        uint8_t len = sha1_len;
+        block[len++] = 0x80;
+        if (len > 56) {
+            memset(block + len, 0, 64 - len);
+            sha1_block(h, block);
+            len = 0;
+        }
+        memset(block + len, 0, 56 - len);
+        put64(block + 56, bytes << 3);
+        sha1_block(h, block);
+
+        for (uint8_t i = 0; i < 5; i++)
+            put32(state + SCAN_STATE_SHA1 + 4 * i, h[i]);
+    }
+
+private:
+    static constexpr uint64_t NONE = ((uint64_t)SCAN_NONE << 32) | SCAN_NONE;
+
+    static constexpr uint32_t SHA1_INIT[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    struct CrcTable {
+        uint32_t v[256];
+    };
+
+    // Reflected, polynomial 0x04c11db7.
+    static constexpr CrcTable CRC_TABLE = [] {
+        CrcTable t = {};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (uint8_t k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            t.v[i] = c;
+        }
+        return t;
+    }();
+
+    static inline uint8_t mode;
+    static inline uint8_t match;
+    static inline uint8_t pattern_len;
+    static inline uint8_t pattern[SCAN_PATTERN_MAX];
+    static inline uint8_t fail[SCAN_PATTERN_MAX];
+    static inline uint64_t bytes;
+    static inline uint64_t found;
+    static inline uint64_t mismatch;
+    static inline uint32_t crc;
+    static inline uint32_t sha1_h[5];
+    static inline uint8_t sha1_buf[64];
+    static inline uint8_t sha1_len;
+
+    static inline uint8_t ref[P::SEQ_IO_SIZE];
+    static inline uint16_t ref_len, ref_pos;
+
+    static void crc32(const uint8_t *data, uint16_t n) {
+        uint32_t c = crc;
+        while (n--)
+            c = CRC_TABLE.v[(c ^ *data++) & 0xff] ^ (c >> 8);
+        crc = c;
+    }
+
+    static void sha1(const uint8_t *data, uint16_t n) {
+        while (n) {
+            if (!sha1_len && n >= 64) {
+                sha1_block(sha1_h, data);
+                data += 64;
+                n -= 64;
+                continue;
+            }
+
+            const uint8_t take = n < 64 - sha1_len ? n : 64 - sha1_len;
+            memcpy(sha1_buf + sha1_len, data, take);
+            data += take;
+            n -= take;
+            sha1_len += take;
+            if (sha1_len == 64) {
+                sha1_block(sha1_h, sha1_buf);
+                sha1_len = 0;
+            }
+        }
+    }
+
+    static void sha1_block(uint32_t *h, const uint8_t *block) {
+        uint32_t w[16];
+        for (uint8_t i = 0; i < 16; i++)
+            w[i] = get32(block + 4 * i);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for (uint8_t t = 0; t < 80; t++) {
+            if (t >= 16)
+                w[t & 15] = rol(w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15], 1);
+
+            uint32_t f, k;
+            if (t < 20)
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            else if (t < 40)
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            else if (t < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            else
+                f = b ^ c ^ d, k = 0xca62c1d6;
+
+            const uint32_t temp = rol(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    // Stops at the first match. While no part of the pattern is matched it
+    // skips to the next byte that starts it.
+    static void search(const uint8_t *data, uint16_t n) {
+        for (uint16_t i = 0; i < n; i++) {
+            if (!match) {
+                const uint8_t *p = (const uint8_t *)memchr(data + i, pattern[0], n - i);
+                if (!p)
+                    return;
+                i = p - data;
+            }
+
+            const uint8_t c = data[i];
+            while (match && pattern[match] != c)
+                match = fail[match - 1];
+            if (pattern[match] == c && ++match == pattern_len) {
+                found = bytes + i + 1 - pattern_len;
+                return;
+            }
+        }
+    }
+
+    static PROTOCOL_INLINE uint32_t rol(uint32_t x, uint8_t n) { return (x << n) | (x >> (32 - n)); }
+
+    static PROTOCOL_INLINE uint32_t get32(const uint8_t *p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    static PROTOCOL_INLINE uint64_t get64(const uint8_t *p) { return ((uint64_t)get32(p) << 32) | get32(p + 4); }
+
+    static PROTOCOL_INLINE void put32(uint8_t *p, uint32_t v) {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+    }
+
+    static PROTOCOL_INLINE void put64(uint8_t *p, uint64_t v) {
+        put32(p, v >> 32);
+        put32(p + 4, (uint32_t)v);
+    }
+};
+
+} // namespace protocol
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * Bytecode of the transaction sequencer, shared by the adapter firmware and
+ * the Amiga drivers that build programs, so it must stay plain C.
+ *
+ * A program is loaded into a slot once with SEQ_LOAD and run any number of
+ * times with SEQ_RUN, each run taking up to SEQ_MAX_ARGS argument bytes and
+ * an input stream, and returning a status byte and an output stream. See
+ * README.md in this directory for how the commands are framed.
+ *
+ * 16 bit operands are big endian. Jump targets are absolute offsets in the
+ * program. The program stops at SEQ_END, at SEQ_FAIL, or with one of the
+ * SEQ_STATUS_ errors below.
+ *
+ * The XTS instructions take the sector number from arguments i to i + 3,
+ * big endian, and add one to it, so that a loop over the blocks of a
+ * multiple block transfer gets the next sector each time; see crypt.h.
+ *
+ * The SCAN instructions run the scans of scan.h on the data a program
+ * reads, which it then doesn't return: SEQ_SCAN takes the whole output so
+ * far and leaves it empty.
+ */
+#ifndef PROTOCOL_SEQ_H_
+#define PROTOCOL_SEQ_H_
+
+#define SEQ_MAX_ARGS        16
+
+//      Opcode              Value   Operands        Description
+#define SEQ_END             0x00    //              Stop with status SEQ_STATUS_OK
+#define SEQ_FAIL            0x01    // s            Stop with status s (1-0xef)
+#define SEQ_SELECT          0x02    //              Assert SS
+#define SEQ_DESELECT        0x03    //              Release SS
+#define SEQ_WRITE           0x04    // n b0...      Send n (1-255) literal bytes
+#define SEQ_WRITE_ARG       0x05    // i n          Send n argument bytes, from argument i
+#define SEQ_WRITE_IN        0x06    // n16          Send n bytes of the input stream
+#define SEQ_READ            0x07    // n16          Receive n bytes into the output stream
+#define SEQ_SKIP            0x08    // n16          Receive n bytes and drop them
+#define SEQ_UNTIL_EQ        0x09    // m v n16      Receive until (byte & m) == v, at most n bytes
+#define SEQ_UNTIL_NE        0x0a    // m v n16      Receive until (byte & m) != v, at most n bytes
+#define SEQ_OUT_LAST        0x0b    //              Append the last received byte to the output
+#define SEQ_JMP             0x0c    // t            Jump to t
+#define SEQ_JNM             0x0d    // t            Jump to t if the last UNTIL gave up
+#define SEQ_JEQ             0x0e    // m v t        Jump to t if (last byte & m) == v
+#define SEQ_JNE             0x0f    // m v t        Jump to t if (last byte & m) != v
+#define SEQ_SETC            0x10    // c n16        Counter c = n
+#define SEQ_SETC_ARG        0x11    // c i          Counter c = arguments i and i + 1
+#define SEQ_DJNZ            0x12    // c t          Decrement counter c, jump to t unless zero
+#define SEQ_SPEED           0x13    // x            SPI clock, 1 fast, 0 slow
+#define SEQ_DELAY_US        0x14    // n16          Wait n microseconds
+#define SEQ_XTS_IN          0x15    // i            Encrypt the next sector of the input in place
+#define SEQ_XTS_OUT         0x16    // i            Decrypt the last sector of the output in place
+#define SEQ_SCAN_START      0x17    //              Take the state record of a scan from the input
+#define SEQ_SCAN            0x18    // m            Scan the output as SCAN_ operation m says, then empty it
+#define SEQ_SCAN_END        0x19    //              Append the state record of the scan to the output
+
+#define SEQ_COUNTERS        4
+
+// Statuses. SEQ_FAIL gives 1-0xef, the rest are errors found by the
+// adapter.
+#define SEQ_STATUS_OK           0x00
+#define SEQ_STATUS_BAD_PROGRAM  0xf0    // Empty slot, bad opcode or operand
+#define SEQ_STATUS_IN_UNDERRUN  0xf1    // Read past the end of the input
+#define SEQ_STATUS_OUT_OVERFLOW 0xf2    // Output larger than the buffer
+#define SEQ_STATUS_BAD_REQUEST  0xf3    // Bad slot, too many arguments, input too large or bad scan state
+#define SEQ_STATUS_NO_KEY       0xf4    // XTS instruction for a device without a key
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ * Transaction sequencer: runs the bytecode in seq.h against the SPI of a
+ * platform policy P, so that a whole SD card command or a register access
+ * of another peripheral takes one request from the Amiga instead of one per
+ * step. Engine<P> does the framing of SEQ_LOAD and SEQ_RUN and only uses
+ * this class when P::SEQ_SLOTS is not zero.
+ *
+ * Besides the engine's requirements the policy provides SEQ_SLOTS,
+ * SEQ_SLOT_SIZE (at most 256, jump targets are one byte), SEQ_IO_SIZE (the
+ * size of the input and of the output buffer), and delay_us(us). The XTS
+ * instructions are only run if it sets HAS_XTS, and the SCAN ones if it
+ * sets HAS_SCAN.
+ */
+#ifndef PROTOCOL_SEQUENCER_HPP_
+#define PROTOCOL_SEQUENCER_HPP_
+
+#include <stdint.h>
+
+#include "crypt.h"
+#include "scanner.hpp"
+#include "seq.h"
+
+namespace protocol {
+
+template <typename P>
+class Sequencer {
+public:
+    static_assert(P::SEQ_SLOT_SIZE <= 256, "jump targets are one byte");
+
+    // Returned by run() when the Amiga released REQ; never sent.
+    static constexpr uint16_t ABORTED = 0x100;
+
+    static inline uint8_t program[P::SEQ_SLOTS][P::SEQ_SLOT_SIZE];
+    static inline uint16_t length[P::SEQ_SLOTS];
+
+    static inline uint8_t args[SEQ_MAX_ARGS];
+    static inline uint8_t in[P::SEQ_IO_SIZE];
+    static inline uint8_t out[P::SEQ_IO_SIZE];
+
+    // Runs the program in slot on args and in_len bytes of in, leaving
+    // out_len bytes in out. Returns the status, or ABORTED.
+    static uint16_t run(uint8_t slot, uint16_t in_len, uint16_t &out_len) {
+        const uint8_t *code = program[slot];
+        const uint16_t end = length[slot];
+        uint16_t pc = 0;
+        uint16_t in_pos = 0;
+        uint16_t counter[SEQ_COUNTERS] = {};
+        uint8_t last = 0xff;
+        bool matched = true;
+
+        out_len = 0;
+        P::spi_begin();
+
+        // Operand i of the current instruction, 0 past the end of the
+        // program; the opcode's size check below catches that.
+        auto op = [&](uint16_t i) -> uint8_t { return pc + i < end ? code[pc + i] : 0; };
+        auto op16 = [&](uint16_t i) -> uint16_t { return (op(i) << 8) | op(i + 1); };
+
+        while (1) {
+            if (pc >= end)
+                return SEQ_STATUS_BAD_PROGRAM;
+
+            const uint8_t opcode = code[pc];
+            const uint8_t size = opcode < sizeof(SIZES) ? SIZES[opcode] : 0;
+            if (!size || pc + size > end)
+                return SEQ_STATUS_BAD_PROGRAM;
+
+            uint16_t next = pc + size;
+
+            switch (opcode) {
+                case SEQ_END:
+                    return SEQ_STATUS_OK;
+
+                case SEQ_FAIL:
+                    return op(1);
+
+                case SEQ_SELECT:
+                    P::select(true);
+                    break;
+
+                case SEQ_DESELECT:
+                    P::select(false);
+                    break;
+
+                case SEQ_WRITE: {
+                    const uint8_t n = op(1);
+                    next += n;
+                    if (!n || next > end)
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    for (uint8_t i = 0; i < n; i++)
+                        last = transfer(code[pc + 2 + i]);
+                    break;
+                }
+
+                case SEQ_WRITE_ARG: {
+                    const uint8_t first = op(1);
+                    const uint8_t n = op(2);
+                    if (first + n > SEQ_MAX_ARGS)
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    for (uint8_t i = 0; i < n; i++)
+                        last = transfer(args[first + i]);
+                    break;
+                }
+
+                case SEQ_WRITE_IN: {
+                    const uint16_t n = op16(1);
+                    if (n > in_len - in_pos)
+                        return SEQ_STATUS_IN_UNDERRUN;
+                    for (uint16_t i = 0; i < n; i++)
+                        last = transfer(in[in_pos++]);
+                    break;
+                }
+
+                case SEQ_READ: {
+                    const uint16_t n = op16(1);
+                    if (n > P::SEQ_IO_SIZE - out_len)
+                        return SEQ_STATUS_OUT_OVERFLOW;
+                    for (uint16_t i = 0; i < n; i++)
+                        out[out_len++] = last = transfer(0xff);
+                    break;
+                }
+
+                case SEQ_SKIP: {
+                    const uint16_t n = op16(1);
+                    for (uint16_t i = 0; i < n; i++)
+                        last = transfer(0xff);
+                    break;
+                }
+
+                case SEQ_UNTIL_EQ:
+                case SEQ_UNTIL_NE: {
+                    const uint8_t mask = op(1);
+                    const uint8_t value = op(2);
+                    const bool eq = opcode == SEQ_UNTIL_EQ;
+                    uint16_t n = op16(3);
+                    matched = false;
+                    while (n--) {
+                        if (released())
+                            return ABORTED;
+                        last = transfer(0xff);
+                        if (((last & mask) == value) == eq) {
+                            matched = true;
+                            break;
+                        }
+                    }
+                    break;
+                }
+
+                case SEQ_OUT_LAST:
+                    if (out_len >= P::SEQ_IO_SIZE)
+                        return SEQ_STATUS_OUT_OVERFLOW;
+                    out[out_len++] = last;
+                    break;
+
+                case SEQ_JMP:
+                    next = op(1);
+                    break;
+
+                case SEQ_JNM:
+                    if (!matched)
+                        next = op(1);
+                    break;
+
+                case SEQ_JEQ:
+                case SEQ_JNE:
+                    if (((last & op(1)) == op(2)) == (opcode == SEQ_JEQ))
+                        next = op(3);
+                    break;
+
+                case SEQ_SETC:
+                    if (op(1) >= SEQ_COUNTERS)
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    counter[op(1)] = op16(2);
+                    break;
+
+                case SEQ_SETC_ARG:
+                    if (op(1) >= SEQ_COUNTERS || op(2) + 2 > SEQ_MAX_ARGS)
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    counter[op(1)] = (args[op(2)] << 8) | args[op(2) + 1];
+                    break;
+
+                case SEQ_DJNZ:
+                    if (op(1) >= SEQ_COUNTERS)
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    if (--counter[op(1)])
+                        next = op(2);
+                    break;
+
+                case SEQ_SPEED:
+                    P::set_speed(op(1));
+                    break;
+
+                case SEQ_DELAY_US:
+                    P::delay_us(op16(1));
+                    break;
+
+                case SEQ_XTS_IN:
+                case SEQ_XTS_OUT:
+                    if constexpr (P::HAS_XTS) {
+                        const uint8_t i = op(1);
+                        if (i + 4 > SEQ_MAX_ARGS)
+                            return SEQ_STATUS_BAD_PROGRAM;
+
+                        const uint32_t sector = ((uint32_t)args[i] << 24) | ((uint32_t)args[i + 1] << 16) |
+                            ((uint32_t)args[i + 2] << 8) | args[i + 3];
+
+                        if (opcode == SEQ_XTS_IN) {
+                            if (CRYPT_SECTOR_SIZE > in_len - in_pos)
+                                return SEQ_STATUS_IN_UNDERRUN;
+                            if (!P::xts_encrypt(in + in_pos, sector))
+                                return SEQ_STATUS_NO_KEY;
+                        } else {
+                            if (out_len < CRYPT_SECTOR_SIZE)
+                                return SEQ_STATUS_BAD_PROGRAM;
+                            if (!P::xts_decrypt(out + out_len - CRYPT_SECTOR_SIZE, sector))
+                                return SEQ_STATUS_NO_KEY;
+                        }
+
+                        // The next sector, for the next block.
+                        for (uint8_t j = i + 4; j-- > i && !++args[j];)
+                            ;
+                        break;
+                    } else {
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    }
+
+                case SEQ_SCAN_START:
+                    if constexpr (P::HAS_SCAN) {
+                        if (SCAN_STATE_SIZE > in_len - in_pos)
+                            return SEQ_STATUS_IN_UNDERRUN;
+                        if (!Scan::start(in + in_pos))
+                            return SEQ_STATUS_BAD_REQUEST;
+                        in_pos += SCAN_STATE_SIZE;
+                        break;
+                    } else {
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    }
+
+                case SEQ_SCAN:
+                    if constexpr (P::HAS_SCAN) {
+                        switch (op(1)) {
+                            case SCAN_FEED:
+                                Scan::feed(out, out_len);
+                                break;
+                            case SCAN_REF:
+                                if (!Scan::store(out, out_len))
+                                    return SEQ_STATUS_OUT_OVERFLOW;
+                                break;
+                            case SCAN_CMP:
+                                if (!Scan::compare(out, out_len))
+                                    return SEQ_STATUS_IN_UNDERRUN;
+                                break;
+                            default:
+                                return SEQ_STATUS_BAD_PROGRAM;
+                        }
+                        out_len = 0;
+                        break;
+                    } else {
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    }
+
+                case SEQ_SCAN_END:
+                    if constexpr (P::HAS_SCAN) {
+                        if (SCAN_STATE_SIZE > P::SEQ_IO_SIZE - out_len)
+                            return SEQ_STATUS_OUT_OVERFLOW;
+                        Scan::end(out + out_len);
+                        out_len += SCAN_STATE_SIZE;
+                        break;
+                    } else {
+                        return SEQ_STATUS_BAD_PROGRAM;
+                    }
+            }
+
+            // A program that loops forever is stopped by the Amiga giving
+            // up and releasing REQ.
+            if (next <= pc && released())
+                return ABORTED;
+
+            pc = next;
+        }
+    }
+
+private:
+    // Instruction sizes including the opcode, SEQ_WRITE's literal bytes
+    // not counted. 0 for unknown opcodes.
+    static constexpr uint8_t SIZES[] = {
+        1,  // SEQ_END
+        2,  // SEQ_FAIL
+        1,  // SEQ_SELECT
+        1,  // SEQ_DESELECT
+        2,  // SEQ_WRITE
+        3,  // SEQ_WRITE_ARG
+        3,  // SEQ_WRITE_IN
+        3,  // SEQ_READ
+        3,  // SEQ_SKIP
+        5,  // SEQ_UNTIL_EQ
+        5,  // SEQ_UNTIL_NE
+        1,  // SEQ_OUT_LAST
+        2,  // SEQ_JMP
+        2,  // SEQ_JNM
+        4,  // SEQ_JEQ
+        4,  // SEQ_JNE
+        4,  // SEQ_SETC
+        3,  // SEQ_SETC_ARG
+        3,  // SEQ_DJNZ
+        2,  // SEQ_SPEED
+        3,  // SEQ_DELAY_US
+        2,  // SEQ_XTS_IN
+        2,  // SEQ_XTS_OUT
+        1,  // SEQ_SCAN_START
+        2,  // SEQ_SCAN
+        1,  // SEQ_SCAN_END
+    };
+
+    using Scan = Scanner<P>;
+
+    static PROTOCOL_INLINE uint8_t transfer(uint8_t value) {
+        P::spi_start(value);
+        P::spi_wait();
+        return P::spi_data();
+    }
+
+    static PROTOCOL_INLINE bool released() {
+        if constexpr (P::POLL_REQ)
+            return P::req_released(P::sample());
+        else
+            return false;
+    }
+};
+
+} // namespace protocol
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * trace_decode - fetches the event trace from an RP2040 adapter built with
+ * PAR_SPI_TRACE over USB CDC, and prints it as a per command timeline.
+ *
+ * Usage: trace_decode [-d <tty>] [-c] [-w <file>] [-r <file>]
+ *
+ *   -d <tty>   Serial device of the adapter (default /dev/ttyACM0)
+ *   -c         Clear the trace on the adapter instead of reading it
+ *   -w <file>  Also save the raw frames to file
+ *   -r <file>  Decode raw frames saved with -w instead of reading the adapter
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "link_protocol.h"
+
+#define READ_TIMEOUT_MS 2000
+
+struct totals {
+    uint32_t requests;
+    uint32_t bytes;
+    uint32_t aborted;
+    uint64_t busy_us;
+    uint64_t clk_wait;
+    uint64_t spi_busy;
+};
+
+static int fd = -1;
+static FILE *save_file;
+static uint32_t sys_clk_hz = 125000000;
+static uint32_t first_time;
+static uint32_t prev_time;
+static int have_time;
+static struct totals totals;
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int open_tty(const char *path) {
+    struct termios tio;
+
+    int f = open(path, O_RDWR | O_NOCTTY);
+    if (f < 0)
+        return -1;
+
+    if (tcgetattr(f, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(f, TCSANOW, &tio);
+    }
+    tcflush(f, TCIOFLUSH);
+    return f;
+}
+
+static int read_exact(void *buf, size_t size) {
+    uint8_t *p = buf;
+
+    while (size) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, READ_TIMEOUT_MS) <= 0)
+            return -1;
+
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (save_file)
+            fwrite(p, 1, n, save_file);
+
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int send_frame(uint8_t type) {
+    uint8_t header[4] = {LINK_SYNC, type, 0, 0};
+    return write(fd, header, sizeof(header)) == sizeof(header) ? 0 : -1;
+}
+
+static const char *command_name(const uint8_t *cmd, char *buf) {
+    uint8_t b = cmd[0];
+
+    switch (b >> 6) {
+        case 0:
+            return "WRITE1";
+        case 1:
+            return "READ1";
+        case 2:
+            return (cmd[1] & 0x80) ? "READ2" : "WRITE2";
+    }
+
+    switch ((b >> 1) & 0x1f) {
+        case 0:
+            return (b & 1) ? "SELECT" : "DESELECT";
+        case 1:
+            return "CARD_PRESENT";
+        case 2:
+            return (b & 1) ? "SPEED_FAST" : "SPEED_SLOW";
+    }
+
+    sprintf(buf, "CTRL_%02x", b);
+    return buf;
+}
+
+static double cycles_to_us(uint32_t cycles) {
+    return cycles * 1e6 / sys_clk_hz;
+}
+
+static void print_event(const uint8_t *p) {
+    uint32_t time_us = get32(p + 0);
+    uint8_t type = p[4];
+    const uint8_t *cmd = p + 5;
+    uint8_t flags = p[7];
+    char name_buf[16];
+
+    if (!have_time) {
+        first_time = time_us;
+        prev_time = time_us;
+        have_time = 1;
+    }
+
+    uint32_t rel = time_us - first_time;
+    uint32_t gap = time_us - prev_time;
+    prev_time = time_us;
+
+    if (type == TRACE_EVENT_CDET) {
+        printf("%10u %8u  CDET %s\n", rel, gap, cmd[0] ? "high (no card)" : "low (card)");
+        return;
+    }
+
+    if (type != TRACE_EVENT_REQUEST) {
+        printf("%10u %8u  unknown event type %u\n", rel, gap, type);
+        return;
+    }
+
+    uint16_t count = get16(p + 8);
+    uint16_t done = get16(p + 10);
+    uint32_t decode = get32(p + 12);
+    uint32_t clk_wait = get32(p + 16);
+    uint32_t spi_busy = get32(p + 20);
+    uint32_t duration = get32(p + 24);
+
+    printf("%10u %8u  %-12s %5u %5u %9.2f %9.1f %9.1f %8u%s\n",
+            rel, gap, command_name(cmd, name_buf), count, done,
+            cycles_to_us(decode), cycles_to_us(clk_wait), cycles_to_us(spi_busy),
+            duration, (flags & TRACE_F_ABORTED) ? "  aborted" : "");
+
+    totals.requests++;
+    totals.bytes += done;
+    totals.busy_us += duration;
+    totals.clk_wait += clk_wait;
+    totals.spi_busy += spi_busy;
+    if (flags & TRACE_F_ABORTED)
+        totals.aborted++;
+}
+
+static int decode_frames(void) {
+    uint8_t header[4];
+    uint8_t th[sizeof(trace_data_header_t)];
+    uint8_t event[sizeof(trace_event_t)];
+
+    printf("%10s %8s  %-12s %5s %5s %9s %9s %9s %8s\n",
+            "time_us", "gap_us", "command", "count", "done",
+            "decode_us", "clk_us", "spi_us", "dur_us");
+
+    while (1) {
+        if (read_exact(header, sizeof(header)))
+            return -1;
+
+        if (header[0] != LINK_SYNC) {
+            fprintf(stderr, "Lost frame sync\n");
+            return -1;
+        }
+
+        uint16_t length = get16(header + 2);
+
+        if (header[1] != LINK_TRACE_DATA) {
+            // Skip frames that are not for us.
+            uint8_t skip;
+            while (length--) {
+                if (read_exact(&skip, 1))
+                    return -1;
+            }
+            continue;
+        }
+
+        if (read_exact(th, sizeof(th)))
+            return -1;
+
+        sys_clk_hz = get32(th + 0);
+        uint32_t dropped = get32(th + 4);
+        uint16_t count = get16(th + 8);
+        uint16_t flags = get16(th + 10);
+
+        if (dropped)
+            printf("*** %u events dropped, ring was full ***\n", dropped);
+
+        for (uint16_t i = 0; i < count; i++) {
+            if (read_exact(event, sizeof(event)))
+                return -1;
+            print_event(event);
+        }
+
+        if (flags & TRACE_DATA_LAST)
+            break;
+    }
+
+    if (totals.requests) {
+        uint32_t span = prev_time - first_time;
+
+        printf("\n%u requests, %u bytes, %u aborted\n", totals.requests, totals.bytes, totals.aborted);
+        printf("REQ asserted %llu us of %u us, waiting for CLK %.0f us, waiting for SPI %.0f us\n",
+                (unsigned long long)totals.busy_us, span,
+                totals.clk_wait * 1e6 / sys_clk_hz, totals.spi_busy * 1e6 / sys_clk_hz);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *tty = "/dev/ttyACM0";
+    const char *save_path = NULL;
+    const char *read_path = NULL;
+    int clear = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:cw:r:")) != -1) {
+        switch (opt) {
+            case 'd':
+                tty = optarg;
+                break;
+            case 'c':
+                clear = 1;
+                break;
+            case 'w':
+                save_path = optarg;
+                break;
+            case 'r':
+                read_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d <tty>] [-c] [-w <file>] [-r <file>]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (read_path) {
+        fd = open(read_path, O_RDONLY);
+        if (fd < 0) {
+            perror(read_path);
+            return 1;
+        }
+        return decode_frames() ? 1 : 0;
+    }
+
+    fd = open_tty(tty);
+    if (fd < 0) {
+        perror(tty);
+        return 1;
+    }
+
+    if (clear)
+        return send_frame(LINK_TRACE_CLEAR) ? 1 : 0;
+
+    if (save_path) {
+        save_file = fopen(save_path, "wb");
+        if (!save_file) {
+            perror(save_path);
+            return 1;
+        }
+    }
+
+    if (send_frame(LINK_TRACE_READ)) {
+        perror("write");
+        return 1;
+    }
+
+    int res = decode_frames();
+
+    if (save_file)
+        fclose(save_file);
+
+    if (res) {
+        fprintf(stderr, "Failed to read trace\n");
+        return 1;
+    }
+    return 0;
+}
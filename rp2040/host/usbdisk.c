@@ -0,0 +1,246 @@
+/*
+ * usbdisk - serves a disk image file to an RP2040 adapter built with
+ * PAR_SPI_USB_DISK over USB CDC, where the Amiga sees it as unit 3 of
+ * spisd.device. Answers the adapter's LINK_DISK_REQUEST frames one at a
+ * time until the adapter goes away.
+ *
+ * Usage: usbdisk [-d <tty>] [-r] [-v] <image>
+ *
+ *   -d <tty>   Serial device of the adapter (default /dev/ttyACM0)
+ *   -r         Serve the image read only, writes fail
+ *   -v         Print every request
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "link_protocol.h"
+
+#define REQUEST_SIZE    8
+#define REPLY_SIZE      12
+
+static int fd = -1;
+static int image = -1;
+static uint32_t image_sectors;
+static int read_only;
+static int verbose;
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int open_tty(const char *path) {
+    struct termios tio;
+
+    int f = open(path, O_RDWR | O_NOCTTY);
+    if (f < 0)
+        return -1;
+
+    if (tcgetattr(f, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(f, TCSANOW, &tio);
+    }
+    tcflush(f, TCIOFLUSH);
+    return f;
+}
+
+static int read_exact(void *buf, size_t size) {
+    uint8_t *p = buf;
+
+    while (size) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int write_exact(const void *buf, size_t size) {
+    const uint8_t *p = buf;
+
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Moves count sectors at lba between the image and buf. Returns 0 if all
+// of them were.
+static int image_io(int write, uint32_t lba, uint32_t count, uint8_t *buf) {
+    size_t size = (size_t)count * LINK_DISK_SECTOR_SIZE;
+    off_t offset = (off_t)lba * LINK_DISK_SECTOR_SIZE;
+
+    if (lba >= image_sectors || count > image_sectors - lba)
+        return -1;
+
+    if (write) {
+        if (read_only)
+            return -1;
+        return pwrite(image, buf, size, offset) == (ssize_t)size ? 0 : -1;
+    }
+    return pread(image, buf, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+static int serve(void) {
+    static uint8_t data[LINK_DISK_MAX_SECTORS * LINK_DISK_SECTOR_SIZE];
+    uint8_t header[4];
+    uint8_t req[REQUEST_SIZE];
+
+    while (1) {
+        if (read_exact(header, 1))
+            return -1;
+
+        // Resynchronize on the sync byte.
+        if (header[0] != LINK_SYNC)
+            continue;
+
+        if (read_exact(header + 1, 3))
+            return -1;
+
+        uint16_t length = get16(header + 2);
+
+        if (header[1] != LINK_DISK_REQUEST || length < REQUEST_SIZE) {
+            uint8_t skip;
+            while (length--) {
+                if (read_exact(&skip, 1))
+                    return -1;
+            }
+            continue;
+        }
+
+        if (read_exact(req, REQUEST_SIZE))
+            return -1;
+
+        uint8_t op = req[0];
+        uint8_t count = req[1];
+        uint32_t lba = get32(req + 4);
+        uint32_t data_len = length - REQUEST_SIZE;
+        uint8_t status = 0;
+
+        if (count > LINK_DISK_MAX_SECTORS || data_len > sizeof(data))
+            return -1;
+
+        if (read_exact(data, data_len))
+            return -1;
+
+        uint8_t reply[4 + REPLY_SIZE] = {LINK_SYNC, LINK_DISK_REPLY};
+        uint32_t reply_data = 0;
+
+        memcpy(reply + 4, req, REQUEST_SIZE);
+
+        switch (op) {
+            case LINK_DISK_INFO:
+                put32(reply + 8, image_sectors);
+                break;
+
+            case LINK_DISK_READ:
+                if (image_io(0, lba, count, data))
+                    status = 1;
+                else
+                    reply_data = count * LINK_DISK_SECTOR_SIZE;
+                break;
+
+            case LINK_DISK_WRITE:
+                if (data_len != count * LINK_DISK_SECTOR_SIZE || image_io(1, lba, count, data))
+                    status = 1;
+                break;
+
+            default:
+                status = 1;
+                break;
+        }
+
+        if (verbose) {
+            static const char *names[] = {"info", "read", "write"};
+            printf("%-5s %8u %2u%s\n", op < 3 ? names[op] : "?", lba, count, status ? "  failed" : "");
+        }
+
+        reply[4 + 8] = status;
+        put16(reply + 2, REPLY_SIZE + reply_data);
+
+        if (write_exact(reply, sizeof(reply)) || write_exact(data, reply_data))
+            return -1;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *tty = "/dev/ttyACM0";
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:rv")) != -1) {
+        switch (opt) {
+            case 'd':
+                tty = optarg;
+                break;
+            case 'r':
+                read_only = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-d <tty>] [-r] [-v] <image>\n", argv[0]);
+        return 1;
+    }
+
+    image = open(argv[optind], read_only ? O_RDONLY : O_RDWR);
+    if (image < 0 || fstat(image, &st)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    image_sectors = st.st_size / LINK_DISK_SECTOR_SIZE;
+
+    fd = open_tty(tty);
+    if (fd < 0) {
+        perror(tty);
+        return 1;
+    }
+
+    printf("Serving %u sectors of %s%s\n", image_sectors, argv[optind], read_only ? " read only" : "");
+
+    serve();
+
+    fprintf(stderr, "Lost the adapter\n");
+    return 1;
+}
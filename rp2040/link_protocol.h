@@ -0,0 +1,82 @@
+/*
+ * Framing used on the USB CDC link between the RP2040 adapter and a host.
+ *
+ * This file is shared by the firmware and the host tools in host/, so it
+ * only depends on stdint.h. All multi byte fields are little endian.
+ */
+#ifndef LINK_PROTOCOL_H_
+#define LINK_PROTOCOL_H_
+
+#include <stdint.h>
+
+#define LINK_SYNC               0xa5
+
+// Every frame starts with a header, followed by length bytes of payload.
+typedef struct {
+    uint8_t sync;
+    uint8_t type;
+    uint16_t length;
+} link_header_t;
+
+// Host to adapter.
+#define LINK_TRACE_READ         0x01    // Send trace events recorded since last read
+#define LINK_TRACE_CLEAR        0x02    // Discard recorded trace events
+#define LINK_DISK_REPLY         0x03    // link_disk_reply_t, then the sectors of a read
+
+// Adapter to host.
+#define LINK_TRACE_DATA         0x81    // trace_data_header_t + count * trace_event_t
+#define LINK_DISK_REQUEST       0x82    // link_disk_request_t, then the sectors of a write
+
+#define TRACE_DATA_LAST         0x0001  // No more LINK_TRACE_DATA frames follow
+
+typedef struct {
+    uint32_t sys_clk_hz;    // Frequency of the cycle counts in the events
+    uint32_t dropped;       // Events lost because the ring was full
+    uint16_t count;         // Number of events in this frame
+    uint16_t flags;
+} trace_data_header_t;
+
+#define TRACE_EVENT_REQUEST     1       // One Amiga request, REQ asserted until released
+#define TRACE_EVENT_CDET        2       // Card detect changed, cmd[0] = new pin level
+
+#define TRACE_F_ABORTED         0x01    // REQ was released before all bytes were transferred
+
+typedef struct {
+    uint32_t time_us;       // When REQ was seen asserted
+    uint8_t type;
+    uint8_t cmd[2];         // Command byte, and second command byte of READ2/WRITE2
+    uint8_t flags;
+    uint16_t count;         // Bytes requested by the command
+    uint16_t done;          // Bytes actually transferred
+    uint32_t decode;        // Cycles from REQ seen until ACT asserted
+    uint32_t clk_wait;      // Cycles spent waiting for the Amiga to toggle CLK
+    uint32_t spi_busy;      // Cycles spent waiting for the SPI to finish a byte
+    uint32_t duration_us;   // Time from REQ seen until REQ released
+} trace_event_t;
+
+// Disk requests, sent by the adapter to the disk image daemon (host/usbdisk)
+// one at a time, each answered with a reply echoing op, count, tag and lba.
+#define LINK_DISK_INFO          0       // Reply lba = number of sectors of the image
+#define LINK_DISK_READ          1
+#define LINK_DISK_WRITE         2
+
+#define LINK_DISK_SECTOR_SIZE   512
+#define LINK_DISK_MAX_SECTORS   8
+
+typedef struct {
+    uint8_t op;
+    uint8_t count;          // Sectors, at most LINK_DISK_MAX_SECTORS
+    uint16_t tag;           // Chosen by the adapter
+    uint32_t lba;
+} link_disk_request_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t count;
+    uint16_t tag;
+    uint32_t lba;
+    uint8_t status;         // 0, or 1 if the image could not be read or written
+    uint8_t reserved[3];
+} link_disk_reply_t;
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * RAM disk and flash disk units, see local_disk.h.
+ *
+ * The flash is erased in 4 KB blocks, eight disk sectors, and an erase
+ * takes tens of milliseconds and wears the block. Writes to the flash disk
+ * are therefore collected in a copy of one block, which is put back when a
+ * write goes to another block or when the Amiga flushes the unit, so that a
+ * run of writes to the same block costs one erase. When putting it back the
+ * block is only erased if some bit has to go from 0 to 1, and only the
+ * pages that changed are programmed.
+ */
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#if PAR_SPI_TRACE || PAR_SPI_USB_DISK
+#include "pico/multicore.h"
+#endif
+
+#include "disk.h"
+#include "local_disk.h"
+#if PAR_SPI_USB_DISK
+#include "usb_disk.h"
+#endif
+
+// The trace ring takes 72 KB of RAM and the USB disk's buffers 28 KB, so
+// the RAM disk is smaller with them.
+#ifndef RAM_DISK_SIZE
+#if PAR_SPI_TRACE || PAR_SPI_USB_DISK
+#define RAM_DISK_SIZE       (64 * 1024)
+#else
+#define RAM_DISK_SIZE       (128 * 1024)
+#endif
+#endif
+
+// The flash disk runs from here to the end of the flash. If the firmware
+// grows past it the unit reports zero sectors.
+#ifndef FLASH_DISK_OFFSET
+#define FLASH_DISK_OFFSET   (512 * 1024)
+#endif
+
+#define BLOCK_SECTORS       (FLASH_SECTOR_SIZE / DISK_SECTOR_SIZE)
+#define BLOCK_PAGES         (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define NO_BLOCK            0xffffffff
+
+extern char __flash_binary_end;
+
+static uint8_t ram_disk[RAM_DISK_SIZE];
+
+static uint32_t flash_sectors;
+static uint32_t flash_erases;
+
+// The block of the flash disk that writes go to, and whether it differs
+// from the flash.
+static uint8_t block_buf[FLASH_SECTOR_SIZE];
+static uint32_t cached_block = NO_BLOCK;
+static bool block_dirty;
+
+void local_disk_init(void) {
+    if ((uintptr_t)&__flash_binary_end - XIP_BASE <= FLASH_DISK_OFFSET)
+        flash_sectors = (PICO_FLASH_SIZE_BYTES - FLASH_DISK_OFFSET) / DISK_SECTOR_SIZE;
+
+#if PAR_SPI_USB_DISK
+    usb_disk_init();
+#endif
+}
+
+// Reads bypass the XIP cache, so that they don't evict the firmware.
+static const uint8_t *flash_data(uint32_t block) {
+    return (const uint8_t *)(XIP_NOCACHE_NOALLOC_BASE + FLASH_DISK_OFFSET) + block * FLASH_SECTOR_SIZE;
+}
+
+// Nothing may run from flash while it is erased or programmed. With
+// tracing or the USB disk core 1 does, so it is parked.
+static uint32_t flash_lock(void) {
+#if PAR_SPI_TRACE || PAR_SPI_USB_DISK
+    multicore_lockout_start_blocking();
+#endif
+    return save_and_disable_interrupts();
+}
+
+static void flash_unlock(uint32_t ints) {
+    restore_interrupts(ints);
+#if PAR_SPI_TRACE || PAR_SPI_USB_DISK
+    multicore_lockout_end_blocking();
+#endif
+}
+
+static bool is_erased(const uint8_t *p, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        if (p[i] != 0xff)
+            return false;
+    }
+    return true;
+}
+
+// Puts the cached block back in the flash if it was written to.
+static uint8_t put_block(void) {
+    if (!block_dirty)
+        return DISK_STATUS_OK;
+
+    block_dirty = false;
+
+    const uint8_t *old = flash_data(cached_block);
+    const uint32_t offset = FLASH_DISK_OFFSET + cached_block * FLASH_SECTOR_SIZE;
+    bool erase = false;
+    uint32_t pages = 0;
+
+    for (uint32_t i = 0; i < FLASH_SECTOR_SIZE && !erase; i++)
+        erase = block_buf[i] & ~old[i];
+
+    for (uint32_t page = 0; page < BLOCK_PAGES; page++) {
+        const uint8_t *p = block_buf + page * FLASH_PAGE_SIZE;
+        bool changed;
+
+        if (erase)
+            changed = !is_erased(p, FLASH_PAGE_SIZE);
+        else
+            changed = memcmp(p, old + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE) != 0;
+
+        if (changed)
+            pages |= 1 << page;
+    }
+
+    if (!erase && !pages)
+        return DISK_STATUS_OK;
+
+    uint32_t ints = flash_lock();
+
+    if (erase) {
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+        flash_erases++;
+    }
+
+    for (uint32_t page = 0; page < BLOCK_PAGES; page++) {
+        if (pages & (1 << page))
+            flash_range_program(offset + page * FLASH_PAGE_SIZE, block_buf + page * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+    }
+
+    flash_unlock(ints);
+
+    return memcmp(block_buf, old, FLASH_SECTOR_SIZE) ? DISK_STATUS_IO_ERROR : DISK_STATUS_OK;
+}
+
+static uint8_t get_block(uint32_t block) {
+    if (block == cached_block)
+        return DISK_STATUS_OK;
+
+    uint8_t status = put_block();
+
+    memcpy(block_buf, flash_data(block), FLASH_SECTOR_SIZE);
+    cached_block = block;
+    return status;
+}
+
+static uint32_t unit_sectors(uint8_t unit) {
+#if PAR_SPI_USB_DISK
+    if (unit == LOCAL_DISK_USB)
+        return usb_disk_sectors();
+#endif
+    return unit == LOCAL_DISK_RAM ? RAM_DISK_SIZE / DISK_SECTOR_SIZE : flash_sectors;
+}
+
+static bool in_range(uint8_t unit, uint32_t lba, uint8_t count) {
+    uint32_t sectors = unit_sectors(unit);
+    return lba <= sectors && count <= sectors - lba;
+}
+
+uint8_t local_disk_info(uint8_t unit, uint32_t *sectors, uint32_t *erases, uint8_t *type) {
+    *sectors = unit_sectors(unit);
+    *erases = unit == LOCAL_DISK_FLASH ? flash_erases : 0;
+    *type = unit == LOCAL_DISK_RAM ? DISK_TYPE_RAM : unit == LOCAL_DISK_FLASH ? DISK_TYPE_FLASH : DISK_TYPE_REMOTE;
+    return DISK_STATUS_OK;
+}
+
+uint8_t local_disk_read(uint8_t unit, uint32_t lba, uint8_t count, uint8_t *buf) {
+    if (!in_range(unit, lba, count))
+        return DISK_STATUS_RANGE;
+
+#if PAR_SPI_USB_DISK
+    if (unit == LOCAL_DISK_USB)
+        return usb_disk_read(lba, count, buf);
+#endif
+
+    if (unit == LOCAL_DISK_RAM) {
+        memcpy(buf, ram_disk + lba * DISK_SECTOR_SIZE, count * DISK_SECTOR_SIZE);
+        return DISK_STATUS_OK;
+    }
+
+    for (uint8_t i = 0; i < count; i++, lba++, buf += DISK_SECTOR_SIZE) {
+        const uint32_t block = lba / BLOCK_SECTORS;
+        const uint32_t offset = (lba % BLOCK_SECTORS) * DISK_SECTOR_SIZE;
+
+        if (block == cached_block)
+            memcpy(buf, block_buf + offset, DISK_SECTOR_SIZE);
+        else
+            memcpy(buf, flash_data(block) + offset, DISK_SECTOR_SIZE);
+    }
+
+    return DISK_STATUS_OK;
+}
+
+uint8_t local_disk_write(uint8_t unit, uint32_t lba, uint8_t count, const uint8_t *buf) {
+    uint8_t status = DISK_STATUS_OK;
+
+    if (!in_range(unit, lba, count))
+        return DISK_STATUS_RANGE;
+
+#if PAR_SPI_USB_DISK
+    if (unit == LOCAL_DISK_USB)
+        return usb_disk_write(lba, count, buf);
+#endif
+
+    if (unit == LOCAL_DISK_RAM) {
+        memcpy(ram_disk + lba * DISK_SECTOR_SIZE, buf, count * DISK_SECTOR_SIZE);
+        return DISK_STATUS_OK;
+    }
+
+    for (uint8_t i = 0; i < count; i++, lba++, buf += DISK_SECTOR_SIZE) {
+        if (get_block(lba / BLOCK_SECTORS) != DISK_STATUS_OK)
+            status = DISK_STATUS_IO_ERROR;
+
+        memcpy(block_buf + (lba % BLOCK_SECTORS) * DISK_SECTOR_SIZE, buf, DISK_SECTOR_SIZE);
+        block_dirty = true;
+    }
+
+    return status;
+}
+
+uint8_t local_disk_flush(uint8_t unit) {
+#if PAR_SPI_USB_DISK
+    if (unit == LOCAL_DISK_USB)
+        return usb_disk_flush();
+#endif
+    return unit == LOCAL_DISK_FLASH ? put_block() : DISK_STATUS_OK;
+}
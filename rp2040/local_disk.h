@@ -0,0 +1,37 @@
+/*
+ * The adapter's own block devices, served with the DISK control command
+ * (see protocol/disk.h): unit 1 is a RAM disk, unit 2 a disk in the part of
+ * the QSPI flash above the firmware, and with PAR_SPI_USB_DISK unit 3 is a
+ * disk image on a USB host (see usb_disk.h). The functions return a
+ * DISK_STATUS_ value and are only called for units 1 to LOCAL_DISK_UNITS.
+ */
+#ifndef LOCAL_DISK_H_
+#define LOCAL_DISK_H_
+
+#include <stdint.h>
+
+#define LOCAL_DISK_RAM      1
+#define LOCAL_DISK_FLASH    2
+#define LOCAL_DISK_USB      3
+
+#if PAR_SPI_USB_DISK
+#define LOCAL_DISK_UNITS    3
+#else
+#define LOCAL_DISK_UNITS    2
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void local_disk_init(void);
+uint8_t local_disk_info(uint8_t unit, uint32_t *sectors, uint32_t *erases, uint8_t *type);
+uint8_t local_disk_read(uint8_t unit, uint32_t lba, uint8_t count, uint8_t *buf);
+uint8_t local_disk_write(uint8_t unit, uint32_t lba, uint8_t count, const uint8_t *buf);
+uint8_t local_disk_flush(uint8_t unit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
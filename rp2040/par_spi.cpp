@@ -0,0 +1,309 @@
+/*
+ * Written in October 2022 by Niklas Ekström.
+ *
+ * Runs on RP2040 microcontroller instead of AVR as before,
+ * but uses the same protocol and Amiga software.
+ *
+ * Updated in October 2026 to use the protocol engine shared with the AVR.
+ */
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+#include "hardware/structs/sio.h"
+#include "hardware/timer.h"
+
+#include "engine.hpp"
+#include "local_disk.h"
+#include "trace.h"
+#include "usb_link.h"
+#include "xts.h"
+
+//      Pin name    GPIO    Direction   Comment     Description
+#define PIN_D(x)    (0+x)   // In/out
+#define PIN_IRQ     8       // Output   Active low
+#define PIN_ACT     9       // Output   Active low
+#define PIN_CLK     10      // Input
+#define PIN_REQ     11      // Input    Active low
+#define PIN_MISO    16      // Input    Pull-up
+#define PIN_SS      17      // Output   Active low  Device 0, the SD card slot
+#define PIN_SCK     18      // Output
+#define PIN_MOSI    19      // Output
+#define PIN_CDET    20      // Input    Pull-up     Card Detect
+#define PIN_SS1     21      // Output   Active low  Device 1
+#define PIN_SS2     22      // Output   Active low  Device 2
+#define PIN_SS3     26      // Output   Active low  Device 3
+#define PIN_DREQ    27      // Input    Pull-down   Data request of a peripheral
+
+#define SS_MASK     ((1 << PIN_SS) | (1 << PIN_SS1) | (1 << PIN_SS2) | (1 << PIN_SS3))
+
+#define SPI_SLOW_FREQUENCY (400*1000)
+#define SPI_FAST_FREQUENCY (16*1000*1000)
+
+// Fast clock of devices 2 and 3, where the command and data chip selects of
+// a VS1053 decoder go. Its data interface takes at most CLKI / 4, 13.8 MHz
+// with the clock multiplier spisd.device sets; this gives 12.5 MHz.
+#define SPI_DECODER_FREQUENCY (13*1000*1000)
+
+// Reported by GET_CAPS, major << 8 | minor.
+#define FIRMWARE_VERSION_RP2040 0x0200
+
+static constexpr uint ss_pins[] = {PIN_SS, PIN_SS1, PIN_SS2, PIN_SS3};
+static constexpr uint fast_frequencies[] = {
+    SPI_FAST_FREQUENCY, SPI_FAST_FREQUENCY, SPI_DECODER_FREQUENCY, SPI_DECODER_FREQUENCY,
+};
+
+// Platform policy for protocol::Engine. All pins are sampled with one read
+// of the SIO input register, the data lines are GPIO 0-7.
+struct Rp2040 : protocol::PlatformDefaults {
+    using pins_t = uint32_t;
+    using count_t = uint32_t;
+
+    static constexpr uint8_t FIRMWARE_ID = CAPS_FIRMWARE_RP2040;
+    static constexpr uint16_t FIRMWARE_VERSION = FIRMWARE_VERSION_RP2040;
+    static constexpr uint16_t SPI_FAST_KHZ = SPI_FAST_FREQUENCY / 1000;
+    static constexpr uint16_t SPI_SLOW_KHZ = SPI_SLOW_FREQUENCY / 1000;
+#if PAR_SPI_TRACE
+    static constexpr uint16_t FEATURES = CAPS_FEATURE_TRACE;
+#endif
+
+    static constexpr uint8_t SEQ_SLOTS = 12;
+    static constexpr uint16_t SEQ_SLOT_SIZE = 256;
+    static constexpr uint16_t SEQ_IO_SIZE = 8192;
+    static constexpr uint16_t BUFFER_SIZE = SEQ_IO_SIZE;
+
+    static constexpr uint8_t DISK_UNITS = LOCAL_DISK_UNITS;
+
+    static constexpr uint8_t DEVICES = sizeof(ss_pins) / sizeof(ss_pins[0]);
+
+    // Core 0 polls REQ in a loop run from RAM with nothing else to do, and
+    // what is left of the previous request after REQ was released, a byte
+    // or two of SPI at most, is done well within two E-cycles.
+    static constexpr uint16_t REQ_LATENCY_NS = 500;
+
+    // The chip select that select() drives, and the fast clock and the
+    // sector key of its device.
+    static inline uint ss_pin = PIN_SS;
+    static inline uint fast_frequency = SPI_FAST_FREQUENCY;
+    static inline xts_key_t xts_keys[DEVICES];
+    static inline xts_key_t *xts_key = xts_keys;
+
+    static uint8_t disk_info(uint8_t unit, uint32_t &sectors, uint32_t &erases, uint8_t &type) {
+        return local_disk_info(unit, &sectors, &erases, &type);
+    }
+
+    static uint8_t disk_read(uint8_t unit, uint32_t lba, uint8_t count, uint8_t *buf) {
+        return local_disk_read(unit, lba, count, buf);
+    }
+
+    static uint8_t disk_write(uint8_t unit, uint32_t lba, uint8_t count, const uint8_t *buf) {
+        return local_disk_write(unit, lba, count, buf);
+    }
+
+    static uint8_t disk_flush(uint8_t unit) { return local_disk_flush(unit); }
+
+    // There is no interrupt that abandons a request, so every wait for CLK
+    // also checks whether REQ was released.
+    static constexpr bool POLL_REQ = true;
+
+    static PROTOCOL_INLINE pins_t sample() { return gpio_get_all(); }
+    static PROTOCOL_INLINE pins_t clk(pins_t pins) { return pins & (1 << PIN_CLK); }
+    static PROTOCOL_INLINE bool req_released(pins_t pins) { return pins & (1 << PIN_REQ); }
+    static PROTOCOL_INLINE uint8_t data(pins_t pins) { return pins & 0xff; }
+
+    static PROTOCOL_INLINE void act() { gpio_put(PIN_ACT, 0); }
+    static PROTOCOL_INLINE void act_release() { gpio_put(PIN_ACT, 1); }
+
+    static PROTOCOL_INLINE void spi_start(uint8_t value) { spi_get_hw(spi0)->dr = value; }
+    static PROTOCOL_INLINE uint8_t spi_data() { return spi_get_hw(spi0)->dr; }
+
+    static PROTOCOL_INLINE void spi_wait() {
+        while (!spi_is_readable(spi0))
+            tight_loop_contents();
+    }
+
+    static PROTOCOL_INLINE void select(bool sel) { gpio_put(ss_pin, !sel); }
+    static PROTOCOL_INLINE void select_device(uint8_t device) {
+        ss_pin = ss_pins[device];
+        fast_frequency = fast_frequencies[device];
+        xts_key = &xts_keys[device];
+    }
+
+    static PROTOCOL_INLINE void set_speed(bool fast) {
+        spi_set_baudrate(spi0, fast ? fast_frequency : SPI_SLOW_FREQUENCY);
+    }
+
+    // IRQ is asserted for a card detect change until CARD_PRESENT, and
+    // for DREQ going high once after DREQ armed it.
+    static inline bool cdet_pending = false;
+    static inline bool dreq_armed = false;
+
+    static PROTOCOL_INLINE void irq_release() {
+        gpio_set_dir(PIN_IRQ, false);
+        cdet_pending = false;
+    }
+
+    static constexpr bool HAS_DREQ = true;
+
+    static PROTOCOL_INLINE uint8_t dreq(bool arm) {
+        uint8_t status = gpio_get(PIN_DREQ) ? DREQ_STATUS_HIGH : 0;
+
+        if (cdet_pending)
+            status |= DREQ_STATUS_CARD_CHANGE;
+        else
+            gpio_set_dir(PIN_IRQ, false);
+
+        // Already high, the Amiga gets on with it without an IRQ.
+        dreq_armed = arm && !(status & DREQ_STATUS_HIGH);
+        return status;
+    }
+
+    static constexpr bool HAS_XTS = true;
+
+    static void xts_set_key(const uint8_t *key) {
+        if (key)
+            ::xts_set_key(xts_key, key);
+        else
+            xts_clear_key(xts_key);
+    }
+
+    static bool xts_encrypt(uint8_t *sector, uint32_t lba) {
+        if (!xts_key->set)
+            return false;
+        ::xts_encrypt(xts_key, sector, lba);
+        return true;
+    }
+
+    static bool xts_decrypt(uint8_t *sector, uint32_t lba) {
+        if (!xts_key->set)
+            return false;
+        ::xts_decrypt(xts_key, sector, lba);
+        return true;
+    }
+
+    static constexpr bool HAS_SCAN = true;
+
+    static PROTOCOL_INLINE bool card_present() { return !gpio_get(PIN_CDET); }
+    static PROTOCOL_INLINE void delay_us(uint16_t us) { busy_wait_us_32(us); }
+
+    // Drives the data lines with a single write of all outputs. The others
+    // are kept at the levels they are driven at when the data lines are
+    // turned around, which is after an XFER has asserted the chip select,
+    // so they are taken from the output register rather than from pins.
+    struct Output {
+        uint32_t base;
+
+        PROTOCOL_INLINE Output(pins_t, uint8_t) : base(sio_hw->gpio_out & ~0xffu) {}
+
+        PROTOCOL_INLINE uint32_t prepare(uint8_t value) const { return base | value; }
+
+        static PROTOCOL_INLINE void drive(uint32_t value) {
+            gpio_put_all(value);
+            gpio_set_dir_out_masked(0xff);
+        }
+    };
+
+#if PAR_SPI_TRACE
+    using cycles_t = uint32_t;
+    static PROTOCOL_INLINE void trace_act() { TRACE_ACT(); }
+    static PROTOCOL_INLINE void trace_second_byte(uint8_t b) { TRACE_SECOND_BYTE(b); }
+    static PROTOCOL_INLINE void trace_count(uint32_t n) { TRACE_COUNT(n); }
+    static PROTOCOL_INLINE void trace_byte_done() { TRACE_BYTE_DONE(); }
+    static PROTOCOL_INLINE void trace_aborted() { TRACE_ABORTED(); }
+    static PROTOCOL_INLINE cycles_t trace_wait_start() { return trace_cycles(); }
+    static PROTOCOL_INLINE void trace_clk_wait_end(cycles_t t) { TRACE_CLK_WAIT_END(t); }
+    static PROTOCOL_INLINE void trace_spi_wait_end(cycles_t t) { TRACE_SPI_WAIT_END(t); }
+#endif
+};
+
+static uint32_t prev_cdet;
+
+static void __not_in_flash_func(handle_request)() {
+    uint32_t pins;
+
+    while (1) {
+        pins = gpio_get_all();
+        if (!(pins & (1 << PIN_REQ)))
+            break;
+
+        if ((pins & (1 << PIN_CDET)) != prev_cdet) {
+            gpio_put(PIN_IRQ, false);
+            gpio_set_dir(PIN_IRQ, true);
+            Rp2040::cdet_pending = true;
+            prev_cdet = pins & (1 << PIN_CDET);
+            TRACE_CDET(prev_cdet);
+        }
+
+        if (Rp2040::dreq_armed && (pins & (1 << PIN_DREQ))) {
+            gpio_put(PIN_IRQ, false);
+            gpio_set_dir(PIN_IRQ, true);
+            Rp2040::dreq_armed = false;
+        }
+    }
+
+    TRACE_BEGIN_REQUEST(pins);
+
+    protocol::Engine<Rp2040>::handle_request(pins);
+
+    while (1) {
+        pins = gpio_get_all();
+        if (pins & (1 << PIN_REQ))
+            break;
+    }
+
+    // Also run from RAM, a flash write by a disk unit flushes the XIP cache
+    // and the next REQ must not wait for it to be refilled.
+    TRACE_END_REQUEST();
+
+    gpio_set_dir_in_masked(0xff);
+    gpio_clr_mask(0xff);
+
+    gpio_put(PIN_ACT, 1);
+
+    while (spi_is_busy(spi0))
+        tight_loop_contents();
+
+    if (spi_is_readable(spi0))
+        (void)spi_get_hw(spi0)->dr;
+}
+
+int main() {
+    spi_init(spi0, SPI_SLOW_FREQUENCY);
+
+    gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
+    gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
+    gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
+    gpio_pull_up(PIN_MISO);
+
+    for (uint pin : ss_pins) {
+        gpio_init(pin);
+        gpio_put(pin, 1);
+        gpio_set_dir(pin, GPIO_OUT);
+    }
+
+    gpio_init(PIN_CDET);
+    gpio_pull_up(PIN_CDET);
+
+    gpio_init(PIN_DREQ);
+    gpio_pull_down(PIN_DREQ);
+
+    for (int i = 0; i < 12; i++)
+        gpio_init(i);
+
+    gpio_put(PIN_ACT, 1);
+    gpio_set_dir(PIN_ACT, GPIO_OUT);
+
+    prev_cdet = gpio_get_all() & (1 << PIN_CDET);
+
+    local_disk_init();
+    xts_init();
+
+#if PAR_SPI_TRACE
+    trace_init();
+#endif
+
+#if PAR_SPI_TRACE || PAR_SPI_USB_DISK
+    usb_link_start();
+#endif
+
+    while (1)
+        handle_request();
+}
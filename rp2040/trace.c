@@ -0,0 +1,79 @@
+/*
+ * Event trace ring, see trace.h.
+ *
+ * Core 0 is the only writer of head and core 1 the only writer of tail,
+ * so the ring needs no locking.
+ */
+#include "pico/stdlib.h"
+#include "hardware/regs/m0plus.h"
+#include "hardware/sync.h"
+
+#include "trace.h"
+
+trace_current_t trace_current;
+
+static trace_event_t ring[TRACE_RING_SIZE];
+static volatile uint32_t head;
+static volatile uint32_t tail;
+static volatile uint32_t dropped;
+static uint32_t dropped_reported;
+
+void trace_init(void) {
+    systick_hw->rvr = 0xffffff;
+    systick_hw->cvr = 0;
+    systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
+
+static void __not_in_flash_func(trace_push)(const trace_event_t *event) {
+    uint32_t h = head;
+
+    if (h - tail >= TRACE_RING_SIZE) {
+        dropped++;
+        return;
+    }
+
+    ring[h & (TRACE_RING_SIZE - 1)] = *event;
+    __dmb();
+    head = h + 1;
+}
+
+void __not_in_flash_func(trace_end_request)(void) {
+    trace_current.event.duration_us = time_us_32() - trace_current.event.time_us;
+    trace_push(&trace_current.event);
+}
+
+void __not_in_flash_func(trace_cdet)(uint32_t level) {
+    trace_event_t event = {0};
+
+    event.time_us = time_us_32();
+    event.type = TRACE_EVENT_CDET;
+    event.cmd[0] = !!level;
+    trace_push(&event);
+}
+
+uint32_t trace_read(trace_event_t *events, uint32_t max, uint32_t *dropped_out) {
+    uint32_t t = tail;
+    uint32_t n = head - t;
+
+    __dmb();
+
+    if (n > max)
+        n = max;
+
+    for (uint32_t i = 0; i < n; i++)
+        events[i] = ring[(t + i) & (TRACE_RING_SIZE - 1)];
+
+    __dmb();
+    tail = t + n;
+
+    uint32_t d = dropped;
+    *dropped_out = d - dropped_reported;
+    dropped_reported = d;
+
+    return n;
+}
+
+void trace_clear(void) {
+    tail = head;
+    dropped_reported = dropped;
+}
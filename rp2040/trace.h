@@ -0,0 +1,97 @@
+/*
+ * Event trace of the requests handled by the adapter.
+ *
+ * Built when PAR_SPI_TRACE is set (cmake -DPAR_SPI_TRACE=ON). Otherwise all
+ * the TRACE_ macros expand to nothing and the request loop is unchanged.
+ *
+ * Core 0 records one event per request into a RAM ring, core 1 sends the
+ * ring to a host over USB CDC (see usb_link.c and host/trace_decode.c).
+ * Wait times are counted in system clock cycles using SysTick.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#include "link_protocol.h"
+
+#if PAR_SPI_TRACE
+
+#include "hardware/structs/systick.h"
+#include "hardware/timer.h"
+
+#define TRACE_RING_SIZE 2048 // Events, must be a power of two
+
+typedef struct {
+    trace_event_t event;
+    uint32_t start_cycles;
+} trace_current_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern trace_current_t trace_current;
+
+void trace_init(void);
+void trace_end_request(void);
+void trace_cdet(uint32_t level);
+
+// Called from core 1. Copies up to max events not yet read into events.
+uint32_t trace_read(trace_event_t *events, uint32_t max, uint32_t *dropped);
+void trace_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint32_t trace_cycles(void) {
+    return systick_hw->cvr;
+}
+
+// SysTick counts down and is 24 bits wide.
+static inline uint32_t trace_elapsed(uint32_t since) {
+    return (since - systick_hw->cvr) & 0xffffff;
+}
+
+#define TRACE_BEGIN_REQUEST(cmd_byte) do { \
+        trace_current.start_cycles = trace_cycles(); \
+        trace_current.event.time_us = time_us_32(); \
+        trace_current.event.type = TRACE_EVENT_REQUEST; \
+        trace_current.event.cmd[0] = (cmd_byte); \
+        trace_current.event.cmd[1] = 0; \
+        trace_current.event.flags = 0; \
+        trace_current.event.count = 0; \
+        trace_current.event.done = 0; \
+        trace_current.event.decode = 0; \
+        trace_current.event.clk_wait = 0; \
+        trace_current.event.spi_busy = 0; \
+    } while (0)
+#define TRACE_ACT()             (trace_current.event.decode = trace_elapsed(trace_current.start_cycles))
+#define TRACE_SECOND_BYTE(b)    (trace_current.event.cmd[1] = (b))
+#define TRACE_COUNT(n)          (trace_current.event.count = (n))
+#define TRACE_BYTE_DONE()       (trace_current.event.done++)
+#define TRACE_ABORTED()         (trace_current.event.flags |= TRACE_F_ABORTED)
+#define TRACE_WAIT_START(t)     uint32_t t = trace_cycles()
+#define TRACE_CLK_WAIT_END(t)   (trace_current.event.clk_wait += trace_elapsed(t))
+#define TRACE_SPI_WAIT_END(t)   (trace_current.event.spi_busy += trace_elapsed(t))
+#define TRACE_END_REQUEST()     trace_end_request()
+#define TRACE_CDET(level)       trace_cdet(level)
+
+#else
+
+#define TRACE_BEGIN_REQUEST(cmd_byte)
+#define TRACE_ACT()
+#define TRACE_SECOND_BYTE(b)
+#define TRACE_COUNT(n)
+#define TRACE_BYTE_DONE()
+#define TRACE_ABORTED()
+#define TRACE_WAIT_START(t)
+#define TRACE_CLK_WAIT_END(t)
+#define TRACE_SPI_WAIT_END(t)
+#define TRACE_END_REQUEST()
+#define TRACE_CDET(level)
+
+#endif
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * TinyUSB configuration for the USB CDC link, see usb_link.c.
+ */
+#ifndef TUSB_CONFIG_H_
+#define TUSB_CONFIG_H_
+
+#ifndef CFG_TUSB_RHPORT0_MODE
+#define CFG_TUSB_RHPORT0_MODE       OPT_MODE_DEVICE
+#endif
+
+#ifndef CFG_TUSB_OS
+#define CFG_TUSB_OS                 OPT_OS_PICO
+#endif
+
+#define CFG_TUD_ENDPOINT0_SIZE      64
+
+#define CFG_TUD_CDC                 1
+#define CFG_TUD_MSC                 0
+#define CFG_TUD_HID                 0
+#define CFG_TUD_MIDI                0
+#define CFG_TUD_VENDOR              0
+
+#define CFG_TUD_CDC_RX_BUFSIZE      1024
+#define CFG_TUD_CDC_TX_BUFSIZE      1024
+
+#endif
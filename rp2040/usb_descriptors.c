@@ -0,0 +1,101 @@
+/*
+ * USB descriptors for the USB CDC link, see usb_link.c.
+ */
+#include <string.h>
+
+#include "pico/unique_id.h"
+#include "tusb.h"
+
+#define USB_VID     0x2e8a  // Raspberry Pi
+#define USB_PID     0x000a  // Raspberry Pi Pico SDK CDC
+
+enum {
+    ITF_NUM_CDC = 0,
+    ITF_NUM_CDC_DATA,
+    ITF_NUM_TOTAL
+};
+
+#define EPNUM_CDC_NOTIF     0x81
+#define EPNUM_CDC_OUT       0x02
+#define EPNUM_CDC_IN        0x82
+
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN)
+
+enum {
+    STRID_LANGID = 0,
+    STRID_MANUFACTURER,
+    STRID_PRODUCT,
+    STRID_SERIAL,
+    STRID_CDC,
+};
+
+static const tusb_desc_device_t desc_device = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = TUSB_CLASS_MISC,
+    .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor = USB_VID,
+    .idProduct = USB_PID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = STRID_MANUFACTURER,
+    .iProduct = STRID_PRODUCT,
+    .iSerialNumber = STRID_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+static const uint8_t desc_configuration[] = {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 100),
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRID_CDC, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+};
+
+static const char *const strings[] = {
+    [STRID_MANUFACTURER] = "Amiga par-to-spi",
+    [STRID_PRODUCT] = "Parallel port to SPI adapter",
+    [STRID_CDC] = "Adapter link",
+};
+
+static uint16_t desc_str[32];
+
+const uint8_t *tud_descriptor_device_cb(void) {
+    return (const uint8_t *)&desc_device;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index) {
+    (void)index;
+    return desc_configuration;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+    char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+    const char *str;
+    uint32_t count;
+
+    (void)langid;
+
+    if (index == STRID_LANGID) {
+        desc_str[1] = 0x0409;
+        count = 1;
+    } else {
+        if (index == STRID_SERIAL) {
+            pico_get_unique_board_id_string(serial, sizeof(serial));
+            str = serial;
+        } else if (index < sizeof(strings) / sizeof(strings[0]) && strings[index]) {
+            str = strings[index];
+        } else {
+            return NULL;
+        }
+
+        count = strlen(str);
+        if (count > 31)
+            count = 31;
+
+        for (uint32_t i = 0; i < count; i++)
+            desc_str[1 + i] = str[i];
+    }
+
+    desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * count + 2);
+    return desc_str;
+}
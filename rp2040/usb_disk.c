@@ -0,0 +1,353 @@
+/*
+ * Adapter disk unit served by a daemon on a USB host, see usb_disk.h.
+ *
+ * A USB round trip takes about a millisecond, longer than the Amiga takes
+ * for a few sectors, so the Amiga is kept away from it. Core 0 only copies
+ * sectors to and from the buffers below, core 1 moves them over the link:
+ *
+ * - Reads are served from a read-ahead window that core 1 keeps filled up
+ *   to PREFETCH_SECTORS past the last read, so that a sequential read
+ *   finds its sectors already there. A read elsewhere starts the window
+ *   over.
+ * - Writes are queued and acknowledged to the Amiga at once. Core 1 sends
+ *   them before any read, and a flush waits until the host has confirmed
+ *   them all.
+ *
+ * Everything shared by the cores is only touched under the lock.
+ */
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+
+#include "disk.h"
+#include "usb_disk.h"
+#include "usb_link.h"
+
+#define WINDOW_SECTORS      32
+#define PREFETCH_SECTORS    16
+#define QUEUE_SECTORS       16
+
+// How long core 0 waits for core 1 before failing a request, which is less
+// than the Amiga waits for the status, how long core 1 waits for a reply,
+// and how often it asks an idle host for the size of its image.
+#define WAIT_TIMEOUT_US     1000000
+#define REPLY_TIMEOUT_US    500000
+#define INFO_INTERVAL_US    500000
+
+#if PAR_SPI_USB_DISK_LOOPBACK
+#define STAND_IN_SECTORS    64
+
+static uint8_t stand_in_image[STAND_IN_SECTORS][DISK_SECTOR_SIZE];
+#endif
+
+static critical_section_t lock;
+
+// Size of the host's image, 0 while there is none.
+static uint32_t sectors;
+
+// The read-ahead window. Sectors win_lba to win_lba + win_valid are in
+// window[], each at its lba modulo WINDOW_SECTORS, and core 1 fetches more
+// until there are win_want. Replies for an older win_gen are dropped.
+static uint8_t window[WINDOW_SECTORS][DISK_SECTOR_SIZE];
+static uint32_t win_lba;
+static uint32_t win_valid;
+static uint32_t win_want;
+static uint16_t win_gen;
+static bool win_failed;
+
+// Queued writes, added at queue_head by core 0 and removed at queue_tail
+// by core 1 when the host has written them.
+static uint8_t queue[QUEUE_SECTORS][DISK_SECTOR_SIZE];
+static uint32_t queue_lba[QUEUE_SECTORS];
+static uint32_t queue_head;
+static uint32_t queue_tail;
+static bool write_failed;
+
+// The request core 1 waits for a reply to.
+static bool in_flight;
+static link_disk_request_t flight;
+static uint32_t sent_us;
+static uint32_t info_us;
+
+void usb_disk_init(void) {
+    critical_section_init(&lock);
+}
+
+static bool connected(void) {
+#if PAR_SPI_USB_DISK_LOOPBACK
+    return true;
+#else
+    return usb_link_connected();
+#endif
+}
+
+uint32_t usb_disk_sectors(void) {
+    critical_section_enter_blocking(&lock);
+    uint32_t n = sectors;
+    critical_section_exit(&lock);
+    return n;
+}
+
+static bool timed_out(uint32_t start) {
+    return time_us_32() - start > WAIT_TIMEOUT_US;
+}
+
+uint8_t usb_disk_read(uint32_t lba, uint8_t count, uint8_t *buf) {
+    const uint32_t start = time_us_32();
+
+    if (count > WINDOW_SECTORS - PREFETCH_SECTORS)
+        return DISK_STATUS_BAD_REQUEST;
+
+    while (1) {
+        critical_section_enter_blocking(&lock);
+
+        if (lba < win_lba || lba > win_lba + win_valid) {
+            win_lba = lba;
+            win_valid = 0;
+            win_gen++;
+            win_failed = false;
+        } else {
+            win_valid -= lba - win_lba;
+            win_lba = lba;
+        }
+
+        // Not past the end of the image, which may also have gone away.
+        win_want = count + PREFETCH_SECTORS;
+        if (lba + win_want > sectors)
+            win_want = sectors > lba ? sectors - lba : 0;
+
+        if (win_failed) {
+            win_valid = 0;
+            win_gen++;
+            win_failed = false;
+            critical_section_exit(&lock);
+            return DISK_STATUS_IO_ERROR;
+        }
+
+        if (win_valid >= count) {
+            for (uint8_t i = 0; i < count; i++)
+                memcpy(buf + i * DISK_SECTOR_SIZE, window[(lba + i) % WINDOW_SECTORS], DISK_SECTOR_SIZE);
+            critical_section_exit(&lock);
+            return DISK_STATUS_OK;
+        }
+
+        critical_section_exit(&lock);
+
+        if (timed_out(start))
+            return DISK_STATUS_IO_ERROR;
+        tight_loop_contents();
+    }
+}
+
+uint8_t usb_disk_write(uint32_t lba, uint8_t count, const uint8_t *buf) {
+    const uint32_t start = time_us_32();
+
+    // The window may hold, or be fetching, what is overwritten.
+    critical_section_enter_blocking(&lock);
+    if (lba < win_lba + WINDOW_SECTORS && lba + count > win_lba) {
+        win_valid = 0;
+        win_want = 0;
+        win_gen++;
+    }
+    critical_section_exit(&lock);
+
+    for (uint8_t i = 0; i < count; i++) {
+        while (1) {
+            critical_section_enter_blocking(&lock);
+            uint32_t queued = queue_head - queue_tail;
+            critical_section_exit(&lock);
+
+            if (queued < QUEUE_SECTORS)
+                break;
+            if (timed_out(start))
+                return DISK_STATUS_IO_ERROR;
+            tight_loop_contents();
+        }
+
+        // The slot at queue_head is not used by core 1 until it is queued.
+        memcpy(queue[queue_head % QUEUE_SECTORS], buf + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+        queue_lba[queue_head % QUEUE_SECTORS] = lba + i;
+
+        critical_section_enter_blocking(&lock);
+        queue_head++;
+        critical_section_exit(&lock);
+    }
+
+    return DISK_STATUS_OK;
+}
+
+uint8_t usb_disk_flush(void) {
+    const uint32_t start = time_us_32();
+
+    while (1) {
+        critical_section_enter_blocking(&lock);
+        bool empty = queue_tail == queue_head;
+        bool failed = write_failed;
+        if (empty)
+            write_failed = false;
+        critical_section_exit(&lock);
+
+        if (empty)
+            return failed ? DISK_STATUS_IO_ERROR : DISK_STATUS_OK;
+        if (timed_out(start))
+            return DISK_STATUS_IO_ERROR;
+        tight_loop_contents();
+    }
+}
+
+#if PAR_SPI_USB_DISK_LOOPBACK
+// Answers a request the way host/usbdisk would, from a RAM image.
+static void stand_in(const link_disk_request_t *req, const uint8_t *data) {
+    link_disk_reply_t reply = {
+        .op = req->op,
+        .count = req->count,
+        .tag = req->tag,
+        .lba = req->lba,
+    };
+    const uint8_t *read_data = NULL;
+
+    if (req->op == LINK_DISK_INFO) {
+        reply.lba = STAND_IN_SECTORS;
+    } else if (req->lba >= STAND_IN_SECTORS || req->count > STAND_IN_SECTORS - req->lba) {
+        reply.status = 1;
+    } else if (req->op == LINK_DISK_WRITE) {
+        memcpy(stand_in_image[req->lba], data, req->count * DISK_SECTOR_SIZE);
+    } else {
+        read_data = stand_in_image[req->lba];
+    }
+
+    usb_disk_reply(&reply, read_data, read_data ? req->count * DISK_SECTOR_SIZE : 0);
+}
+#endif
+
+static void send(uint8_t op, uint8_t count, uint16_t tag, uint32_t lba, const uint8_t *data) {
+    flight.op = op;
+    flight.count = count;
+    flight.tag = tag;
+    flight.lba = lba;
+    in_flight = true;
+    sent_us = time_us_32();
+
+#if PAR_SPI_USB_DISK_LOOPBACK
+    stand_in(&flight, data);
+#else
+    usb_link_send(LINK_DISK_REQUEST, &flight, sizeof(flight), data, data ? count * DISK_SECTOR_SIZE : 0);
+#endif
+}
+
+// Fails what an unanswered request was for, when the host is gone or
+// didn't reply in time.
+static void give_up(void) {
+    in_flight = false;
+
+    critical_section_enter_blocking(&lock);
+    if (flight.op == LINK_DISK_WRITE) {
+        queue_tail += flight.count;
+        write_failed = true;
+    } else if (flight.op == LINK_DISK_READ && flight.tag == win_gen) {
+        win_failed = true;
+    }
+    critical_section_exit(&lock);
+}
+
+void usb_disk_poll(void) {
+    const uint32_t now = time_us_32();
+
+    if (!connected()) {
+        if (in_flight)
+            give_up();
+
+        critical_section_enter_blocking(&lock);
+        sectors = 0;
+        if (queue_tail != queue_head) {
+            queue_tail = queue_head;
+            write_failed = true;
+        }
+        critical_section_exit(&lock);
+        return;
+    }
+
+    if (in_flight) {
+        if (now - sent_us < REPLY_TIMEOUT_US)
+            return;
+        give_up();
+    }
+
+    uint8_t op = 0xff;
+    uint8_t count = 0;
+    uint16_t tag = 0;
+    uint32_t lba = 0;
+    const uint8_t *data = NULL;
+
+    critical_section_enter_blocking(&lock);
+
+    if (!sectors) {
+        if (now - info_us >= INFO_INTERVAL_US) {
+            info_us = now;
+            op = LINK_DISK_INFO;
+        }
+    } else if (queue_tail != queue_head) {
+        // As many queued sectors as follow each other on the disk and in
+        // the queue.
+        const uint32_t slot = queue_tail % QUEUE_SECTORS;
+
+        op = LINK_DISK_WRITE;
+        lba = queue_lba[slot];
+        data = queue[slot];
+        count = 1;
+        while (count < LINK_DISK_MAX_SECTORS && queue_tail + count != queue_head &&
+                slot + count < QUEUE_SECTORS && queue_lba[slot + count] == lba + count)
+            count++;
+    } else if (win_valid < win_want && !win_failed) {
+        op = LINK_DISK_READ;
+        lba = win_lba + win_valid;
+        tag = win_gen;
+        count = win_want - win_valid < LINK_DISK_MAX_SECTORS ? win_want - win_valid : LINK_DISK_MAX_SECTORS;
+    }
+
+    critical_section_exit(&lock);
+
+    if (op != 0xff)
+        send(op, count, tag, lba, data);
+}
+
+void usb_disk_reply(const link_disk_reply_t *reply, const uint8_t *data, uint32_t data_len) {
+    if (!in_flight || reply->op != flight.op || reply->tag != flight.tag)
+        return;
+
+    if (reply->op != LINK_DISK_INFO && (reply->lba != flight.lba || reply->count != flight.count))
+        return;
+
+    in_flight = false;
+
+    critical_section_enter_blocking(&lock);
+
+    switch (reply->op) {
+        case LINK_DISK_INFO:
+            sectors = reply->status ? 0 : reply->lba;
+            break;
+
+        case LINK_DISK_WRITE:
+            queue_tail += reply->count;
+            if (reply->status)
+                write_failed = true;
+            break;
+
+        case LINK_DISK_READ:
+            if (reply->tag != win_gen || reply->lba != win_lba + win_valid)
+                break;
+
+            if (reply->status || data_len != reply->count * DISK_SECTOR_SIZE) {
+                win_failed = true;
+                break;
+            }
+
+            for (uint8_t i = 0; i < reply->count; i++)
+                memcpy(window[(reply->lba + i) % WINDOW_SECTORS], data + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+            win_valid += reply->count;
+            break;
+    }
+
+    critical_section_exit(&lock);
+}
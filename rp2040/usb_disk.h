@@ -0,0 +1,35 @@
+/*
+ * Adapter disk unit served by a daemon on a USB host (host/usbdisk.c).
+ * The usb_disk_read/write/flush functions are called on core 0 for the
+ * DISK command, the others on core 1 by the USB link. They return a
+ * DISK_STATUS_ value.
+ *
+ * Built with PAR_SPI_USB_DISK. With PAR_SPI_USB_DISK_LOOPBACK the daemon
+ * is replaced by a stand-in on the adapter that serves a small RAM image,
+ * so that the unit can be tested without a host.
+ */
+#ifndef USB_DISK_H_
+#define USB_DISK_H_
+
+#include <stdint.h>
+
+#include "link_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void usb_disk_init(void);
+uint32_t usb_disk_sectors(void);
+uint8_t usb_disk_read(uint32_t lba, uint8_t count, uint8_t *buf);
+uint8_t usb_disk_write(uint32_t lba, uint8_t count, const uint8_t *buf);
+uint8_t usb_disk_flush(void);
+
+void usb_disk_poll(void);
+void usb_disk_reply(const link_disk_reply_t *reply, const uint8_t *data, uint32_t data_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
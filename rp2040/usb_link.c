@@ -0,0 +1,156 @@
+/*
+ * USB CDC link to a host, see usb_link.h.
+ */
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/clocks.h"
+#include "tusb.h"
+
+#include "link_protocol.h"
+#include "trace.h"
+#include "usb_disk.h"
+#include "usb_link.h"
+
+// Large enough for the sectors of a disk reply when the USB disk is built.
+#if PAR_SPI_USB_DISK
+#define MAX_RX_PAYLOAD (sizeof(link_disk_reply_t) + LINK_DISK_MAX_SECTORS * LINK_DISK_SECTOR_SIZE)
+#else
+#define MAX_RX_PAYLOAD 64
+#endif
+#define TRACE_EVENTS_PER_FRAME 64
+
+static link_header_t rx_header;
+static uint8_t rx_payload[MAX_RX_PAYLOAD] __attribute__((aligned(4)));
+static uint32_t rx_count;
+
+static void link_write(const void *data, uint32_t size) {
+    const uint8_t *p = data;
+
+    while (size) {
+        uint32_t n = tud_cdc_write(p, size);
+        p += n;
+        size -= n;
+
+        if (size) {
+            tud_cdc_write_flush();
+            tud_task();
+
+            if (!tud_cdc_connected())
+                return;
+        }
+    }
+}
+
+static void send_header(uint8_t type, uint32_t length) {
+    link_header_t header = {
+        .sync = LINK_SYNC,
+        .type = type,
+        .length = length,
+    };
+    link_write(&header, sizeof(header));
+}
+
+int usb_link_connected(void) {
+    return tud_cdc_connected();
+}
+
+void usb_link_send(uint8_t type, const void *header, uint32_t header_size, const void *data, uint32_t data_size) {
+    send_header(type, header_size + data_size);
+    link_write(header, header_size);
+    link_write(data, data_size);
+    tud_cdc_write_flush();
+}
+
+#if PAR_SPI_TRACE
+static void send_trace(void) {
+    static trace_event_t events[TRACE_EVENTS_PER_FRAME];
+    trace_data_header_t th;
+
+    // Stop after one ring worth of events so that a busy adapter can't keep
+    // us sending forever.
+    uint32_t frames = TRACE_RING_SIZE / TRACE_EVENTS_PER_FRAME;
+
+    do {
+        uint32_t dropped;
+        uint32_t n = trace_read(events, TRACE_EVENTS_PER_FRAME, &dropped);
+
+        th.sys_clk_hz = clock_get_hz(clk_sys);
+        th.dropped = dropped;
+        th.count = n;
+        th.flags = (n < TRACE_EVENTS_PER_FRAME || --frames == 0) ? TRACE_DATA_LAST : 0;
+
+        send_header(LINK_TRACE_DATA, sizeof(th) + n * sizeof(trace_event_t));
+        link_write(&th, sizeof(th));
+        link_write(events, n * sizeof(trace_event_t));
+    } while (!(th.flags & TRACE_DATA_LAST));
+
+    tud_cdc_write_flush();
+}
+#endif
+
+static void handle_frame(void) {
+    switch (rx_header.type) {
+#if PAR_SPI_TRACE
+        case LINK_TRACE_READ:
+            send_trace();
+            break;
+        case LINK_TRACE_CLEAR:
+            trace_clear();
+            break;
+#endif
+#if PAR_SPI_USB_DISK
+        case LINK_DISK_REPLY:
+            if (rx_header.length >= sizeof(link_disk_reply_t))
+                usb_disk_reply((const link_disk_reply_t *)rx_payload, rx_payload + sizeof(link_disk_reply_t),
+                        rx_header.length - sizeof(link_disk_reply_t));
+            break;
+#endif
+    }
+}
+
+static void poll_rx(void) {
+    while (tud_cdc_available()) {
+        if (rx_count < sizeof(link_header_t)) {
+            uint8_t *h = (uint8_t *)&rx_header;
+            h[rx_count] = tud_cdc_read_char();
+
+            // Resynchronize on the sync byte.
+            if (rx_count == 0 && h[0] != LINK_SYNC)
+                continue;
+
+            rx_count++;
+        } else {
+            uint32_t offset = rx_count - sizeof(link_header_t);
+            uint8_t c = tud_cdc_read_char();
+
+            if (offset < MAX_RX_PAYLOAD)
+                rx_payload[offset] = c;
+            rx_count++;
+        }
+
+        if (rx_count == sizeof(link_header_t) + rx_header.length) {
+            if (rx_header.length <= MAX_RX_PAYLOAD)
+                handle_frame();
+            rx_count = 0;
+        }
+    }
+}
+
+static void usb_link_main(void) {
+    // Lets core 0 park this core while it writes the flash disk.
+    multicore_lockout_victim_init();
+
+    tusb_init();
+
+    while (1) {
+        tud_task();
+        poll_rx();
+#if PAR_SPI_USB_DISK
+        usb_disk_poll();
+#endif
+    }
+}
+
+void usb_link_start(void) {
+    multicore_launch_core1(usb_link_main);
+}
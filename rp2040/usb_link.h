@@ -0,0 +1,25 @@
+/*
+ * USB CDC link to a host, run on core 1 so that USB interrupts never
+ * disturb the request loop on core 0. The frame format is defined in
+ * link_protocol.h.
+ */
+#ifndef USB_LINK_H_
+#define USB_LINK_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void usb_link_start(void);
+
+// Called on core 1 only.
+int usb_link_connected(void);
+void usb_link_send(uint8_t type, const void *header, uint32_t header_size, const void *data, uint32_t data_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * AES-128 in XTS mode over 512 byte sectors, for the CRYPT command and the
+ * sequencer's XTS instructions (see protocol/crypt.h).
+ */
+#ifndef XTS_H_
+#define XTS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define XTS_ROUNDS          10
+
+// The round keys of both AES keys, with the data key's in both directions.
+typedef struct {
+    uint32_t enc[4 * (XTS_ROUNDS + 1)];
+    uint32_t dec[4 * (XTS_ROUNDS + 1)];
+    uint32_t tweak[4 * (XTS_ROUNDS + 1)];
+    bool set;
+} xts_key_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void xts_init(void);
+void xts_set_key(xts_key_t *k, const uint8_t *key);
+void xts_clear_key(xts_key_t *k);
+void xts_encrypt(const xts_key_t *k, uint8_t *sector, uint32_t lba);
+void xts_decrypt(const xts_key_t *k, uint8_t *sector, uint32_t lba);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,8 +1,10 @@
 /*
  * Written in the end of April 2020 by Niklas Ekström.
  * Updated in July 2021 by Niklas Ekström to handle Card Present signal.
+ * Updated in October 2026 to negotiate transfer paths with GET_CAPS.
  */
 #include <exec/types.h>
+#include <exec/execbase.h>
 #include <exec/interrupts.h>
 #include <exec/libraries.h>
 #include <hardware/cia.h>
@@ -23,8 +25,105 @@
 #define CLK_MASK	(1 << CLK_BIT)
 #define ACT_MASK	(1 << ACT_BIT)
 
-extern void spi_read_fast(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
-extern void spi_write_fast(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+// The kernels clock a byte every two E-cycles, about 2.8 us. An adapter
+// whose fast SPI clock can't shift a byte in that time gets paced
+// transfers instead.
+#define KERNEL_MIN_KHZ	4000
+
+// Sequencer control commands.
+#define SEQ_LOAD_CMD	0xc8
+#define SEQ_RUN_CMD		0xca
+
+#define EXCHANGE_CMD	0xcc
+
+// Loopback mode control commands, the argument bit of LOOPBACK_CMD enters.
+#define LOOPBACK_CMD	0xce
+#define STATUS_CMD		0xd0
+
+#define DISK_CMD		0xd2
+
+#define DEVICE_CMD		0xd4
+
+// Transfer with chip select control, the argument bit of XFER_CMD reads.
+// The header byte is SDLccccc, with L a second byte holds the low 8 bits
+// of size - 1.
+#define XFER_CMD		0xd6
+#define XFER_SELECT		0x80
+#define XFER_DESELECT	0x40
+#define XFER_LONG		0x20
+
+// The argument bit arms an IRQ for DREQ going high.
+#define DREQ_CMD		0xd8
+
+#define CRYPT_CMD		0xda
+
+// Most devices spi-lib keeps a speed for.
+#define MAX_DEVICES		8
+
+// Most REQ latency an adapter may advertise for writes to skip the wait
+// for ACT. The data port next changes an E-cycle, 1.4 us, after REQ.
+#define BLIND_MAX_LATENCY_NS	1000
+
+// Largest transfer of the kernels.
+#define KERNEL_MAX_SIZE	8191
+
+// Size of the requests longer transfers are split in.
+#define SPLIT_SIZE		4096
+
+// CIA reads to wait for a sequencer program to finish, about 1.5 s.
+#define SEQ_TIMEOUT_POLLS	0x100000
+
+// CIA reads to wait for the adapter to do a DISK operation. Putting back a
+// block of a flash disk takes up to half a second.
+#define DISK_TIMEOUT_POLLS	0x100000
+
+extern void spi_read_fast_000(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_fast_000(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_fast_020(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_fast_020(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_512_000(__reg("a0") UBYTE *buf);
+extern void spi_write_512_000(__reg("a0") const UBYTE *buf);
+extern void spi_read_512_020(__reg("a0") UBYTE *buf);
+extern void spi_write_512_020(__reg("a0") const UBYTE *buf);
+extern void spi_write_6(__reg("a0") const UBYTE *buf);
+extern ULONG spi_write_fast_000_blind(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern ULONG spi_write_fast_020_blind(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern ULONG spi_write_512_000_blind(__reg("a0") const UBYTE *buf);
+extern ULONG spi_write_512_020_blind(__reg("a0") const UBYTE *buf);
+extern ULONG spi_write_6_blind(__reg("a0") const UBYTE *buf);
+extern void spi_read_more_000(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_read_more_020(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_more_000(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+extern void spi_write_more_020(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+
+// Transfer kernels in spi_low.asm for one CPU family. The _blind writes
+// don't wait for ACT after the command, and return the control port as it
+// was at the end.
+struct spi_kernels
+{
+	void (*read)(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+	void (*write)(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+	void (*read_512)(__reg("a0") UBYTE *buf);
+	void (*write_512)(__reg("a0") const UBYTE *buf);
+	void (*read_more)(__reg("a0") UBYTE *buf, __reg("d0") ULONG size);
+	void (*write_more)(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+	ULONG (*write_blind)(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size);
+	ULONG (*write_512_blind)(__reg("a0") const UBYTE *buf);
+};
+
+static const struct spi_kernels kernels_000 =
+{
+	spi_read_fast_000, spi_write_fast_000, spi_read_512_000, spi_write_512_000,
+	spi_read_more_000, spi_write_more_000, spi_write_fast_000_blind, spi_write_512_000_blind
+};
+
+static const struct spi_kernels kernels_020 =
+{
+	spi_read_fast_020, spi_write_fast_020, spi_read_512_020, spi_write_512_020,
+	spi_read_more_020, spi_write_more_020, spi_write_fast_020_blind, spi_write_512_020_blind
+};
+
+static const struct spi_kernels *kernels = &kernels_000;
 
 static volatile UBYTE *cia_a_prb = (volatile UBYTE *)0xbfe101;
 static volatile UBYTE *cia_a_ddrb = (volatile UBYTE *)0xbfe301;
@@ -34,6 +133,28 @@ static volatile UBYTE *cia_b_ddra = (volatile UBYTE *)0xbfd200;
 
 static long current_speed = SPI_SPEED_SLOW;
 
+// The device the adapter talks to, and the speed last set for each. The
+// adapter keeps a speed per device too, and switches with the device.
+static int current_device;
+static long device_speed[MAX_DEVICES];
+
+// What the adapter said it can do, or what a legacy adapter can do.
+static struct spi_caps caps;
+
+// Set when the transfers in the current speed use the kernels, and the CIA
+// reads a paced transfer waits after each byte otherwise. With act_handshake
+// set a paced transfer waits for the adapter to signal each byte on ACT.
+static int use_kernels;
+static int byte_wait;
+static int act_handshake;
+
+// Set when writes use the _blind kernels, which the adapter's REQ latency
+// allows in the current speed and fast_path_enabled permits. A write that
+// ends without ACT asserted counts a miss and clears fast_path_enabled.
+static int use_blind;
+static int fast_path_enabled = 1;
+static ULONG fast_path_misses;
+
 static const char spi_lib_name[] = "spi-lib";
 
 static struct Library *miscbase;
@@ -107,6 +228,241 @@ int spi_get_card_present()
 	return present;
 }
 
+static UWORD caps_word(const UBYTE *raw, int offset)
+{
+	return (raw[offset] << 8) | raw[offset + 1];
+}
+
+// Reads the capability record with GET_CAPS (11000110). An adapter that
+// doesn't know the command never asserts ACT, and is described with the
+// numbers of the AVR firmware that came before GET_CAPS.
+static void read_caps()
+{
+	UBYTE raw[CAPS_SIZE];
+
+	for (int i = 0; i < CAPS_SIZE; i++)
+		raw[i] = 0;
+
+	*cia_a_prb = 0xc6;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (wait_until_active())
+	{
+		*cia_a_ddrb = 0x00;
+
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		int length = *cia_a_prb;
+		if (length > CAPS_SIZE)
+			length = CAPS_SIZE;
+
+		for (int i = 1; i < length; i++)
+		{
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+
+			raw[i] = *cia_a_prb;
+		}
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	if (raw[CAPS_LAYOUT] != CAPS_LAYOUT_VERSION)
+	{
+		caps.firmware_id = CAPS_FIRMWARE_LEGACY;
+		caps.firmware_version = 0;
+		caps.spi_fast_khz = 8000;
+		caps.spi_slow_khz = 250;
+		caps.control_cmds = 0x7;
+		caps.max_transfer = 8192;
+		caps.buffer_size = 0;
+		caps.features = 0;
+		caps.seq_slots = 0;
+		caps.seq_slot_size = 0;
+		caps.devices = 1;
+		caps.req_latency_ns = 0;
+		return;
+	}
+
+	caps.firmware_id = raw[CAPS_FIRMWARE_ID];
+	caps.firmware_version = caps_word(raw, CAPS_FIRMWARE_VERSION);
+	caps.spi_fast_khz = caps_word(raw, CAPS_SPI_FAST_KHZ);
+	caps.spi_slow_khz = caps_word(raw, CAPS_SPI_SLOW_KHZ);
+	caps.control_cmds = ((ULONG)caps_word(raw, CAPS_CONTROL_CMDS) << 16) | caps_word(raw, CAPS_CONTROL_CMDS + 2);
+	caps.max_transfer = caps_word(raw, CAPS_MAX_TRANSFER);
+	caps.buffer_size = caps_word(raw, CAPS_BUFFER_SIZE);
+	caps.features = caps_word(raw, CAPS_FEATURES);
+	caps.seq_slots = raw[CAPS_SEQ_SLOTS];
+	caps.seq_slot_size = caps_word(raw, CAPS_SEQ_SLOT_SIZE);
+	caps.devices = raw[CAPS_DEVICES] ? raw[CAPS_DEVICES] : 1;
+	if (caps.devices > MAX_DEVICES)
+		caps.devices = MAX_DEVICES;
+	caps.req_latency_ns = caps_word(raw, CAPS_REQ_LATENCY);
+}
+
+// Picks how transfers are made in the current speed, from the CPU and the
+// adapter's SPI clocks.
+static void select_paths()
+{
+	if (SysBase->AttnFlags & AFF_68020)
+		kernels = &kernels_020;
+	else
+		kernels = &kernels_000;
+
+	UWORD khz = current_speed == SPI_SPEED_FAST ? caps.spi_fast_khz : caps.spi_slow_khz;
+	if (khz == 0)
+		khz = 250;
+
+	use_kernels = current_speed == SPI_SPEED_FAST && khz >= KERNEL_MIN_KHZ;
+	byte_wait = (8000 + khz - 1) / khz;
+	act_handshake = current_speed != SPI_SPEED_FAST && (caps.features & CAPS_FEATURE_ACT_HANDSHAKE);
+	use_blind = use_kernels && fast_path_enabled && caps.req_latency_ns != 0 &&
+			caps.req_latency_ns <= BLIND_MAX_LATENCY_NS;
+}
+
+const struct spi_caps *spi_get_caps()
+{
+	return &caps;
+}
+
+static int supports(UBYTE cmd)
+{
+	return (caps.control_cmds >> ((cmd >> 1) & 0x1f)) & 1;
+}
+
+// Writes one parameter byte of a control command, clocked by toggling CLK.
+static UBYTE send_byte(UBYTE ctrl, UBYTE value)
+{
+	*cia_a_prb = value;
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+	return ctrl;
+}
+
+int spi_seq_load(int slot, const UBYTE *program, ULONG length)
+{
+	if (!supports(SEQ_LOAD_CMD) || slot >= caps.seq_slots || length > caps.seq_slot_size)
+		return SPI_SEQ_UNSUPPORTED;
+
+	*cia_a_prb = SEQ_LOAD_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return SPI_SEQ_UNSUPPORTED;
+	}
+
+	ctrl = send_byte(ctrl, slot);
+	ctrl = send_byte(ctrl, length >> 8);
+	ctrl = send_byte(ctrl, length);
+
+	for (ULONG i = 0; i < length; i++)
+		ctrl = send_byte(ctrl, program[i]);
+
+	*cia_b_pra = ctrl;                  // Delay to allow write to complete
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	return 0;
+}
+
+int spi_seq_run(int slot, const UBYTE *args, int argc, const UBYTE *in, ULONG in_len,
+		UBYTE *out, ULONG out_size, ULONG *out_len)
+{
+	*out_len = 0;
+
+	if (!supports(SEQ_RUN_CMD) || argc > SEQ_MAX_ARGS || in_len > caps.buffer_size)
+		return SPI_SEQ_UNSUPPORTED;
+
+	*cia_a_prb = SEQ_RUN_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return SPI_SEQ_UNSUPPORTED;
+	}
+
+	ctrl = send_byte(ctrl, slot);
+	ctrl = send_byte(ctrl, argc);
+	for (int i = 0; i < argc; i++)
+		ctrl = send_byte(ctrl, args[i]);
+
+	ctrl = send_byte(ctrl, in_len >> 8);
+	ctrl = send_byte(ctrl, in_len);
+	for (ULONG i = 0; i < in_len; i++)
+		ctrl = send_byte(ctrl, in[i]);
+
+	// Turn the data port around, then wait for ACT to be released, which
+	// says that the status byte is on the port.
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ULONG polls = SEQ_TIMEOUT_POLLS;
+	while (polls && !(*cia_b_pra & ACT_MASK))
+		polls--;
+
+	if (!polls)
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		*cia_a_ddrb = 0xff;
+		return SPI_SEQ_TIMEOUT;
+	}
+
+	int status = *cia_a_prb;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+	ULONG len = *cia_a_prb << 8;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+	len |= *cia_a_prb;
+
+	*out_len = len;
+	if (len > out_size)
+		len = out_size;
+
+	// The kernels release REQ when done.
+	if (len > KERNEL_MAX_SIZE)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+		*out++ = *cia_a_prb;
+		len--;
+	}
+
+	if (len)
+		kernels->read_more(out, len);
+	else
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		*cia_a_ddrb = 0xff;
+	}
+
+	return status;
+}
+
 void spi_set_speed(long speed)
 {
 	*cia_a_prb = speed == SPI_SPEED_FAST ? 0xc5 : 0xc4;
@@ -119,18 +475,106 @@ void spi_set_speed(long speed)
 	*cia_b_pra = prev;
 
 	current_speed = speed;
+	device_speed[current_device] = speed;
+	select_paths();
+}
+
+// Switches to another device with DEVICE (11010100) and its number. The
+// adapter releases the chip select of the current device and takes on the
+// speed of the new one.
+static void send_device(int device)
+{
+	*cia_a_prb = DEVICE_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (wait_until_active())
+		ctrl = send_byte(ctrl, device);
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	current_device = device;
+	current_speed = device_speed[device];
+	select_paths();
 }
 
-// A slow SPI transfer takes 32 us (8 bits times 4us (250kHz)).
-// An E-cycle is 1.4 us.
-static void wait_40_us()
+int spi_select_device(int device)
+{
+	if (device < 0 || device >= caps.devices)
+		return -1;
+
+	if (device != current_device)
+		send_device(device);
+
+	return 0;
+}
+
+// Waits for the adapter to shift one byte in a paced transfer. A CIA read
+// takes an E-cycle, 1.4 us, and byte_wait is one read per microsecond the
+// byte takes, which leaves the adapter time to handle CLK.
+static void wait_byte()
 {
 	UBYTE tmp;
-	for (int i = 0; i < 32; i++)
+	for (int i = 0; i < byte_wait; i++)
 		tmp = *cia_b_pra;
 }
 
-static void spi_write_slow(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
+// Waits for ACT to reach level (ACT_MASK or 0) in a handshaked transfer.
+// Gives up after about 1.4 ms, well past a byte at the slowest SPI clock,
+// so that a missing adapter can't hang the caller.
+static void wait_act(UBYTE level)
+{
+	int count = 1000;
+	while (count > 0 && (*cia_b_pra & ACT_MASK) != level)
+		count--;
+}
+
+// The bytes of a paced write, after the command. Returns the control port.
+static UBYTE write_bytes_paced(UBYTE ctrl, const UBYTE *buf, ULONG size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		*cia_a_prb = *buf++;
+
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		// The adapter toggles ACT when a byte has been shifted, releasing
+		// it after the first one.
+		if (act_handshake)
+			wait_act((i & 1) ? 0 : ACT_MASK);
+		else
+			wait_byte();
+	}
+
+	return ctrl;
+}
+
+// The bytes of a paced read, after the command has turned the data port
+// around. Returns the control port.
+static UBYTE read_bytes_paced(UBYTE ctrl, UBYTE *buf, ULONG size)
+{
+	for (int i = 0; i < size; i++)
+	{
+		// The adapter releases ACT when the next byte is on the data lines.
+		if (act_handshake)
+			wait_act(ACT_MASK);
+		else
+			wait_byte();
+
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		*buf++ = *cia_a_prb;
+	}
+
+	return ctrl;
+}
+
+static void spi_write_paced(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
 {
 	UBYTE ctrl = *cia_b_pra;
 
@@ -158,21 +602,13 @@ static void spi_write_slow(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
 		*cia_b_pra = ctrl;
 	}
 
-	for (int i = 0; i < size; i++)
-	{
-		*cia_a_prb = *buf++;
-
-		ctrl ^= CLK_MASK;
-		*cia_b_pra = ctrl;
-
-		wait_40_us();
-	}
+	ctrl = write_bytes_paced(ctrl, buf, size);
 
 	ctrl |= REQ_MASK;
 	*cia_b_pra = ctrl;
 }
 
-static void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
+static void spi_read_paced(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
 {
 	UBYTE ctrl = *cia_b_pra;
 
@@ -202,14 +638,149 @@ static void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
 
 	*cia_a_ddrb = 0;
 
-	for (int i = 0; i < size; i++)
+	ctrl = read_bytes_paced(ctrl, buf, size);
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+}
+
+// One XFER request: a read (read set) or write of 1 <= size <= 8192 bytes,
+// with the chip select asserted before them and/or released after them as
+// flags say. The kernels take one byte less, so the first byte of 8192 is
+// moved here, as in disk_request().
+static void xfer(UBYTE *buf, ULONG size, int read, UBYTE flags)
+{
+	*cia_a_prb = XFER_CMD | read;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	wait_until_active();
+
+	if (size <= 32)
+		ctrl = send_byte(ctrl, flags | (size - 1));
+	else
+	{
+		ctrl = send_byte(ctrl, flags | XFER_LONG | ((size - 1) >> 8));
+		ctrl = send_byte(ctrl, size - 1);
+	}
+
+	if (read)
+	{
+		*cia_a_ddrb = 0x00;
+
+		// The adapter releases the chip select as soon as the last byte is
+		// on the data lines, before REQ goes.
+		if (use_kernels)
+		{
+			ULONG n = size;
+			if (n > KERNEL_MAX_SIZE)
+			{
+				ctrl ^= CLK_MASK;
+				*cia_b_pra = ctrl;
+				*buf++ = *cia_a_prb;
+				n--;
+			}
+
+			// The kernel releases REQ.
+			kernels->read_more(buf, n);
+			return;
+		}
+
+		ctrl = read_bytes_paced(ctrl, buf, size);
+
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+
+		*cia_a_ddrb = 0xff;
+		return;
+	}
+
+	if (use_kernels)
+	{
+		ULONG n = size;
+		if (n > KERNEL_MAX_SIZE)
+		{
+			send_byte(ctrl, *buf++);
+			n--;
+		}
+
+		kernels->write_more(buf, n);
+	}
+	else
+		write_bytes_paced(ctrl, buf, size);
+
+	// The adapter toggles ACT once more when the last byte has been
+	// shifted out and the chip select released. In fast mode that is the
+	// only change of ACT. Otherwise the read of the control port gives the
+	// adapter time to take the last byte, as in the kernels.
+	if (flags & XFER_DESELECT)
+		wait_act(act_handshake && !((size - 1) & 1) ? 0 : ACT_MASK);
+
+	ctrl = *cia_b_pra;
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+}
+
+// A transfer with XFER, or with separate SELECT requests around it for an
+// adapter that doesn't have XFER.
+static void transfer_cs(UBYTE *buf, ULONG size, int read, UBYTE flags)
+{
+	if (!supports(XFER_CMD))
 	{
-		wait_40_us();
+		if (flags & XFER_SELECT)
+			spi_select();
+		if (read)
+			spi_read(buf, size);
+		else
+			spi_write(buf, size);
+		if (flags & XFER_DESELECT)
+			spi_deselect();
+		return;
+	}
+
+	xfer(buf, size, read, flags);
+}
+
+// One EXCHANGE request of 1 <= size <= caps.buffer_size bytes.
+static void exchange(const UBYTE *tx, UBYTE *rx, ULONG size)
+{
+	*cia_a_prb = EXCHANGE_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	wait_until_active();
+
+	ctrl = send_byte(ctrl, (size - 1) >> 8);
+	ctrl = send_byte(ctrl, size - 1);
+
+	if (use_kernels)
+	{
+		kernels->write_more(tx, size);
+		*cia_a_ddrb = 0x00;
+		kernels->read_more(rx, size);
+		return;
+	}
+
+	for (ULONG i = 0; i < size; i++)
+	{
+		ctrl = send_byte(ctrl, tx[i]);
+		wait_byte();
+	}
+
+	*cia_a_ddrb = 0x00;
 
+	for (ULONG i = 0; i < size; i++)
+	{
 		ctrl ^= CLK_MASK;
 		*cia_b_pra = ctrl;
 
-		*buf++ = *cia_a_prb;
+		rx[i] = *cia_a_prb;
 	}
 
 	ctrl |= REQ_MASK;
@@ -218,20 +789,449 @@ static void spi_read_slow(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
 	*cia_a_ddrb = 0xff;
 }
 
-void spi_read(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
+int spi_exchange(const UBYTE *tx, UBYTE *rx, ULONG size)
+{
+	if (!supports(EXCHANGE_CMD))
+		return -1;
+
+	ULONG max = caps.buffer_size < KERNEL_MAX_SIZE ? caps.buffer_size : KERNEL_MAX_SIZE;
+
+	while (size)
+	{
+		ULONG n = size < max ? size : max;
+
+		exchange(tx, rx, n);
+
+		tx += n;
+		rx += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+int spi_loopback(int enable)
+{
+	if (!supports(LOOPBACK_CMD))
+		return SPI_LOOPBACK_UNSUPPORTED;
+
+	*cia_a_prb = LOOPBACK_CMD | (enable ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	*cia_b_pra = ctrl & ~REQ_MASK;
+
+	wait_until_active();
+
+	*cia_b_pra = ctrl;
+
+	return 0;
+}
+
+// Reads the loopback counters with STATUS (11010000), like GET_CAPS.
+int spi_loopback_status(struct spi_loopback_status *status)
 {
-	if (current_speed == SPI_SPEED_FAST)
-		spi_read_fast(buf, size);
+	UBYTE raw[LOOPBACK_STATUS_SIZE];
+
+	if (!supports(STATUS_CMD))
+		return SPI_LOOPBACK_UNSUPPORTED;
+
+	*cia_a_prb = STATUS_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	wait_until_active();
+
+	*cia_a_ddrb = 0x00;
+
+	for (int i = 0; i < LOOPBACK_STATUS_SIZE; i++)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		raw[i] = *cia_a_prb;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	status->sum = ((ULONG)caps_word(raw, LOOPBACK_STATUS_SUM) << 16) | caps_word(raw, LOOPBACK_STATUS_SUM + 2);
+	status->written = ((ULONG)caps_word(raw, LOOPBACK_STATUS_WRITTEN) << 16) | caps_word(raw, LOOPBACK_STATUS_WRITTEN + 2);
+	status->read = ((ULONG)caps_word(raw, LOOPBACK_STATUS_READ) << 16) | caps_word(raw, LOOPBACK_STATUS_READ + 2);
+	status->stalls = ((ULONG)caps_word(raw, LOOPBACK_STATUS_STALLS) << 16) | caps_word(raw, LOOPBACK_STATUS_STALLS + 2);
+	return 0;
+}
+
+// Writes and reads size bytes rounds times in loopback mode, at the current
+// speed and with the same transfer paths as with a peripheral, and checks
+// what the adapter got and returned. buf is used for the data.
+int spi_self_test(UBYTE *buf, ULONG size, ULONG rounds, struct spi_self_test *result)
+{
+	struct spi_loopback_status status;
+	UWORD sum1 = 0, sum2 = 0;
+	UBYTE x = LOOPBACK_SEED;
+
+	result->bytes = 0;
+	result->errors = 0;
+	result->stalls = 0;
+	result->sum_ok = 0;
+
+	if (size == 0 || size > caps.max_transfer)
+		size = caps.max_transfer;
+
+	if (spi_loopback(1) < 0)
+		return SPI_LOOPBACK_UNSUPPORTED;
+
+	for (ULONG r = 0; r < rounds; r++)
+	{
+		// Every other byte inverted, so that all lines toggle.
+		for (ULONG i = 0; i < size; i++)
+		{
+			x = LOOPBACK_NEXT(x);
+			buf[i] = (i & 1) ? ~x : x;
+			sum1 += buf[i];
+			sum2 += sum1;
+		}
+		spi_write(buf, size);
+
+		spi_read(buf, size);
+		UBYTE expected = LOOPBACK_SEED;
+		for (ULONG i = 0; i < size; i++)
+		{
+			if (buf[i] != expected)
+				result->errors++;
+			expected = LOOPBACK_NEXT(expected);
+		}
+
+		result->bytes += size;
+	}
+
+	spi_loopback_status(&status);
+	spi_loopback(0);
+
+	result->stalls = status.stalls;
+	result->sum_ok = status.sum == (((ULONG)sum2 << 16) | sum1) &&
+			status.written == result->bytes && status.read == result->bytes;
+	return 0;
+}
+
+// One DISK request (11010010) of count sectors, see protocol/disk.h.
+// Writes tx_len bytes from tx after the header, and unless the adapter
+// returns an error reads rx_len bytes into rx. Returns the status.
+static int disk_request(int unit, int op, ULONG lba, int count, const UBYTE *tx, ULONG tx_len,
+		UBYTE *rx, ULONG rx_len)
+{
+	*cia_a_prb = DISK_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	wait_until_active();
+
+	ctrl = send_byte(ctrl, unit);
+	ctrl = send_byte(ctrl, op);
+	ctrl = send_byte(ctrl, lba >> 24);
+	ctrl = send_byte(ctrl, lba >> 16);
+	ctrl = send_byte(ctrl, lba >> 8);
+	ctrl = send_byte(ctrl, lba);
+	ctrl = send_byte(ctrl, count);
+
+	if (use_kernels && tx_len)
+	{
+		if (tx_len > KERNEL_MAX_SIZE)
+		{
+			ctrl = send_byte(ctrl, *tx++);
+			tx_len--;
+		}
+
+		kernels->write_more(tx, tx_len);
+		ctrl = *cia_b_pra;
+	}
 	else
-		spi_read_slow(buf, size);
+	{
+		for (ULONG i = 0; i < tx_len; i++)
+			ctrl = send_byte(ctrl, tx[i]);
+	}
+
+	// Turn the data port around and wait for the status, as in
+	// spi_seq_run().
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	ULONG polls = DISK_TIMEOUT_POLLS;
+	while (polls && !(*cia_b_pra & ACT_MASK))
+		polls--;
+
+	int status = polls ? *cia_a_prb : SPI_DISK_TIMEOUT;
+
+	if (status != DISK_STATUS_OK)
+		rx_len = 0;
+
+	// The kernels release REQ when done.
+	if (use_kernels && rx_len)
+	{
+		if (rx_len > KERNEL_MAX_SIZE)
+		{
+			ctrl ^= CLK_MASK;
+			*cia_b_pra = ctrl;
+			*rx++ = *cia_a_prb;
+			rx_len--;
+		}
+
+		kernels->read_more(rx, rx_len);
+		return status;
+	}
+
+	for (ULONG i = 0; i < rx_len; i++)
+	{
+		ctrl ^= CLK_MASK;
+		*cia_b_pra = ctrl;
+
+		rx[i] = *cia_a_prb;
+	}
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	return status;
 }
 
-void spi_write(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
+int spi_disk_info(int unit, struct spi_disk_info *info)
+{
+	UBYTE raw[DISK_INFO_SIZE];
+
+	if (!supports(DISK_CMD))
+		return SPI_DISK_UNSUPPORTED;
+
+	int status = disk_request(unit, DISK_OP_INFO, 0, 0, NULL, 0, raw, DISK_INFO_SIZE);
+	if (status != DISK_STATUS_OK)
+		return status;
+
+	info->sectors = ((ULONG)caps_word(raw, DISK_INFO_SECTORS) << 16) | caps_word(raw, DISK_INFO_SECTORS + 2);
+	info->erases = ((ULONG)caps_word(raw, DISK_INFO_ERASES) << 16) | caps_word(raw, DISK_INFO_ERASES + 2);
+	info->type = raw[DISK_INFO_TYPE];
+	return 0;
+}
+
+// Sectors per DISK request, as many as the adapter's buffer holds.
+static ULONG disk_request_sectors()
+{
+	return caps.buffer_size >> DISK_SECTOR_SHIFT;
+}
+
+int spi_disk_read(int unit, ULONG lba, UBYTE *buf, ULONG count)
+{
+	ULONG max = disk_request_sectors();
+
+	if (!supports(DISK_CMD) || !max)
+		return SPI_DISK_UNSUPPORTED;
+
+	while (count)
+	{
+		ULONG n = count < max ? count : max;
+
+		int status = disk_request(unit, DISK_OP_READ, lba, n, NULL, 0, buf, n << DISK_SECTOR_SHIFT);
+		if (status != DISK_STATUS_OK)
+			return status;
+
+		lba += n;
+		buf += n << DISK_SECTOR_SHIFT;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int spi_disk_write(int unit, ULONG lba, const UBYTE *buf, ULONG count)
+{
+	ULONG max = disk_request_sectors();
+
+	if (!supports(DISK_CMD) || !max)
+		return SPI_DISK_UNSUPPORTED;
+
+	while (count)
+	{
+		ULONG n = count < max ? count : max;
+
+		int status = disk_request(unit, DISK_OP_WRITE, lba, n, buf, n << DISK_SECTOR_SHIFT, NULL, 0);
+		if (status != DISK_STATUS_OK)
+			return status;
+
+		lba += n;
+		buf += n << DISK_SECTOR_SHIFT;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int spi_disk_flush(int unit)
+{
+	if (!supports(DISK_CMD))
+		return SPI_DISK_UNSUPPORTED;
+
+	return disk_request(unit, DISK_OP_FLUSH, 0, 0, NULL, 0, NULL, 0);
+}
+
+// Reads the DREQ status like CARD_PRESENT. The change_isr given to
+// spi_initialize() is then called when the adapter asserts IRQ, for DREQ
+// going high if arm was set or for the card detect switch.
+int spi_dreq(int arm)
 {
-	if (current_speed == SPI_SPEED_FAST)
-		spi_write_fast(buf, size);
+	if (!supports(DREQ_CMD))
+		return SPI_DREQ_UNSUPPORTED;
+
+	*cia_a_prb = DREQ_CMD | (arm ? 1 : 0);
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return SPI_DREQ_UNSUPPORTED;
+	}
+
+	*cia_a_ddrb = 0x00;
+
+	ctrl ^= CLK_MASK;
+	*cia_b_pra = ctrl;
+
+	int status = *cia_a_prb & (DREQ_STATUS_HIGH | DREQ_STATUS_CARD_CHANGE);
+
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	*cia_a_ddrb = 0xff;
+
+	return status;
+}
+
+// One READ request of 1 <= size <= KERNEL_MAX_SIZE bytes.
+static void read_chunk(UBYTE *buf, ULONG size)
+{
+	if (!use_kernels)
+		spi_read_paced(buf, size);
+	else if (size == 512)
+		kernels->read_512(buf);
 	else
-		spi_write_slow(buf, size);
+		kernels->read(buf, size);
+}
+
+// A blind write that ended with ACT released went unanswered, so later
+// writes wait for ACT again.
+static void check_blind(ULONG ctrl)
+{
+	if (ctrl & ACT_MASK)
+	{
+		fast_path_misses++;
+		fast_path_enabled = 0;
+		use_blind = 0;
+	}
+}
+
+// One WRITE request of 1 <= size <= KERNEL_MAX_SIZE bytes.
+static void write_chunk(const UBYTE *buf, ULONG size)
+{
+	if (use_blind)
+	{
+		if (size == 512)
+			check_blind(kernels->write_512_blind(buf));
+		else if (size == 6)
+			check_blind(spi_write_6_blind(buf));
+		else
+			check_blind(kernels->write_blind(buf, size));
+	}
+	else if (!use_kernels)
+		spi_write_paced(buf, size);
+	else if (size == 512)
+		kernels->write_512(buf);
+	else if (size == 6)
+		spi_write_6(buf);
+	else
+		kernels->write(buf, size);
+}
+
+// The kernels mask the count to 13 bits, so a longer transfer, such as one
+// of 8192 bytes, is split in requests of SPLIT_SIZE bytes. The chip select
+// stays as it is in between.
+void spi_read(__reg("a0") UBYTE *buf, __reg("d0") ULONG size)
+{
+	while (size > KERNEL_MAX_SIZE)
+	{
+		read_chunk(buf, SPLIT_SIZE);
+		buf += SPLIT_SIZE;
+		size -= SPLIT_SIZE;
+	}
+
+	read_chunk(buf, size);
+}
+
+void spi_write(__reg("a0") const UBYTE *buf, __reg("d0") ULONG size)
+{
+	while (size > KERNEL_MAX_SIZE)
+	{
+		write_chunk(buf, SPLIT_SIZE);
+		buf += SPLIT_SIZE;
+		size -= SPLIT_SIZE;
+	}
+
+	write_chunk(buf, size);
+}
+
+void spi_read_sel(UBYTE *buf, ULONG size)
+{
+	transfer_cs(buf, size, 1, XFER_SELECT);
+}
+
+void spi_read_desel(UBYTE *buf, ULONG size)
+{
+	transfer_cs(buf, size, 1, XFER_DESELECT);
+}
+
+void spi_read_sel_desel(UBYTE *buf, ULONG size)
+{
+	transfer_cs(buf, size, 1, XFER_SELECT | XFER_DESELECT);
+}
+
+void spi_write_sel(const UBYTE *buf, ULONG size)
+{
+	transfer_cs((UBYTE *)buf, size, 0, XFER_SELECT);
+}
+
+void spi_write_desel(const UBYTE *buf, ULONG size)
+{
+	transfer_cs((UBYTE *)buf, size, 0, XFER_DESELECT);
+}
+
+void spi_write_sel_desel(const UBYTE *buf, ULONG size)
+{
+	transfer_cs((UBYTE *)buf, size, 0, XFER_SELECT | XFER_DESELECT);
+}
+
+int spi_fast_path(int enable)
+{
+	if (caps.req_latency_ns == 0 || caps.req_latency_ns > BLIND_MAX_LATENCY_NS)
+		return -1;
+
+	fast_path_enabled = enable;
+	select_paths();
+	return 0;
+}
+
+unsigned long spi_fast_path_misses()
+{
+	return fast_path_misses;
 }
 
 int spi_initialize(void (*change_isr)())
@@ -293,6 +1293,17 @@ int spi_initialize(void (*change_isr)())
 		goto fail_out4;
 	}
 
+	read_caps();
+
+	// The adapter may have been left talking to another device, at any
+	// speed, so every device is put back to slow.
+	for (int device = caps.devices - 1; device >= 0; device--)
+	{
+		if (caps.devices > 1)
+			send_device(device);
+		spi_set_speed(SPI_SPEED_SLOW);
+	}
+
 	AbleICR(ciaabase, CIAICRF_SETCLR | CIAICRF_FLG);
 
 	return card_present;
@@ -325,3 +1336,38 @@ void spi_shutdown()
 	FreeMiscResource(miscbase, MR_PARALLELBITS);
 	FreeMiscResource(miscbase, MR_PARALLELPORT);
 }
+
+// Sets the key the adapter encrypts the sectors of the current device with
+// in the sequencer's XTS instructions, see protocol/crypt.h, with CRYPT
+// followed by the operation and the key. A NULL key clears it.
+int spi_crypt_key(const UBYTE *key)
+{
+	if (!supports(CRYPT_CMD))
+		return SPI_CRYPT_UNSUPPORTED;
+
+	*cia_a_prb = CRYPT_CMD;
+
+	UBYTE ctrl = *cia_b_pra;
+	ctrl &= ~REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	if (!wait_until_active())
+	{
+		ctrl |= REQ_MASK;
+		*cia_b_pra = ctrl;
+		return SPI_CRYPT_UNSUPPORTED;
+	}
+
+	ctrl = send_byte(ctrl, key ? CRYPT_OP_SET_KEY : CRYPT_OP_CLEAR);
+	if (key)
+	{
+		for (int i = 0; i < CRYPT_KEY_SIZE; i++)
+			ctrl = send_byte(ctrl, key[i]);
+	}
+
+	*cia_b_pra = ctrl;                  // Delay to allow write to complete
+	ctrl |= REQ_MASK;
+	*cia_b_pra = ctrl;
+
+	return 0;
+}
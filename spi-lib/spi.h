@@ -5,16 +5,110 @@
 #ifndef SPI_H_
 #define SPI_H_
 
+#include "../protocol/caps.h"
+#include "../protocol/disk.h"
+#include "../protocol/seq.h"
+#include "../protocol/loopback.h"
+#include "../protocol/dreq.h"
+#include "../protocol/crypt.h"
+#include "../protocol/scan.h"
+
 #define SPI_SPEED_SLOW 0
 #define SPI_SPEED_FAST 1
 
+// The adapter's capability record, see protocol/caps.h. Valid after
+// spi_initialize(); an adapter without GET_CAPS has firmware_id
+// CAPS_FIRMWARE_LEGACY.
+struct spi_caps
+{
+	unsigned char firmware_id;
+	unsigned short firmware_version;
+	unsigned short spi_fast_khz;
+	unsigned short spi_slow_khz;
+	unsigned long control_cmds;
+	unsigned short max_transfer;
+	unsigned short buffer_size;
+	unsigned short features;
+	unsigned char seq_slots;
+	unsigned short seq_slot_size;
+	unsigned char devices;		// SPI devices with a chip select each, at least 1
+	unsigned short req_latency_ns;	// Most ns the adapter takes to see REQ in fast mode, 0 if unbounded
+};
+
+// Errors from spi_seq_load() and spi_seq_run(); other values are the
+// status of the program (SEQ_STATUS_OK, SEQ_FAIL or SEQ_STATUS_...).
+#define SPI_SEQ_UNSUPPORTED	(-1)
+#define SPI_SEQ_TIMEOUT		(-2)
+
+// Counters of the adapter's loopback mode, see protocol/loopback.h.
+struct spi_loopback_status
+{
+	unsigned long sum;
+	unsigned long written;
+	unsigned long read;
+	unsigned long stalls;
+};
+
+// Result of spi_self_test().
+struct spi_self_test
+{
+	unsigned long bytes;		// bytes read and bytes written
+	unsigned long errors;		// bytes read that differed from the pattern
+	unsigned long stalls;		// bytes the adapter was late for
+	int sum_ok;					// the adapter's checksum of the writes matched
+};
+
+// Errors from spi_loopback(), spi_loopback_status() and spi_self_test().
+#define SPI_LOOPBACK_UNSUPPORTED	(-1)
+
+// A block device kept by the adapter, see protocol/disk.h.
+struct spi_disk_info
+{
+	unsigned long sectors;
+	unsigned long erases;
+	unsigned char type;			// DISK_TYPE_...
+};
+
+// Errors from the spi_disk_ functions; other values are a DISK_STATUS_.
+#define SPI_DISK_UNSUPPORTED	(-1)
+#define SPI_DISK_TIMEOUT		(-2)
+
+// Error from spi_dreq(); other values are DREQ_STATUS_ bits.
+#define SPI_DREQ_UNSUPPORTED	(-1)
+
+// Error from spi_crypt_key().
+#define SPI_CRYPT_UNSUPPORTED	(-1)
+
 int spi_initialize(void (*change_isr)());
 int spi_get_card_present();
 void spi_shutdown();
+const struct spi_caps *spi_get_caps();
 void spi_set_speed(long speed);
+int spi_select_device(int device);
 void spi_select();
 void spi_deselect();
 void spi_read(__reg("a0") unsigned char *buf, __reg("d0") unsigned long size);
 void spi_write(__reg("a0") const unsigned char *buf, __reg("d0") unsigned long size);
+void spi_read_sel(unsigned char *buf, unsigned long size);
+void spi_read_desel(unsigned char *buf, unsigned long size);
+void spi_read_sel_desel(unsigned char *buf, unsigned long size);
+void spi_write_sel(const unsigned char *buf, unsigned long size);
+void spi_write_desel(const unsigned char *buf, unsigned long size);
+void spi_write_sel_desel(const unsigned char *buf, unsigned long size);
+int spi_fast_path(int enable);
+unsigned long spi_fast_path_misses();
+int spi_exchange(const unsigned char *tx, unsigned char *rx, unsigned long size);
+int spi_seq_load(int slot, const unsigned char *program, unsigned long length);
+int spi_seq_run(int slot, const unsigned char *args, int argc, const unsigned char *in, unsigned long in_len,
+		unsigned char *out, unsigned long out_size, unsigned long *out_len);
+int spi_loopback(int enable);
+int spi_loopback_status(struct spi_loopback_status *status);
+int spi_self_test(unsigned char *buf, unsigned long size, unsigned long rounds, struct spi_self_test *result);
+int spi_disk_info(int unit, struct spi_disk_info *info);
+int spi_disk_read(int unit, unsigned long lba, unsigned char *buf, unsigned long count);
+int spi_disk_write(int unit, unsigned long lba, const unsigned char *buf, unsigned long count);
+int spi_disk_flush(int unit);
+int spi_dreq(int arm);
+int spi_crypt_key(const unsigned char *key);
 
 #endif
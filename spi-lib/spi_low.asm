@@ -1,8 +1,26 @@
 ; Written in the end of April 2020 by Niklas Ekström.
 ; Updated in July 2021 by Niklas Ekström to handle Card Present signal.
-
-        XDEF        _spi_read_fast
-        XDEF        _spi_write_fast
+; Updated in October 2026 with CPU specific kernels and fixed size paths.
+; Updated in October 2026 with writes that don't wait for ACT.
+
+        XDEF        _spi_read_fast_000
+        XDEF        _spi_write_fast_000
+        XDEF        _spi_read_fast_020
+        XDEF        _spi_write_fast_020
+        XDEF        _spi_read_512_000
+        XDEF        _spi_write_512_000
+        XDEF        _spi_read_512_020
+        XDEF        _spi_write_512_020
+        XDEF        _spi_write_6
+        XDEF        _spi_write_fast_000_blind
+        XDEF        _spi_write_fast_020_blind
+        XDEF        _spi_write_512_000_blind
+        XDEF        _spi_write_512_020_blind
+        XDEF        _spi_write_6_blind
+        XDEF        _spi_read_more_000
+        XDEF        _spi_read_more_020
+        XDEF        _spi_write_more_000
+        XDEF        _spi_write_more_020
         CODE
 
 CIAB_PRTRSEL	equ	(2)
@@ -21,25 +39,109 @@ REQ_BIT         equ     CIAB_PRTRSEL
 CLK_BIT         equ     CIAB_PRTRPOUT
 ACT_BIT         equ     CIAB_PRTRBUSY
 
-                ; a0 = unsigned char *buf
-                ; d0 = unsigned int size
-                ; assert: 1 <= size < 2^13 (three top bits are zeros)
+; Every byte costs two CIA accesses, one to the data port and one to toggle
+; CLK, and a CIA access takes one E-cycle. The kernels differ in what they
+; do between the accesses. On a 68000 a dbra in between is enough to miss
+; an E-cycle, so its loops are unrolled 16 times. A 68020 or later has the
+; time, but its buffer is often in chip RAM, so those loops move the buffer
+; a longword at a time to take fewer chip bus slots.
+;
+; The loops toggle CLK by writing d1 and d2 alternately, one of them holding
+; the current level of the control port and the other the toggled level.
+
+; WRITE_BYTE reg: put the next buffer byte on the data port and toggle CLK.
+WRITE_BYTE      MACRO
+                move.b  (a0)+,(a1)
+                move.b  \1,(a5)
+                ENDM
 
-_spi_write_fast:
-                and     #$1fff,d0
-                bne.b   .not_zero
-                rts
-.not_zero:
-                movem.l d2/a5,-(a7)
+; READ_BYTE reg: toggle CLK and read the byte the adapter put on the port.
+READ_BYTE       MACRO
+                move.b  \1,(a5)
+                move.b  (a1),(a0)+
+                ENDM
+
+; WRITE_LONG: four bytes from one longword read of the buffer.
+WRITE_LONG      MACRO
+                move.l  (a0)+,d3
+                rol.l   #8,d3
+                move.b  d3,(a1)
+                move.b  d1,(a5)
+                rol.l   #8,d3
+                move.b  d3,(a1)
+                move.b  d2,(a5)
+                rol.l   #8,d3
+                move.b  d3,(a1)
+                move.b  d1,(a5)
+                rol.l   #8,d3
+                move.b  d3,(a1)
+                move.b  d2,(a5)
+                ENDM
+
+; READ_LONG: four bytes stored with one longword write to the buffer.
+READ_LONG       MACRO
+                move.b  d1,(a5)
+                move.b  (a1),d3
+                lsl.l   #8,d3
+                move.b  d2,(a5)
+                move.b  (a1),d3
+                lsl.l   #8,d3
+                move.b  d1,(a5)
+                move.b  (a1),d3
+                lsl.l   #8,d3
+                move.b  d2,(a5)
+                move.b  (a1),d3
+                move.l  d3,(a0)+
+                ENDM
 
+; Set up a1/a5 and load the control port into d2.
+ENTER           MACRO
+                movem.l d2-d3/a5,-(a7)
                 lea.l   CIAA_BASE+CIAPRB,a1     ; Data
                 lea.l   CIAB_BASE+CIAPRA,a5     ; Control pins
-
                 move.b  (a5),d2
+                ENDM
 
-                subq    #1,d0                   ; d0 = size - 1
+; Release REQ and return.
+LEAVE_WRITE     MACRO
+                move.b	d2,(a5)                 ; Delay to allow write to complete
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+                movem.l (a7)+,d2-d3/a5
+                rts
+                ENDM
 
-                cmp     #63,d0
+; Release REQ and return the control port in d0, for the caller to check
+; that ACT is asserted. The read takes the place of LEAVE_WRITE's delay.
+LEAVE_WRITE_CHECK MACRO
+                moveq   #0,d0
+                move.b  (a5),d0
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+                movem.l (a7)+,d2-d3/a5
+                rts
+                ENDM
+
+; Return with REQ still asserted, for the caller to continue the request.
+LEAVE_MORE      MACRO
+                movem.l (a7)+,d2-d3/a5
+                rts
+                ENDM
+
+LEAVE_READ      MACRO
+                bset    #REQ_BIT,d2
+                move.b  d2,(a5)
+                move.b  #$ff,$200(a1)           ; Start driving data pins
+                movem.l (a7)+,d2-d3/a5
+                rts
+                ENDM
+
+; Send the command for a transfer of d0 + 1 bytes, and wait for ACT.
+
+                ; d0 = size - 1, d2 = control port
+                ; returns d2 = control port, CLK at its current level
+
+write_cmd:      cmp     #63,d0
                 ble.b   .one_byte_cmd
 
                 ; WRITE2 = 10xxxxxx 0xxxxxxx
@@ -59,7 +161,7 @@ _spi_write_fast:
                 move.b  d1,(a1)
                 bchg    #CLK_BIT,d2
                 move.b  d2,(a5)
-                bra.b   .cmd_sent
+                rts
 
 .one_byte_cmd:  ; WRITE1 = 00xxxxxx
                 move.b  d0,(a1)
@@ -69,55 +171,39 @@ _spi_write_fast:
 .act_wait1:     move.b  (a5),d2
                 btst    #ACT_BIT,d2
                 bne.b   .act_wait1
+                rts
 
-.cmd_sent:      addq    #1,d0                   ; d0 = size
-
-                btst    #0,d0
-                beq.b   .even
-
-                move.b  (a0)+,(a1)
-                bchg    #CLK_BIT,d2
-                move.b  d2,(a5)
-
-.even:          lsr     #1,d0
-                beq.b   .done
-                subq    #1,d0
+; As write_cmd, but without waiting for ACT. Only for an adapter that takes
+; the command within an E-cycle of REQ, the time until the data port next
+; changes.
 
-                move.b  d2,d1
-                bchg    #CLK_BIT,d1
+write_cmd_blind:
+                cmp     #63,d0
+                ble.b   .one_byte_cmd
 
-.loop:          move.b  (a0)+,(a1)
-                move.b  d1,(a5)
-                move.b  (a0)+,(a1)
+                move    d0,d1
+                lsr     #7,d1
+                or.b    #$80,d1
+                move.b  d1,(a1)
+                bclr    #REQ_BIT,d2
                 move.b  d2,(a5)
-                dbra    d0,.loop
 
-.done:          move.b	d2,(a5)                 ; Delay to allow write to complete
-                bset    #REQ_BIT,d2
+                move.b  d0,d1
+                and.b   #$7f,d1
+                move.b  d1,(a1)
+                bchg    #CLK_BIT,d2
                 move.b  d2,(a5)
-
-                movem.l (a7)+,d2/a5
                 rts
 
-                ; a0 = unsigned char *buf
-                ; d0 = unsigned int size
-                ; assert: 1 <= size < 2^13 (three top bits are zeros)
-
-_spi_read_fast:
-                and     #$1fff,d0
-                bne.b   .not_zero
+.one_byte_cmd:  move.b  d0,(a1)
+                bclr    #REQ_BIT,d2
+                move.b  d2,(a5)
                 rts
-.not_zero:
-                movem.l d2/a5,-(a7)
 
-                lea.l   CIAA_BASE+CIAPRB,a1      ; Data
-                lea.l   CIAB_BASE+CIAPRA,a5      ; Control pins
+                ; d0 = size - 1, d2 = control port
+                ; returns d2 = control port, data port set to input
 
-                move.b  (a5),d2
-
-                subq    #1,d0                   ; d0 = size - 1
-
-                cmp     #63,d0
+read_cmd:       cmp     #63,d0
                 ble.b   .one_byte_cmd
 
                 ; READ2 = 10xxxxxx 1xxxxxxx
@@ -151,33 +237,309 @@ _spi_read_fast:
                 bne.b   .act_wait1
 
 .cmd_sent:      move.b  #0,$200(a1)             ; Stop driving data pins
+                rts
+
+; Every write comes in two versions, one with write_cmd and LEAVE_WRITE
+; and a _blind one with write_cmd_blind and LEAVE_WRITE_CHECK. The macros
+; take the routine that sends the command and the macro that leaves.
+
+; WRITE_FAST body, cmd, leave: a write of d0 bytes. A size of 0 returns
+; d0 = 0, which reads as ACT asserted.
+WRITE_FAST      MACRO
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     \2
+                addq    #1,d0                   ; d0 = size
+                bsr     \1
+                \3
+                ENDM
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; assert: 1 <= size < 2^13 (three top bits are zeros)
+
+_spi_write_fast_000:
+                WRITE_FAST write_body_000,write_cmd,LEAVE_WRITE
+
+                ; As above, but returns d0 = control port at the end.
+
+_spi_write_fast_000_blind:
+                WRITE_FAST write_body_000,write_cmd_blind,LEAVE_WRITE_CHECK
+
+                ; a0 = const unsigned char *buf
+                ; d0 = unsigned int size
+                ; Writes more bytes in a request the caller started, and
+                ; leaves REQ asserted.
+
+_spi_write_more_000:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+                bsr.b   write_body_000
+                LEAVE_MORE
 
+                ; Enter the unrolled loop at the slot that leaves size
+                ; bytes, swapping d1 and d2 when that slot writes d2.
+                ; The last byte is always written with d2.
+
+write_body_000: move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+                move    d0,d3
+                neg     d3
+                and     #15,d3
+                btst    #0,d3
+                beq.b   .even_slot
+                exg     d1,d2
+.even_slot:
+                add     #15,d0
+                lsr     #4,d0
+                subq    #1,d0
+                add     d3,d3
+                add     d3,d3
+                jmp     .loop(pc,d3.w)
+
+.loop:          REPT    8
+                WRITE_BYTE d1
+                WRITE_BYTE d2
+                ENDR
+                dbra    d0,.loop
+                rts
+
+_spi_read_fast_000:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     read_cmd
                 addq    #1,d0                   ; d0 = size
+                bra.b   read_body_000
+
+                ; a0 = unsigned char *buf
+                ; d0 = unsigned int size
+                ; Reads the rest of a request the caller started: REQ is
+                ; asserted and the data port is already an input.
 
-                btst    #0,d0
-                beq.b   .even
+_spi_read_more_000:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+
+read_body_000:  move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+                move    d0,d3
+                neg     d3
+                and     #15,d3
+                btst    #0,d3
+                beq.b   .even_slot
+                exg     d1,d2
+.even_slot:
+                add     #15,d0
+                lsr     #4,d0
+                subq    #1,d0
+                add     d3,d3
+                add     d3,d3
+                jmp     .loop(pc,d3.w)
+
+.loop:          REPT    8
+                READ_BYTE d1
+                READ_BYTE d2
+                ENDR
+                dbra    d0,.loop
 
+                LEAVE_READ
+
+_spi_write_fast_020:
+                WRITE_FAST write_body_020,write_cmd,LEAVE_WRITE
+
+_spi_write_fast_020_blind:
+                WRITE_FAST write_body_020,write_cmd_blind,LEAVE_WRITE_CHECK
+
+_spi_write_more_020:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+                bsr.b   write_body_020
+                LEAVE_MORE
+
+                ; Bytes that don't make up a whole longword go first.
+
+write_body_020: move    d0,d3
+                and     #3,d3
+                beq.b   .longs
+                subq    #1,d3
+.lead:          move.b  (a0)+,(a1)
                 bchg    #CLK_BIT,d2
                 move.b  d2,(a5)
-                move.b  (a1),(a0)+
+                dbra    d3,.lead
 
-.even:          lsr     #1,d0
+.longs:         lsr     #2,d0
                 beq.b   .done
                 subq    #1,d0
 
                 move.b  d2,d1
                 bchg    #CLK_BIT,d1
 
-.loop:          move.b  d1,(a5)
-                move.b  (a1),(a0)+
+.loop:          WRITE_LONG
+                dbra    d0,.loop
+
+.done:          rts
+
+_spi_read_fast_020:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+                subq    #1,d0                   ; d0 = size - 1
+                bsr     read_cmd
+                addq    #1,d0                   ; d0 = size
+                bra.b   read_body_020
+
+_spi_read_more_020:
+                and     #$1fff,d0
+                bne.b   .not_zero
+                rts
+.not_zero:
+                ENTER
+
+read_body_020:  move    d0,d3
+                and     #3,d3
+                beq.b   .longs
+                subq    #1,d3
+.lead:          bchg    #CLK_BIT,d2
                 move.b  d2,(a5)
                 move.b  (a1),(a0)+
+                dbra    d3,.lead
+
+.longs:         lsr     #2,d0
+                beq.b   .done
+                subq    #1,d0
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+.loop:          READ_LONG
                 dbra    d0,.loop
 
-.done:          bset    #REQ_BIT,d2
-                move.b  d2,(a5)
+.done:          LEAVE_READ
 
-                move.b  #$ff,$200(a1)             ; Start driving data pins
+; Fixed size paths. The command bytes and loop counts are constants, and
+; there is no remainder to take care of.
 
-                movem.l (a7)+,d2/a5
-                rts
+WRITE_512_000   MACRO
+                ENTER
+                move    #511,d0
+                bsr     \1
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+                moveq   #512/16-1,d0
+
+.loop:          REPT    8
+                WRITE_BYTE d1
+                WRITE_BYTE d2
+                ENDR
+                dbra    d0,.loop
+
+                \2
+                ENDM
+
+WRITE_512_020   MACRO
+                ENTER
+                move    #511,d0
+                bsr     \1
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+                moveq   #512/8-1,d0
+
+.loop:          WRITE_LONG
+                WRITE_LONG
+                dbra    d0,.loop
+
+                \2
+                ENDM
+
+WRITE_6         MACRO
+                ENTER
+                moveq   #5,d0
+                bsr     \1
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+
+                REPT    3
+                WRITE_BYTE d1
+                WRITE_BYTE d2
+                ENDR
+
+                \2
+                ENDM
+
+                ; a0 = unsigned char *buf, 512 bytes
+
+_spi_write_512_000:
+                WRITE_512_000 write_cmd,LEAVE_WRITE
+
+_spi_write_512_000_blind:
+                WRITE_512_000 write_cmd_blind,LEAVE_WRITE_CHECK
+
+_spi_read_512_000:
+                ENTER
+                move    #511,d0
+                bsr     read_cmd
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+                moveq   #512/16-1,d0
+
+.loop:          REPT    8
+                READ_BYTE d1
+                READ_BYTE d2
+                ENDR
+                dbra    d0,.loop
+
+                LEAVE_READ
+
+_spi_write_512_020:
+                WRITE_512_020 write_cmd,LEAVE_WRITE
+
+_spi_write_512_020_blind:
+                WRITE_512_020 write_cmd_blind,LEAVE_WRITE_CHECK
+
+_spi_read_512_020:
+                ENTER
+                move    #511,d0
+                bsr     read_cmd
+
+                move.b  d2,d1
+                bchg    #CLK_BIT,d1
+                moveq   #512/8-1,d0
+
+.loop:          READ_LONG
+                READ_LONG
+                dbra    d0,.loop
+
+                LEAVE_READ
+
+                ; a0 = unsigned char *buf, 6 bytes (an SD card command)
+
+_spi_write_6:
+                WRITE_6 write_cmd,LEAVE_WRITE
+
+_spi_write_6_blind:
+                WRITE_6 write_cmd_blind,LEAVE_WRITE_CHECK